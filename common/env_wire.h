@@ -0,0 +1,297 @@
+/*
+* Wire format shared by sensor/ and gateway/. All records are packed and
+* little-endian; the structs only document the layout and are never
+* copied to or from the air as a whole, the encoders and decoders below
+* go byte by byte so padding and host byte order cannot leak in.
+*/
+#ifndef ENV_WIRE_H
+#define ENV_WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Bumped on any change of the layouts below
+#define ENV_WIRE_VERSION 1
+
+// Sample history characteristic in the ESS service,
+// vendor UUID 8f1d0001-4a4b-4e8c-9b7a-3c2d1e0fa5b6, for BLE_UUID128_INIT()
+#define ENV_WIRE_BACKLOG_UUID128 0xb6, 0xa5, 0x0f, 0x1e, 0x2d, 0x3c, 0x7a, 0x9b, \
+                                 0x8c, 0x4e, 0x4b, 0x4a, 0x01, 0x00, 0x1d, 0x8f
+
+// Longest backlog value, read with one long read
+#define ENV_WIRE_BATCH_MAX_LEN 512
+
+// Advertising SID of the periodic advertising train, the gateway syncs to it
+// by address and SID
+#define ENV_WIRE_PADV_SID 1
+
+/**One sample: both readings of one conversion */
+typedef struct env_wire_sample_t {
+    uint32_t timestamp;            // Sensor uptime in ms
+    int16_t temperature;           // Celsius x100
+    uint16_t humidity;             // Percent x100
+} env_wire_sample_t;
+
+/**Characteristic value and notification of one reading */
+typedef struct __attribute__((packed)) env_wire_reading_t {
+    uint8_t version;
+    uint32_t seq;                  // Sample sequence number
+    uint32_t timestamp;            // Sensor uptime in ms
+    int16_t value;                 // Reading x100
+} env_wire_reading_t;
+
+/**ESS service data of the advertisement, after the 16-bit service UUID */
+typedef struct __attribute__((packed)) env_wire_adv_t {
+    uint8_t version;
+    int16_t temperature;
+    uint16_t humidity;
+    uint32_t timestamp;
+} env_wire_adv_t;
+
+/**ESS service data of the periodic advertising train, one per sample */
+typedef struct __attribute__((packed)) env_wire_padv_t {
+    uint8_t version;
+    uint32_t seq;                  // Sample sequence number, gaps are missed samples
+    uint32_t timestamp;            // Sensor uptime in ms
+    int16_t temperature;           // Celsius x100
+    uint16_t humidity;             // Percent x100
+} env_wire_padv_t;
+
+/**
+* Backlog batch: the first sample in full, then one delta record per
+* following sample. Consecutive sequence numbers from first_seq on.
+*/
+typedef struct __attribute__((packed)) env_wire_batch_hdr_t {
+    uint8_t version;
+    uint8_t count;                 // Samples in the batch, base included
+    uint32_t first_seq;            // Sequence number of the base sample
+    uint32_t next_seq;             // Sequence number of the next sample taken
+    uint32_t timestamp;            // Base sample
+    int16_t temperature;
+    uint16_t humidity;
+} env_wire_batch_hdr_t;
+
+typedef struct __attribute__((packed)) env_wire_delta_t {
+    uint16_t dt_ms;                // Time since the previous sample
+    int8_t temperature;            // Change since the previous sample, x100
+    int8_t humidity;
+} env_wire_delta_t;
+
+#define ENV_WIRE_READING_LEN   sizeof(env_wire_reading_t)
+#define ENV_WIRE_ADV_LEN       sizeof(env_wire_adv_t)
+#define ENV_WIRE_PADV_LEN      sizeof(env_wire_padv_t)
+#define ENV_WIRE_BATCH_HDR_LEN sizeof(env_wire_batch_hdr_t)
+#define ENV_WIRE_DELTA_LEN     sizeof(env_wire_delta_t)
+
+// Most samples in one batch
+#define ENV_WIRE_BATCH_MAX_SAMPLES \
+    (1 + (ENV_WIRE_BATCH_MAX_LEN - ENV_WIRE_BATCH_HDR_LEN) / ENV_WIRE_DELTA_LEN)
+
+_Static_assert(ENV_WIRE_READING_LEN == 11, "reading record layout changed");
+_Static_assert(ENV_WIRE_ADV_LEN == 9, "advertisement layout changed");
+_Static_assert(ENV_WIRE_PADV_LEN == 13, "periodic advertisement layout changed");
+_Static_assert(ENV_WIRE_BATCH_HDR_LEN == 18, "batch header layout changed");
+_Static_assert(ENV_WIRE_DELTA_LEN == 4, "delta record layout changed");
+_Static_assert(ENV_WIRE_BATCH_MAX_SAMPLES <= UINT8_MAX, "batch count is 8 bit");
+
+#define ENV_WIRE_AT(type, field) offsetof(type, field)
+
+static inline void env_wire_put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static inline void env_wire_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = v >> 24;
+}
+
+static inline uint16_t env_wire_get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t env_wire_get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Single reading */
+
+static inline size_t env_wire_reading_encode(uint8_t *buf, uint32_t seq,
+                                             uint32_t timestamp, int16_t value)
+{
+    buf[ENV_WIRE_AT(env_wire_reading_t, version)] = ENV_WIRE_VERSION;
+    env_wire_put32(&buf[ENV_WIRE_AT(env_wire_reading_t, seq)], seq);
+    env_wire_put32(&buf[ENV_WIRE_AT(env_wire_reading_t, timestamp)], timestamp);
+    env_wire_put16(&buf[ENV_WIRE_AT(env_wire_reading_t, value)], value);
+    return ENV_WIRE_READING_LEN;
+}
+
+/*
+* returns: 0 on success, -1 if the record is short or of another version.
+*/
+static inline int env_wire_reading_decode(const uint8_t *buf, size_t len,
+                                          uint32_t *seq, uint32_t *timestamp,
+                                          int16_t *value)
+{
+    if (len < ENV_WIRE_READING_LEN || buf[0] != ENV_WIRE_VERSION) return -1;
+
+    *seq = env_wire_get32(&buf[ENV_WIRE_AT(env_wire_reading_t, seq)]);
+    *timestamp = env_wire_get32(&buf[ENV_WIRE_AT(env_wire_reading_t, timestamp)]);
+    *value = env_wire_get16(&buf[ENV_WIRE_AT(env_wire_reading_t, value)]);
+    return 0;
+}
+
+/* Advertisement */
+
+static inline size_t env_wire_adv_encode(uint8_t *buf, const env_wire_sample_t *s)
+{
+    buf[ENV_WIRE_AT(env_wire_adv_t, version)] = ENV_WIRE_VERSION;
+    env_wire_put16(&buf[ENV_WIRE_AT(env_wire_adv_t, temperature)], s->temperature);
+    env_wire_put16(&buf[ENV_WIRE_AT(env_wire_adv_t, humidity)], s->humidity);
+    env_wire_put32(&buf[ENV_WIRE_AT(env_wire_adv_t, timestamp)], s->timestamp);
+    return ENV_WIRE_ADV_LEN;
+}
+
+static inline int env_wire_adv_decode(const uint8_t *buf, size_t len, env_wire_sample_t *s)
+{
+    if (len < ENV_WIRE_ADV_LEN || buf[0] != ENV_WIRE_VERSION) return -1;
+
+    s->temperature = env_wire_get16(&buf[ENV_WIRE_AT(env_wire_adv_t, temperature)]);
+    s->humidity = env_wire_get16(&buf[ENV_WIRE_AT(env_wire_adv_t, humidity)]);
+    s->timestamp = env_wire_get32(&buf[ENV_WIRE_AT(env_wire_adv_t, timestamp)]);
+    return 0;
+}
+
+/* Periodic advertisement */
+
+static inline size_t env_wire_padv_encode(uint8_t *buf, uint32_t seq,
+                                          const env_wire_sample_t *s)
+{
+    buf[ENV_WIRE_AT(env_wire_padv_t, version)] = ENV_WIRE_VERSION;
+    env_wire_put32(&buf[ENV_WIRE_AT(env_wire_padv_t, seq)], seq);
+    env_wire_put32(&buf[ENV_WIRE_AT(env_wire_padv_t, timestamp)], s->timestamp);
+    env_wire_put16(&buf[ENV_WIRE_AT(env_wire_padv_t, temperature)], s->temperature);
+    env_wire_put16(&buf[ENV_WIRE_AT(env_wire_padv_t, humidity)], s->humidity);
+    return ENV_WIRE_PADV_LEN;
+}
+
+static inline int env_wire_padv_decode(const uint8_t *buf, size_t len, uint32_t *seq,
+                                       env_wire_sample_t *s)
+{
+    if (len < ENV_WIRE_PADV_LEN || buf[0] != ENV_WIRE_VERSION) return -1;
+
+    *seq = env_wire_get32(&buf[ENV_WIRE_AT(env_wire_padv_t, seq)]);
+    s->timestamp = env_wire_get32(&buf[ENV_WIRE_AT(env_wire_padv_t, timestamp)]);
+    s->temperature = env_wire_get16(&buf[ENV_WIRE_AT(env_wire_padv_t, temperature)]);
+    s->humidity = env_wire_get16(&buf[ENV_WIRE_AT(env_wire_padv_t, humidity)]);
+    return 0;
+}
+
+/* Backlog batch */
+
+/*
+* Encode consecutive samples from first_seq on into buf. The batch ends
+* early at a sample whose change does not fit a delta record; the next
+* batch starts with it as its base.
+* returns: length of the batch, *count is set to the samples taken.
+*/
+static inline size_t env_wire_batch_encode(uint8_t *buf, size_t size,
+                                           const env_wire_sample_t *samples, unsigned n,
+                                           uint32_t first_seq, uint32_t next_seq,
+                                           unsigned *count)
+{
+    *count = 0;
+    if (size < ENV_WIRE_BATCH_HDR_LEN) return 0;
+
+    buf[ENV_WIRE_AT(env_wire_batch_hdr_t, version)] = ENV_WIRE_VERSION;
+    env_wire_put32(&buf[ENV_WIRE_AT(env_wire_batch_hdr_t, first_seq)], first_seq);
+    env_wire_put32(&buf[ENV_WIRE_AT(env_wire_batch_hdr_t, next_seq)], next_seq);
+    size_t len = ENV_WIRE_BATCH_HDR_LEN;
+
+    // Base sample, zero in an empty batch
+    env_wire_sample_t base = n > 0 ? samples[0] : (env_wire_sample_t){ 0 };
+    env_wire_put32(&buf[ENV_WIRE_AT(env_wire_batch_hdr_t, timestamp)], base.timestamp);
+    env_wire_put16(&buf[ENV_WIRE_AT(env_wire_batch_hdr_t, temperature)], base.temperature);
+    env_wire_put16(&buf[ENV_WIRE_AT(env_wire_batch_hdr_t, humidity)], base.humidity);
+
+    unsigned i = n > 0 ? 1 : 0;
+
+    for (; i < n && i < ENV_WIRE_BATCH_MAX_SAMPLES && len + ENV_WIRE_DELTA_LEN <= size; i++) {
+        uint32_t dt = samples[i].timestamp - samples[i - 1].timestamp;
+        int32_t dtemp = samples[i].temperature - samples[i - 1].temperature;
+        int32_t dhum = samples[i].humidity - samples[i - 1].humidity;
+        if (dt > UINT16_MAX || dtemp < INT8_MIN || dtemp > INT8_MAX ||
+            dhum < INT8_MIN || dhum > INT8_MAX) {
+            break;
+        }
+        env_wire_put16(&buf[len], dt);
+        buf[len + 2] = (uint8_t)(int8_t)dtemp;
+        buf[len + 3] = (uint8_t)(int8_t)dhum;
+        len += ENV_WIRE_DELTA_LEN;
+    }
+
+    buf[ENV_WIRE_AT(env_wire_batch_hdr_t, count)] = i;
+    *count = i;
+    return len;
+}
+
+/**Decoder state of a batch, samples come out in order */
+typedef struct env_wire_batch_iter_t {
+    const uint8_t *delta;          // Delta record of the sample after next
+    unsigned left;                 // Samples not returned yet
+    uint32_t seq;                  // Sequence number of the next sample
+    env_wire_sample_t sample;      // Next sample
+} env_wire_batch_iter_t;
+
+/*
+* Check a batch and read its header. The count is clamped to the records
+* actually received, so a truncated batch is never read past its end.
+* returns: 0 on success, -1 if the batch is short or of another version.
+*/
+static inline int env_wire_batch_begin(env_wire_batch_iter_t *it, const uint8_t *buf,
+                                       size_t len, uint32_t *first_seq, uint32_t *next_seq)
+{
+    if (len < ENV_WIRE_BATCH_HDR_LEN || buf[0] != ENV_WIRE_VERSION) return -1;
+
+    *first_seq = env_wire_get32(&buf[ENV_WIRE_AT(env_wire_batch_hdr_t, first_seq)]);
+    *next_seq = env_wire_get32(&buf[ENV_WIRE_AT(env_wire_batch_hdr_t, next_seq)]);
+
+    unsigned count = buf[ENV_WIRE_AT(env_wire_batch_hdr_t, count)];
+    unsigned received = 1 + (len - ENV_WIRE_BATCH_HDR_LEN) / ENV_WIRE_DELTA_LEN;
+    it->left = count < received ? count : received;
+    it->seq = *first_seq;
+    it->delta = &buf[ENV_WIRE_BATCH_HDR_LEN];
+    it->sample.timestamp = env_wire_get32(&buf[ENV_WIRE_AT(env_wire_batch_hdr_t, timestamp)]);
+    it->sample.temperature = env_wire_get16(&buf[ENV_WIRE_AT(env_wire_batch_hdr_t, temperature)]);
+    it->sample.humidity = env_wire_get16(&buf[ENV_WIRE_AT(env_wire_batch_hdr_t, humidity)]);
+    return 0;
+}
+
+/*
+* returns: true and the next sample with its sequence number, false once
+* the batch is exhausted.
+*/
+static inline bool env_wire_batch_next(env_wire_batch_iter_t *it, uint32_t *seq,
+                                       env_wire_sample_t *sample)
+{
+    if (it->left == 0) return false;
+
+    *seq = it->seq++;
+    *sample = it->sample;
+    if (--it->left > 0) {
+        it->sample.timestamp += env_wire_get16(it->delta);
+        it->sample.temperature += (int8_t)it->delta[2];
+        it->sample.humidity += (int8_t)it->delta[3];
+        it->delta += ENV_WIRE_DELTA_LEN;
+    }
+    return true;
+}
+
+#endif /* ENV_WIRE_H */
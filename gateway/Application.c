@@ -5,8 +5,20 @@
 #include <string.h>
 
 #include "shell.h"
+#include "mutex.h"
+#include "sema.h"
+#include "thread.h"
 #include "application.h"
 
+// Responses waiting to be printed, a ring filled by response_print_post()
+static sensor_response_t print_queue[RESPONSE_PRINT_QUEUE];
+static unsigned print_head;             // Oldest queued response
+static unsigned print_count;
+static uint32_t print_dropped;          // Lost to a full queue since the last print
+static mutex_t print_lock = MUTEX_INIT;
+static sema_t print_ready;
+static char print_stack[THREAD_STACKSIZE_DEFAULT];
+
 // Print sensor response in formatted way
 void print_sensor_response(const sensor_response_t *response) {
     printf("\n=== Sensor Query Response ===\n");
@@ -17,9 +29,63 @@ void print_sensor_response(const sensor_response_t *response) {
         printf("Status: SUCCESS\n");
         printf("Value: %.1f %s\n", response->value, response->unit);
         printf("Timestamp: %lu\n", response->timestamp);
+        printf("Connect-to-Read Latency: %lu ms\n", response->read_latency_ms);
     } else {
         printf("Status: ERROR\n");
         printf("Error: %s\n", response->error_message);
     }
     printf("============================\n");
-}
\ No newline at end of file
+}
+
+/*
+*Queue a response for the printer thread. Called from the NimBLE host task,
+*which must not wait on the console. The response is dropped if the queue is
+*full, the count of dropped ones is printed with the next response.
+*/
+void response_print_post(const sensor_response_t *response)
+{
+    mutex_lock(&print_lock);
+    if (print_count == RESPONSE_PRINT_QUEUE) {
+        print_dropped++;
+        mutex_unlock(&print_lock);
+        return;
+    }
+    print_queue[(print_head + print_count++) % RESPONSE_PRINT_QUEUE] = *response;
+    mutex_unlock(&print_lock);
+    sema_post(&print_ready);
+}
+
+static void *print_thread(void *arg)
+{
+    (void)arg;
+    sensor_response_t response;
+
+    while (1) {
+        sema_wait(&print_ready);
+
+        mutex_lock(&print_lock);
+        response = print_queue[print_head];
+        print_head = (print_head + 1) % RESPONSE_PRINT_QUEUE;
+        print_count--;
+        uint32_t dropped = print_dropped;
+        print_dropped = 0;
+        mutex_unlock(&print_lock);
+
+        if (dropped) {
+            printf("[WARN] %lu responses not printed, queue full\n", (unsigned long)dropped);
+        }
+        print_sensor_response(&response);
+    }
+    return NULL;
+}
+
+/*
+*Start the thread printing published responses, below the shell so a
+*response never interrupts a command half way.
+*/
+void response_print_init(void)
+{
+    sema_create(&print_ready, 0);
+    thread_create(print_stack, sizeof(print_stack), THREAD_PRIORITY_MAIN + 1,
+                  THREAD_CREATE_STACKTEST, print_thread, NULL, "resp_print");
+}
@@ -0,0 +1,67 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "host/ble_hs_adv.h"
+#include "adv_filter.h"
+
+/*
+* Walk the raw AD structures once, without copying or parsing them into a
+* struct. Only UUID16 lists and manufacturer data are looked at.
+* returns: bitmask of the filter uuids found, 0 if the packet is rejected.
+*/
+uint8_t adv_filter_match(const adv_filter_t *f, const uint8_t *ad, size_t ad_len)
+{
+    const uint8_t *p = ad;
+    const uint8_t *end = ad + ad_len;
+    uint8_t found = 0;
+    int mfg_ok = (f->mfg_prefix_len == 0);
+
+    while (p + 1 < end) {
+        uint8_t len = p[0];
+        const uint8_t *next = p + 1 + len;
+        if (len == 0 || next > end) break;
+
+        uint8_t type = p[1];
+        if (type == BLE_HS_ADV_TYPE_COMP_UUIDS16 || type == BLE_HS_ADV_TYPE_INCOMP_UUIDS16) {
+            for (const uint8_t *u = p + 2; u + 1 < next; u += 2) {
+                uint16_t uuid = u[0] | (u[1] << 8);
+                if (!(f->uuid_mask & ADV_FILTER_BIT(uuid))) continue;
+                for (uint8_t i = 0; i < f->num_uuids; i++) {
+                    if (f->uuids[i] == uuid) found |= 1 << i;
+                }
+            }
+        } else if (type == BLE_HS_ADV_TYPE_MFG_DATA && !mfg_ok) {
+            mfg_ok = (len - 1 >= f->mfg_prefix_len) &&
+                     memcmp(p + 2, f->mfg_prefix, f->mfg_prefix_len) == 0;
+        }
+        p = next;
+    }
+
+    return mfg_ok ? found : 0;
+}
+
+/*
+* Find the service data of a UUID16 in a raw advertisement.
+* returns: pointer to the data after the UUID, or NULL if not present.
+*/
+const uint8_t *adv_find_svc_data16(const uint8_t *ad, size_t ad_len,
+                                   uint16_t uuid, size_t *data_len)
+{
+    const uint8_t *p = ad;
+    const uint8_t *end = ad + ad_len;
+
+    while (p + 1 < end) {
+        uint8_t len = p[0];
+        const uint8_t *next = p + 1 + len;
+        if (len == 0 || next > end) break;
+
+        if (p[1] == BLE_HS_ADV_TYPE_SVC_DATA_UUID16 && len >= 3 &&
+            (p[2] | (p[3] << 8)) == uuid) {
+            *data_len = len - 3;
+            return p + 4;
+        }
+        p = next;
+    }
+    return NULL;
+}
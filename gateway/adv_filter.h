@@ -0,0 +1,30 @@
+#ifndef ADV_FILTER_H
+#define ADV_FILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ADV_FILTER_MAX_UUIDS   4
+#define ADV_FILTER_MAX_PREFIX  4
+
+// Bit of a UUID16 in the quick reject mask
+#define ADV_FILTER_BIT(uuid)   (1UL << ((uuid) & 0x1f))
+
+/*
+* Precomputed advertisement filter. A packet matches if one of its UUID16
+* list entries is in uuids and, if mfg_prefix_len is set, its manufacturer
+* data starts with mfg_prefix.
+*/
+typedef struct adv_filter_t {
+    uint16_t uuids[ADV_FILTER_MAX_UUIDS];      // UUID16 values to accept
+    uint8_t num_uuids;
+    uint32_t uuid_mask;                        // ADV_FILTER_BIT of all uuids
+    uint8_t mfg_prefix[ADV_FILTER_MAX_PREFIX]; // Company ID and data prefix
+    uint8_t mfg_prefix_len;                    // 0 to ignore manufacturer data
+} adv_filter_t;
+
+uint8_t adv_filter_match(const adv_filter_t *f, const uint8_t *ad, size_t ad_len);
+const uint8_t *adv_find_svc_data16(const uint8_t *ad, size_t ad_len,
+                                   uint16_t uuid, size_t *data_len);
+
+#endif /* ADV_FILTER_H */
@@ -6,12 +6,24 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include "host/ble_hs.h"
 
-#define TARGET_DEVICE_PREFIX "EnvSensor"  // Look for devices with this name prefix
-#define TEMP_SENSOR_NAME "EnvSensor-TEMP"
-#define HUM_SENSOR_NAME "EnvSensor-HUM"
+#define TARGET_DEVICE_PREFIX "EnvNode"  // Look for devices with this name prefix
 #define TEMP_SENSOR_ID 0
 #define HUMID_SENSOR_ID 1
+// Published responses waiting for the printer thread
+#define RESPONSE_PRINT_QUEUE 8
+
+// Query phases, timestamped in sensor_response_t.phase_ms
+typedef enum query_phase_t {
+    PHASE_SCAN_START = 0,   // Scanner started for the query
+    PHASE_ADV_MATCH,        // Advertisement of the sensor matched
+    PHASE_CONNECTED,        // Connection complete
+    PHASE_SVC_FOUND,        // ESS service discovered
+    PHASE_CHR_FOUND,        // Sensor characteristic discovered
+    PHASE_READ_DONE,        // Reading received
+    PHASE_COUNT
+} query_phase_t;
 
 // Sensor response structure
 typedef struct sensor_response_t{
@@ -20,11 +32,17 @@ typedef struct sensor_response_t{
     double value;                   // Sensor reading value
     uint32_t timestamp;            // Unix timestamp of the reading
     char unit[16];                 // Unit ("Celsius" or "Percent")
+    ble_addr_t addr;               // Node that took the reading
     uint32_t discovery_latency_ms; // Time to discover sensor
+    uint32_t read_latency_ms;      // Time from connection to read complete
+    uint32_t phase_ms[PHASE_COUNT]; // Time of each phase since the query start
+    uint8_t phases;                // Bit per phase reached
     char error_message[64];        // Error description if failed
 } sensor_response_t;
 
 void print_sensor_response(const sensor_response_t *response);
+void response_print_init(void);
+void response_print_post(const sensor_response_t *response);
 
 
 #endif /* GATEWAY_H */
\ No newline at end of file
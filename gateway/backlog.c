@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ztimer.h"
+#include "host/ble_gatt.h"
+#include "ble_handler.h"
+#include "conn_pool.h"
+#include "gateway.h"
+#include "backlog.h"
+#include "env_wire.h"
+#include "trace.h"
+#include "registry.h"
+
+const ble_uuid128_t backlog_chr_uuid = BLE_UUID128_INIT(ENV_WIRE_BACKLOG_UUID128);
+
+static backlog_node_t nodes[BACKLOG_MAX_NODES];
+
+// Download in progress, one at a time
+static struct {
+    backlog_node_t pos;            // Position of the node, moved on as batches arrive
+    backlog_node_t *node;          // Slot of the node, taken at the first blob
+    bool resumed;                  // Position taken from the sensor's last ack
+    bool more;                     // Sensor holds samples past this read
+    uint32_t samples;              // Samples received in this download
+    uint32_t last_timestamp;       // Sensor time of the newest sample
+    uint16_t rx_len;
+    uint8_t rx[ENV_WIRE_BATCH_MAX_LEN]; // Batch of the current long read
+} drain;
+
+// Position of a node, NULL if it was never drained
+static backlog_node_t *node_find(const ble_addr_t *addr)
+{
+    for (unsigned i = 0; i < BACKLOG_MAX_NODES; i++) {
+        backlog_node_t *n = &nodes[i];
+        if (n->in_use && ble_addr_cmp(&n->addr, addr) == 0) return n;
+    }
+    return NULL;
+}
+
+// Slot of a node, the least recently drained one is replaced if new
+static backlog_node_t *node_get(const ble_addr_t *addr)
+{
+    backlog_node_t *lru = &nodes[0];
+    for (unsigned i = 0; i < BACKLOG_MAX_NODES; i++) {
+        backlog_node_t *n = &nodes[i];
+        if (n->in_use && ble_addr_cmp(&n->addr, addr) == 0) return n;
+        if (!n->in_use) {
+            lru = n;
+        } else if (lru->in_use && n->last_drain_ms < lru->last_drain_ms) {
+            lru = n;
+        }
+    }
+    memset(lru, 0, sizeof(*lru));
+    lru->addr = *addr;
+    return lru;
+}
+
+static void backlog_fail(gw_request_t *req, const char *msg)
+{
+    uint16_t conn = req->conn_handle;
+    req->response->success = false;
+    snprintf(req->response->error_message, sizeof(req->response->error_message),
+             "%s", msg);
+    ble_request_complete(req);
+    conn_pool_remove(conn);
+    ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+static void backlog_finish(gw_request_t *req)
+{
+    uint16_t conn = req->conn_handle;
+    backlog_node_t *n = &drain.pos;
+
+    n->in_use = true;
+    n->samples += drain.samples;
+    n->last_drain_ms = ztimer_now(ZTIMER_MSEC);
+    if (!drain.node) drain.node = node_get(&n->addr);
+    *drain.node = *n;
+
+    sensor_response_t *response = req->response;
+    response->success = true;
+    response->value = drain.samples;
+    response->timestamp = drain.last_timestamp;
+    response->read_latency_ms = ztimer_now(ZTIMER_MSEC) - req->connect_time;
+    strcpy(response->unit, "samples");
+    request_mark_phase(req, PHASE_READ_DONE);
+
+    TRACE_INFO(TR_BACKLOG_DONE, req->id, drain.samples, n->next_seq);
+    ble_request_complete(req);
+
+    // Keep the link open for the next query if the pool takes it
+    if (conn_pool_add(conn) != 0) {
+        ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
+    }
+}
+
+static int read_cb(uint16_t conn, const struct ble_gatt_error *error,
+                   struct ble_gatt_attr *attr, void *arg);
+
+static void drain_read(gw_request_t *req)
+{
+    drain.rx_len = 0;
+    request_set_state(req, REQ_DRAINING);
+    int rc = ble_gattc_read_long(req->conn_handle, req->val_handle, 0, read_cb, NULL);
+    if (rc != 0) {
+        TRACE_ERROR(TR_BACKLOG_READ_FAILED, req->conn_handle, rc, 0);
+        backlog_fail(req, "Backlog read failed");
+    }
+}
+
+static int ack_cb(uint16_t conn, const struct ble_gatt_error *error,
+                  struct ble_gatt_attr *attr, void *arg)
+{
+    (void)attr;
+    (void)arg;
+
+    gw_request_t *req = request_find_by_conn(conn);
+    if (!req || req->state != REQ_DRAINING) return 0;
+
+    if (error->status != 0) {
+        TRACE_ERROR(TR_BACKLOG_ACK_FAILED, conn, error->status, 0);
+        backlog_fail(req, "Backlog ack failed");
+        return 0;
+    }
+
+    if (drain.more) {
+        drain_read(req);
+    } else {
+        backlog_finish(req);
+    }
+    return 0;
+}
+
+// Acknowledge every sample before the download position of the node
+static void drain_ack(gw_request_t *req)
+{
+    uint8_t ack[4];
+    env_wire_put32(ack, drain.pos.next_seq);
+
+    request_set_state(req, REQ_DRAINING);
+    int rc = ble_gattc_write_flat(req->conn_handle, req->val_handle, ack, sizeof(ack),
+                                  ack_cb, NULL);
+    if (rc != 0) {
+        TRACE_ERROR(TR_BACKLOG_ACK_FAILED, req->conn_handle, rc, 0);
+        backlog_fail(req, "Backlog ack failed");
+    }
+}
+
+// Take the samples of a complete long read and move the position on
+static void drain_parse(gw_request_t *req)
+{
+    backlog_node_t *n = &drain.pos;
+    env_wire_batch_iter_t it;
+    uint32_t first, next;
+
+    if (env_wire_batch_begin(&it, drain.rx, drain.rx_len, &first, &next) != 0) {
+        backlog_fail(req, "Backlog batch malformed");
+        return;
+    }
+
+    // Samples the ring overwrote since the last download
+    if (!drain.resumed && first > n->next_seq) {
+        n->lost += first - n->next_seq;
+    }
+    drain.resumed = false;
+
+    unsigned count = 0;
+    uint32_t seq;
+    env_wire_sample_t sample;
+    while (env_wire_batch_next(&it, &seq, &sample)) {
+        drain.last_timestamp = sample.timestamp;
+        count++;
+        TRACE_DEBUG(TR_BACKLOG_SAMPLE, seq, sample.temperature, sample.humidity);
+    }
+
+    n->next_seq = first + count;
+    drain.samples += count;
+    drain.more = count > 0 && n->next_seq < next;
+    // Keep the position of a download cut short
+    if (drain.node) *drain.node = *n;
+    drain_ack(req);
+}
+
+static int read_cb(uint16_t conn, const struct ble_gatt_error *error,
+                   struct ble_gatt_attr *attr, void *arg)
+{
+    (void)arg;
+
+    gw_request_t *req = request_find_by_conn(conn);
+    if (!req || req->state != REQ_DRAINING) return 0;
+
+    if (error->status == BLE_HS_EDONE) {
+        drain_parse(req);
+        return 0;
+    }
+    if (error->status != 0 || !attr) {
+        TRACE_ERROR(TR_BACKLOG_READ_FAILED, conn, error->status, 0);
+        backlog_fail(req, "Backlog read failed");
+        return 0;
+    }
+
+    // Long read: one callback per blob, at its offset in the value. The
+    // deadline bounds each blob, a full batch takes many at the default MTU
+    request_set_state(req, REQ_DRAINING);
+    if (!drain.node) {
+        // Only a node that answers takes the place of another
+        drain.node = node_get(&drain.pos.addr);
+    }
+    uint16_t len = OS_MBUF_PKTLEN(attr->om);
+    if (attr->offset + len > sizeof(drain.rx)) {
+        backlog_fail(req, "Backlog value too long");
+        return 0;
+    }
+    os_mbuf_copydata(attr->om, 0, len, &drain.rx[attr->offset]);
+    drain.rx_len = attr->offset + len;
+    return 0;
+}
+
+// First exchange of the download, once the MTU is settled
+static void drain_begin(gw_request_t *req)
+{
+    if (drain.resumed) {
+        drain_read(req);
+    } else {
+        drain.more = true;
+        drain_ack(req);
+    }
+}
+
+static int mtu_cb(uint16_t conn, const struct ble_gatt_error *error, uint16_t mtu, void *arg)
+{
+    (void)arg;
+
+    gw_request_t *req = request_find_by_conn(conn);
+    if (!req || req->state != REQ_DRAINING) return 0;
+
+    // Refused or not supported: download in blobs of the default MTU
+    TRACE_INFO(TR_MTU, conn, error->status, mtu);
+    drain_begin(req);
+    return 0;
+}
+
+/*
+*Download the samples a node recorded since the last download, found the
+*backlog characteristic for req. The gateway sends its own position first;
+*for an unknown node the download resumes where the sensor was last acked.
+*returns: 0 on success.
+*/
+int backlog_start(gw_request_t *req)
+{
+    gw_request_t *other = request_find_state(REQ_DRAINING, 0);
+    if (other && other != req) {
+        backlog_fail(req, "Another backlog download is running");
+        return -1;
+    }
+
+    backlog_node_t *n = node_find(&req->addr);
+    drain.node = n;
+    drain.pos = n ? *n : (backlog_node_t){ .addr = req->addr };
+    drain.resumed = !n;
+    drain.samples = 0;
+    drain.last_timestamp = 0;
+
+    TRACE_INFO(TR_BACKLOG_START, req->id, req->conn_handle, drain.resumed);
+
+    // A batch takes dozens of blobs at the default MTU, raise it once per link
+    request_set_state(req, REQ_DRAINING);
+    if (ble_att_mtu(req->conn_handle) <= BLE_ATT_MTU_DFLT &&
+        ble_gattc_exchange_mtu(req->conn_handle, mtu_cb, NULL) == 0) {
+        return 0;
+    }
+    drain_begin(req);
+    return 0;
+}
+
+static void backlog_print(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < BACKLOG_MAX_NODES; i++) {
+        backlog_node_t *n = &nodes[i];
+        if (!n->in_use) continue;
+        printf("[%u] %02x:%02x:%02x:%02x:%02x:%02x  next seq: %lu  samples: %lu"
+               "  lost: %lu  drained %lu ms ago\n", i,
+               n->addr.val[5], n->addr.val[4], n->addr.val[3],
+               n->addr.val[2], n->addr.val[1], n->addr.val[0],
+               (unsigned long)n->next_seq, (unsigned long)n->samples,
+               (unsigned long)n->lost, (unsigned long)(now - n->last_drain_ms));
+        count++;
+    }
+    if (count == 0) {
+        printf("No backlog downloaded yet\n");
+    }
+}
+
+static int backlog_cmd(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "get") == 0) {
+        registry_node_t *node = argc > 2 ? registry_resolve(argv[2]) : NULL;
+        if (argc > 2 && !node) {
+            printf("[ERR] Unknown node %s, see nodes\n", argv[2]);
+            return 1;
+        }
+        // Any node serves the backlog, find one by its temperature UUID
+        printf("Downloading sensor backlog...\n");
+        ble_query_node(SENSOR_TEMP, QUERY_BACKLOG, node ? &node->addr : NULL);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "clear") == 0) {
+        if (request_find_state(REQ_DRAINING, 0)) {
+            printf("[ERR] A backlog download is in progress\n");
+            return 1;
+        }
+        memset(nodes, 0, sizeof(nodes));
+    } else if (argc > 1) {
+        printf("usage: %s [get [node]|clear]\n", argv[0]);
+        return 1;
+    }
+
+    backlog_print();
+    return 0;
+}
+
+/**Shell command */
+int cmd_backlog(int argc, char **argv)
+{
+    // drain.node points into the nodes the host updates
+    return ble_host_cmd(backlog_cmd, argc, argv);
+}
@@ -0,0 +1,28 @@
+#ifndef BACKLOG_H
+#define BACKLOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host/ble_hs.h"
+#include "request.h"
+
+// Nodes whose download position is remembered
+#define BACKLOG_MAX_NODES   4
+
+// Download position of one node
+typedef struct backlog_node_t {
+    bool in_use;
+    ble_addr_t addr;               // Node address
+    uint32_t next_seq;             // First sample not downloaded yet
+    uint32_t samples;              // Samples downloaded
+    uint32_t lost;                 // Samples overwritten before the download
+    uint32_t last_drain_ms;        // End of the last download
+} backlog_node_t;
+
+extern const ble_uuid128_t backlog_chr_uuid;
+
+int backlog_start(gw_request_t *req);
+
+int cmd_backlog(int argc, char **argv);
+
+#endif /* BACKLOG_H */
@@ -5,102 +5,375 @@
 #include <string.h>
 
 #include "periph/rtc.h"
+#include "sema.h"
+#include "thread.h"
 #include "ztimer.h"
+#include "nimble/nimble_port.h"
 #include "host/ble_gatt.h"
 #include "host/ble_hs_adv.h"
+#include "presence.h"
+#include "conn_pool.h"
+#include "conn_profile.h"
+#include "gatt_cache.h"
+#include "request.h"
+#include "subscribe.h"
+#include "backlog.h"
+#include "adv_filter.h"
+#include "trace.h"
+#include "series.h"
+#include "read_cache.h"
+#include "scan_sched.h"
+#include "registry.h"
+#include "poll.h"
+#include "padv.h"
+#include "env_wire.h"
 
 // Globals
-uint32_t scan_start_time = 0;
-bool scan_timeout_active = false;
-const char *target_type = NULL;
-sensor_response_t *active_response = NULL;
-static bool connecting = false;
-static uint16_t conn_handle = 0;
-static bool ess_found = false;
+sensor_response_t *active_response = NULL;  // Last completed response
+static sensor_response_t last_response;
+
+// Thread running the NimBLE host event queue, known once ble_host_init ran
+static kernel_pid_t host_pid = KERNEL_PID_UNDEF;
+
+// Fast-path filter for scan_cb, precomputed for the sensor types we query
+const adv_filter_t sensor_filter = {
+    .uuids = { TEMPERATURE_CHARACTERISTIC_UUID, HUMIDITY_CHARACTERISTIC_UUID },
+    .num_uuids = 2,
+    .uuid_mask = ADV_FILTER_BIT(TEMPERATURE_CHARACTERISTIC_UUID) |
+                 ADV_FILTER_BIT(HUMIDITY_CHARACTERISTIC_UUID),
+};
+
+
+// Call handed from another thread to the NimBLE host
+typedef struct host_call_t {
+    struct ble_npl_event ev;
+    sema_t done;
+    void (*fn)(void *arg);
+    void *arg;
+} host_call_t;
+
+static void host_call_cb(struct ble_npl_event *ev)
+{
+    host_call_t *call = ble_npl_event_get_arg(ev);
+    call->fn(call->arg);
+    sema_post(&call->done);
+}
 
+/*
+*Run fn on the NimBLE host thread and wait for it. Requests, the scanner
+*and the registry are only changed there, so the shell and the host
+*callbacks never race on them. Called on the host thread, fn runs directly.
+*/
+void ble_host_call(void (*fn)(void *arg), void *arg)
+{
+    if (host_pid != KERNEL_PID_UNDEF && thread_getpid() == host_pid) {
+        fn(arg);
+        return;
+    }
 
-typedef struct packet_t {
-    int16_t reading;
-    uint32_t timestamp;
-} packet_t;
+    host_call_t call = { .fn = fn, .arg = arg };
+    sema_create(&call.done, 0);
+    ble_npl_event_init(&call.ev, host_call_cb, &call);
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &call.ev);
+    sema_wait(&call.done);
+}
 
+typedef struct host_cmd_t {
+    int (*cmd)(int argc, char **argv);
+    int argc;
+    char **argv;
+    int rc;
+} host_cmd_t;
+
+static void host_cmd_cb(void *arg)
+{
+    host_cmd_t *call = arg;
+    call->rc = call->cmd(call->argc, call->argv);
+}
 
 /*
-*Generate request id
+*Run a shell command on the NimBLE host thread, for commands that list or
+*change state the host owns. The command must not wait for the host.
+*returns: rc of the command.
 */
-void generate_request_id(char *request_id, size_t size) {
-    static uint32_t counter = 0;
-    snprintf(request_id, size, "REQ_%lu_%lu", counter++, ztimer_now(ZTIMER_MSEC));
+int ble_host_cmd(int (*cmd)(int argc, char **argv), int argc, char **argv)
+{
+    host_cmd_t call = { .cmd = cmd, .argc = argc, .argv = argv };
+    ble_host_call(host_cmd_cb, &call);
+    return call.rc;
 }
 
-// Add this function to get elapsed scan time
-uint32_t get_scan_elapsed_ms(void) {
-    if (scan_start_time == 0) return 0;
-    return ztimer_now(ZTIMER_MSEC) - scan_start_time;
+static void host_pid_cb(void *arg)
+{
+    (void)arg;
+    host_pid = thread_getpid();
 }
 
+// Learn the host thread, once its event queue runs
+void ble_host_init(void)
+{
+    ble_host_call(host_pid_cb, NULL);
+}
 
-int gatt_read_cb(uint16_t conn, const struct ble_gatt_error *error,
-                 struct ble_gatt_attr *attr, void *arg)
+typedef struct active_call_t {
+    uint32_t id;
+    bool active;
+} active_call_t;
+
+static void request_active_cb(void *arg)
 {
-    (void)arg;
+    active_call_t *call = arg;
+    call->active = request_find_by_id(call->id) != NULL;
+}
 
-    if (error->status != 0) {
-        printf("[ERR] GATT read failed: %d\n", error->status);
+/*
+*returns: true while a query scans for or connects to a sensor, a pool
+*reconnect waits until none does.
+*/
+bool ble_queries_need_radio(void)
+{
+    return request_find_state(REQ_SCANNING, 0) ||
+           request_find_state(REQ_CONNECT_PENDING, 0) ||
+           request_find_state(REQ_CONNECTING, 0);
+}
+
+/*
+*returns: true if the query with the given request number is still in flight.
+*/
+bool ble_request_active(uint32_t id)
+{
+    active_call_t call = { .id = id };
+    ble_host_call(request_active_cb, &call);
+    return call.active;
+}
+
+/*
+*Start, stop or change the scanner to match the requests in flight.
+*returns: rc of the scanner, 0 on success.
+*/
+int ble_scan_update(void)
+{
+    gw_request_t *req = request_find_state(REQ_SCANNING, 0);
+
+    // NimBLE cannot scan while a connection is being initiated
+    if (request_find_state(REQ_CONNECTING, 0) || conn_pool_connecting()) {
+        scan_sched_cancel();
+        nimble_scanner_stop();
+        // A query waits for an advertisement: a pool reconnect gives way
+        if (req) conn_pool_yield();
         return 0;
     }
+    if (req) {
+        return scan_sched_query(req->sensor_uuid);
+    }
+    // No query waiting for an advertisement, back to background scanning
+    scan_sched_cancel();
+    if (padv_scan_wanted()) {
+        // A periodic sync is created from the extended advertisements
+        return presence_scan_active();
+    }
+    return presence_scan_resume();
+}
 
-    if (!attr || !attr->om) {
-        printf("[WARN] No attribute data received\n");
-        return 0;
+/*
+*Decode a sensor reading, an env_wire_reading_t.
+*returns: 0 on success, -1 if the record is short or of another version.
+*/
+int ble_decode_reading(struct os_mbuf *om, uint32_t *seq, int16_t *reading,
+                       uint32_t *timestamp)
+{
+    uint8_t buf[ENV_WIRE_READING_LEN];
+    size_t len = OS_MBUF_PKTLEN(om);
+
+    if (len > sizeof(buf)) len = sizeof(buf);
+    if (os_mbuf_copydata(om, 0, len, buf) != 0) return -1;
+    return env_wire_reading_decode(buf, len, seq, timestamp, reading);
+}
+
+/*
+*Hand a finished response to the user, printed later by the printer thread.
+*/
+void ble_publish_response(const sensor_response_t *response)
+{
+    response_print_post(response);
+
+    series_add_response(response);
+    read_cache_on_response(response);
+    poll_on_response(response);
+
+    // Kept for the evaluation commands
+    last_response = *response;
+    active_response = &last_response;
+}
+
+/*
+*Release a request without reporting it, e.g. once a subscription is set up.
+*/
+void ble_request_release(gw_request_t *req)
+{
+    request_free(req);
+    ble_scan_update();
+}
+
+/*
+*Report the result of a request and release it.
+*/
+void ble_request_complete(gw_request_t *req)
+{
+    TIMING_STAMP(req, TP_PUBLISH);
+    req->response->addr = req->addr;
+    ble_publish_response(req->response);
+    if (req->waiter) {
+        *req->waiter->response = *req->response;
+        sema_post(&req->waiter->done);
+        req->waiter = NULL;
     }
+    ble_request_release(req);
+}
 
-    if (!active_response) {
-        printf("[ERR] active_response is NULL\n");
-        return 0;
+static void request_fail(gw_request_t *req, const char *msg)
+{
+    req->response->success = false;
+    snprintf(req->response->error_message, sizeof(req->response->error_message),
+             "%s", msg);
+    ble_request_complete(req);
+}
+
+/*
+*The connect slot is free again: start the connect of the next request
+*waiting for it, or bring the scanner back.
+*/
+void ble_connect_next(void)
+{
+    gw_request_t *req = request_find_state(REQ_CONNECT_PENDING, 0);
+    if (req) {
+        ble_connect_sensor(req);
+    } else {
+        ble_scan_update();
     }
+}
 
-    size_t om_len = OS_MBUF_PKTLEN(attr->om);
+int svc_disc_cb(uint16_t conn, const struct ble_gatt_error *error,
+                const struct ble_gatt_svc *svc, void *arg);
+int chr_disc_cb(uint16_t conn, const struct ble_gatt_error *error,
+                const struct ble_gatt_chr *chr, void *arg);
 
-    // Check if we have at least the 2-byte reading
-    if (om_len < sizeof(int16_t)) {
-        printf("[WARN] Not enough data (%zu bytes)\n", om_len);
-        return 0;
+// Discover only the ESS service instead of every service on the peer, and
+// only its characteristics when the service range is cached
+static int start_discovery(gw_request_t *req)
+{
+    request_set_state(req, REQ_DISCOVERING);
+    req->ess_found = false;
+    uint16_t start, end;
+    int rc;
+    if (gatt_cache_svc(&req->addr, &start, &end)) {
+        req->ess_found = true;
+        req->end_handle = end;
+        request_mark_phase(req, PHASE_SVC_FOUND);
+        rc = ble_gattc_disc_all_chrs(req->conn_handle, start, end, chr_disc_cb, NULL);
+    } else {
+        rc = ble_gattc_disc_svc_by_uuid(req->conn_handle,
+                                        BLE_UUID16_DECLARE(ENV_SENSING_SERVICE_UUID),
+                                        svc_disc_cb, NULL);
+    }
+    if (rc != 0) {
+        TRACE_ERROR(TR_DISC_FAILED, req->conn_handle, rc, 0);
+        // Disconnect if we can't start discovery
+        ble_gap_terminate(req->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
     }
+    return rc;
+}
 
-    uint8_t buf[6] = {0}; // Max size for reading + timestamp (2 + 4)
-    size_t copy_len = om_len < sizeof(buf) ? om_len : sizeof(buf);
-    os_mbuf_copydata(attr->om, 0, copy_len, buf);
+/*
+*Give the link of a finished read to the oldest query still waiting for a
+*sensor, so temperature and humidity come from one connection.
+*returns: true if a read was started on the link.
+*/
+static bool hand_over_link(uint16_t conn, const ble_addr_t *addr)
+{
+    gw_request_t *req = request_find_waiting(addr);
+    if (!req) return false;
+
+    uint16_t val_handle = gatt_cache_val_handle(addr, req->sensor_uuid);
+    if (val_handle == 0) return false;
+
+    request_state_t state = req->state;
+    req->addr = *addr;
+    req->response->discovery_latency_ms = ztimer_now(ZTIMER_MSEC) - req->start_time;
+    TRACE_INFO(TR_LINK_SHARED, req->id, conn, val_handle);
+    if (ble_read_sensor(req, conn, val_handle) != 0) {
+        request_set_state(req, state);
+        return false;
+    }
+    request_mark_phase(req, PHASE_CONNECTED);
+    return true;
+}
 
-    int16_t reading = buf[0] | (buf[1] << 8);
-    uint32_t timestamp = 0;
+int gatt_read_cb(uint16_t conn, const struct ble_gatt_error *error,
+                 struct ble_gatt_attr *attr, void *arg)
+{
+    (void)arg;
 
-    // If we have more than 2 bytes, assume the next 4 are the timestamp
-    if (copy_len >= 6) {
-        timestamp = buf[2] | (buf[3] << 8) | (buf[4] << 16) | (buf[5] << 24);
-    } else {
-        // Fallback: use local time
-        timestamp = ztimer_now(ZTIMER_MSEC);
+    gw_request_t *req = request_find_by_conn(conn);
+    if (!req) {
+        TRACE_ERROR(TR_READ_UNKNOWN, conn, 0, 0);
+        return 0;
     }
+    TIMING_STAMP(req, TP_READ_CB);
 
-    active_response->value = reading / 100.0;
+    if (error->status != 0) {
+        TRACE_ERROR(TR_READ_FAILED, conn, error->status, 0);
+        if (req->cached_read) {
+            // Cached handles are stale, rediscover on this connection
+            req->cached_read = false;
+            gatt_cache_invalidate(&req->addr);
+            start_discovery(req);
+            return 0;
+        }
+        // Stale pooled link, close it and let the next query reconnect
+        conn_pool_remove(conn);
+        char msg[32];
+        snprintf(msg, sizeof(msg), "GATT read failed: %d", error->status);
+        request_fail(req, msg);
+        ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
+        return 0;
+    }
 
-    if (strcmp(active_response->unit, "Celsius") == 0) {
-        printf("[INFO] Temperature: %.2f °C @ %lu \n",
-               active_response->value, (unsigned long)timestamp);
-    } else if (strcmp(active_response->unit, "Percent") == 0) {
-        printf("[INFO] Humidity: %.2f %% @ %lu \n",
-               active_response->value, (unsigned long)timestamp);
-    } else {
-        printf("[WARN] Unknown unit: %s\n", active_response->unit);
+    sensor_response_t *response = req->response;
+    uint32_t seq;
+    int16_t reading;
+    uint32_t timestamp;
+    if (!attr || !attr->om ||
+        ble_decode_reading(attr->om, &seq, &reading, &timestamp) != 0) {
+        TRACE_ERROR(TR_READ_SHORT, conn, attr && attr->om ? OS_MBUF_PKTLEN(attr->om) : 0, 0);
+        // No later event completes the request, the sensor speaks another format
+        conn_pool_remove(conn);
+        request_fail(req, "Unsupported wire format");
+        ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
         return 0;
     }
 
+    response->value = reading / 100.0;
+    request_mark_phase(req, PHASE_READ_DONE);
+    TRACE_INFO(TR_READ_DONE, req->id, reading, timestamp);
+
     // Save success and timestamp
-    active_response->success = true;
-    active_response->timestamp = timestamp;
+    response->success = true;
+    response->timestamp = timestamp;
+    response->read_latency_ms = ztimer_now(ZTIMER_MSEC) - req->connect_time;
+
+    ble_addr_t addr = req->addr;
+    ble_request_complete(req);
 
-    print_sensor_response(active_response);
+    // Serve a waiting query over the same link, the node has both readings
+    if (hand_over_link(conn, &addr)) {
+        return 0;
+    }
+
+    // Keep the link open for the next query if the pool takes it
+    if (conn_pool_add(conn) == 0) {
+        return 0;
+    }
 
     // Disconnect safely
     ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
@@ -108,30 +381,69 @@ int gatt_read_cb(uint16_t conn, const struct ble_gatt_error *error,
     return 0;
 }
 
-// Characteristic Discovery 
+// Characteristic Discovery
 int chr_disc_cb(uint16_t conn, const struct ble_gatt_error *error,
                 const struct ble_gatt_chr *chr, void *arg)
 {
     (void)arg;
 
+    gw_request_t *req = request_find_by_conn(conn);
+    if (!req) return 0;
+
     if (error->status == BLE_HS_EDONE) {
-        printf("[INFO] Characteristic discovery complete\n");
+        // Last characteristic of the service, its descriptors run to the service end
+        if (req->subscribe && req->val_handle != 0 && req->state == REQ_DISCOVERING) {
+            subscribe_start(req);
+        } else if (req->state == REQ_DISCOVERING) {
+            TRACE_ERROR(TR_CHR_MISSING, conn, req->sensor_uuid, 0);
+            // The cached service range may be stale, discover it next time
+            gatt_cache_invalidate(&req->addr);
+            ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
+        }
         return 0;
     }
 
     if (error->status != 0) {
-        printf("[ERROR] Characteristic discovery failed: %d\n", error->status);
+        TRACE_ERROR(TR_DISC_FAILED, conn, error->status, 0);
         return 0;
     }
 
     if (!chr) return 0;
 
+    // The characteristic to subscribe to ends before the next one
+    if (req->subscribe && req->val_handle != 0 && req->state == REQ_DISCOVERING) {
+        if (chr->uuid.u.type == BLE_UUID_TYPE_16) {
+            gatt_cache_store_chr(&req->addr, chr->uuid.u16.value, chr->val_handle);
+        }
+        req->end_handle = chr->def_handle - 1;
+        subscribe_start(req);
+        // Stop the characteristic discovery, descriptors are looked up now
+        return 1;
+    }
+
+    if (req->backlog && req->state == REQ_DISCOVERING &&
+        ble_uuid_cmp(&chr->uuid.u, &backlog_chr_uuid.u) == 0) {
+        request_mark_phase(req, PHASE_CHR_FOUND);
+        req->val_handle = chr->val_handle;
+        backlog_start(req);
+        return 0;
+    }
+
     if (chr->uuid.u.type == BLE_UUID_TYPE_16) {
         uint16_t uuid = chr->uuid.u16.value;
-        printf("[DEBUG] Found characteristic UUID: 0x%04X, handle: %d\n",
-               uuid, chr->val_handle);
-
-        ble_gattc_read(conn, chr->val_handle, gatt_read_cb, NULL);
+        TRACE_DEBUG(TR_CHR_FOUND, conn, uuid, chr->val_handle);
+
+        gatt_cache_store_chr(&req->addr, uuid, chr->val_handle);
+        if (uuid == req->sensor_uuid && req->state == REQ_DISCOVERING && !req->backlog) {
+            request_mark_phase(req, PHASE_CHR_FOUND);
+            req->val_handle = chr->val_handle;
+            // Subscriptions wait for the next characteristic to bound the descriptors
+            if (!req->subscribe) {
+                request_set_state(req, REQ_READING);
+                TIMING_STAMP(req, TP_READ_START);
+                ble_gattc_read(conn, chr->val_handle, gatt_read_cb, NULL);
+            }
+        }
     }
 
     return 0;
@@ -143,39 +455,36 @@ int svc_disc_cb(uint16_t conn, const struct ble_gatt_error *error,
 {
     (void)arg;
 
+    gw_request_t *req = request_find_by_conn(conn);
+    if (!req) return 0;
+
     if (error->status == BLE_HS_EDONE) {
-        if (!ess_found) {
-            printf("[WARN] ESS service not found on this device (search completed)\n");
+        if (!req->ess_found) {
+            TRACE_ERROR(TR_SVC_MISSING, conn, 0, 0);
             ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
-        } else {
-            printf("[INFO] Service discovery complete\n");
         }
         return 0;
     }
 
-    if (!svc) {
-        printf("[WARN] No service data received\n");
+    if (error->status != 0) {
+        TRACE_ERROR(TR_DISC_FAILED, conn, error->status, 0);
         return 0;
     }
 
-    printf("[DEBUG] Found service: UUID=");
-    if (svc->uuid.u.type == BLE_UUID_TYPE_16) {
-        printf("0x%04X", svc->uuid.u16.value);
-    } else {
-        printf("(128-bit UUID)");
-    }
-    printf(", Handle range: %d to %d\n", svc->start_handle, svc->end_handle);
+    if (!svc) return 0;
 
     if (svc->uuid.u.type == BLE_UUID_TYPE_16 &&
         svc->uuid.u16.value == ENV_SENSING_SERVICE_UUID) {
-        ess_found = true;
-        printf("[SUCCESS] Found ESS service! Handle range: %d to %d\n",
-               svc->start_handle, svc->end_handle);
+        req->ess_found = true;
+        req->end_handle = svc->end_handle;
+        request_mark_phase(req, PHASE_SVC_FOUND);
+        TRACE_INFO(TR_SVC_FOUND, conn, svc->start_handle, svc->end_handle);
+        gatt_cache_store_svc(&req->addr, svc->start_handle, svc->end_handle);
 
         int rc = ble_gattc_disc_all_chrs(conn, svc->start_handle, svc->end_handle,
                                          chr_disc_cb, NULL);
         if (rc != 0) {
-            printf("[ERROR] Characteristic discovery initiation failed: %d\n", rc);
+            TRACE_ERROR(TR_DISC_FAILED, conn, rc, 0);
             ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
         }
     }
@@ -186,43 +495,85 @@ int svc_disc_cb(uint16_t conn, const struct ble_gatt_error *error,
 /**Gap Event */
 int gap_event_cb(struct ble_gap_event *event, void *arg)
 {
-    (void)arg;
-
     switch (event->type) {
 
-        case BLE_GAP_EVENT_CONNECT:
-            connecting = false;
+        case BLE_GAP_EVENT_CONNECT: {
+            // Only the request that started the connect gets this event
+            gw_request_t *req = arg;
+
             if (event->connect.status == 0) {
-                conn_handle = event->connect.conn_handle;
-                printf("[SUCCESS] Connected! Handle: %d\n", conn_handle);
-                
-                // Start service discovery immediately after connection
-                if(DEBUG){
-                    printf("[DEBUG] Starting ESS service discovery...\n");                
-                    printf("[DEBUG] Discovering ALL services...\n");
-                }
-          
-                int rc = ble_gattc_disc_all_svcs(conn_handle, svc_disc_cb, NULL);
-                
-                if (rc != 0) {
-                    printf("[ERROR] Service discovery initiation failed: %d\n", rc);
-                    // Disconnect if we can't start discovery
-                    ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                req->conn_handle = event->connect.conn_handle;
+                req->connect_time = ztimer_now(ZTIMER_MSEC);
+                request_mark_phase(req, PHASE_CONNECTED);
+                TRACE_INFO(TR_CONNECTED, req->id, req->conn_handle, 0);
+
+                // Known peer: read straight away with the cached handle
+                uint16_t val_handle = gatt_cache_val_handle(&req->addr, req->sensor_uuid);
+                // Subscriptions need discovery to find the CCCD, downloads the backlog
+                if (val_handle != 0 && !req->subscribe && !req->backlog) {
+                    TRACE_DEBUG(TR_CACHED_READ, req->id, val_handle, 0);
+                    req->cached_read = true;
+                    request_set_state(req, REQ_READING);
+                    TIMING_STAMP(req, TP_READ_START);
+                    if (ble_gattc_read(req->conn_handle, val_handle, gatt_read_cb, NULL) == 0) {
+                        ble_connect_next();
+                        break;
+                    }
+                    req->cached_read = false;
                 }
+
+                // Start service discovery immediately after connection
+                start_discovery(req);
+            } else if (req->timed_out) {
+                TRACE_ERROR(TR_CONNECT_CANCELLED, req->id, 0, 0);
+                request_fail(req, "Connect timeout");
             } else {
-                printf("[ERROR] Connection failed: %d\n", event->connect.status);
-                nimble_scanner_start();
+                TRACE_ERROR(TR_CONNECT_FAILED, req->id, event->connect.status, 0);
+                // Known address may be gone, look for the sensor again
+                request_set_state(req, REQ_SCANNING);
             }
+            ble_connect_next();
             break;
+        }
+
+        case BLE_GAP_EVENT_DISCONNECT: {
+            uint16_t handle = event->disconnect.conn.conn_handle;
+            TRACE_INFO(TR_DISCONNECTED, handle, event->disconnect.reason, 0);
+
+            // Link lost before the read completed, also on a pooled link: the
+            // pool reconnects under a new handle the query never learns
+            gw_request_t *req = request_find_by_conn(handle);
+            if (req) {
+                char msg[48];
+                snprintf(msg, sizeof(msg), "Disconnected during %s (reason=%d)",
+                         request_state_str(req->state), event->disconnect.reason);
+                request_fail(req, msg);
+            }
+
+            // Pooled links are evicted or reconnected by the pool
+            if (conn_pool_on_disconnect(handle, event->disconnect.reason)) {
+                break;
+            }
+            subscribe_on_disconnect(handle);
+            break;
+        }
+
+        case BLE_GAP_EVENT_CONN_UPDATE: {
+            uint16_t handle = event->conn_update.conn_handle;
+            struct ble_gap_conn_desc desc;
+            uint16_t itvl = ble_gap_conn_find(handle, &desc) == 0 ? desc.conn_itvl : 0;
+            TRACE_INFO(TR_CONN_UPDATE, handle, event->conn_update.status, itvl);
+            conn_pool_on_update(handle, event->conn_update.status);
+            break;
+        }
 
-        case BLE_GAP_EVENT_DISCONNECT:
-            printf("[INFO] Disconnected: reason=%d\n", event->disconnect.reason);
-            connecting = false;
-            conn_handle = 0;
+        case BLE_GAP_EVENT_NOTIFY_RX:
+            subscribe_on_notify(event->notify_rx.conn_handle,
+                                event->notify_rx.attr_handle, event->notify_rx.om);
             break;
 
         default:
-            printf("[DEBUG] Unhandled GAP event: %d\n", event->type);
+            TRACE_DEBUG(TR_GAP_EVENT, event->type, 0, 0);
             break;
     }
 
@@ -230,78 +581,200 @@ int gap_event_cb(struct ble_gap_event *event, void *arg)
     return 0;
 }
 
-/**Scanner callback function */
+/*
+*Deadline of the current phase of a request expired, runs in the NimBLE
+*host context.
+*/
+void ble_request_timeout(gw_request_t *req)
+{
+    uint32_t elapsed = ztimer_now(ZTIMER_MSEC) - req->start_time;
+    char msg[64];
+
+    TRACE_ERROR(TR_TIMEOUT, req->id, req->state, elapsed);
+
+    switch (req->state) {
+        case REQ_SCANNING:
+            snprintf(msg, sizeof(msg), "Scan timeout - no %s sensor found after %lu ms",
+                     req->type_name, elapsed);
+            request_fail(req, msg);
+            break;
+
+        case REQ_CONNECTING:
+            // Completed by the connect event that reports the cancel,
+            // which may be delivered before conn_cancel returns
+            req->timed_out = true;
+            if (ble_gap_conn_cancel() != 0) {
+                req->timed_out = false;
+            }
+            break;
+
+        case REQ_CONNECT_PENDING:
+            request_fail(req, "Timeout waiting for the connect slot");
+            break;
+
+        case REQ_DISCOVERING:
+        case REQ_READING:
+        case REQ_SUBSCRIBING:
+        case REQ_DRAINING: {
+            uint16_t conn = req->conn_handle;
+            snprintf(msg, sizeof(msg), "Timeout while %s after %lu ms",
+                     request_state_str(req->state), elapsed);
+            request_fail(req, msg);
+            conn_pool_remove(conn);
+            ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+/*
+*Read a sensor over a link that is already open.
+*returns: rc of ble_gattc_read, 0 on success.
+*/
+int ble_read_sensor(gw_request_t *req, uint16_t conn, uint16_t val_handle)
+{
+    request_set_state(req, REQ_READING);
+    req->conn_handle = conn;
+    req->cached_read = false;
+    req->connect_time = ztimer_now(ZTIMER_MSEC);
+    TIMING_STAMP(req, TP_READ_START);
+    int rc = ble_gattc_read(conn, val_handle, gatt_read_cb, NULL);
+    if (rc != 0) {
+        TRACE_ERROR(TR_READ_FAILED, conn, rc, 0);
+        req->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    }
+    return rc;
+}
+
+/*
+*Look up the characteristics of a sensor over a link that is already open.
+*returns: rc of the service discovery, 0 on success.
+*/
+int ble_discover_sensor(gw_request_t *req, uint16_t conn)
+{
+    req->conn_handle = conn;
+    req->connect_time = ztimer_now(ZTIMER_MSEC);
+    int rc = start_discovery(req);
+    if (rc != 0) {
+        req->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    }
+    return rc;
+}
+
+/*
+*Connect to the sensor at req->addr with the connection profile of the
+*request. NimBLE initiates one connection at a time and cannot do so while
+*scanning, so the request waits for the connect slot if another request
+*holds it, and the scanner is stopped first.
+*returns: rc of ble_gap_connect, 0 on success or when queued.
+*/
+int ble_connect_sensor(gw_request_t *req)
+{
+    if (request_find_state(REQ_CONNECTING, 0) || conn_pool_connecting()) {
+        request_set_state(req, REQ_CONNECT_PENDING);
+        conn_pool_yield();
+        return 0;
+    }
+
+    request_set_state(req, REQ_CONNECTING);
+    nimble_scanner_stop();
+
+    struct ble_gap_conn_params conn_params;
+    conn_profile_params(req->conn_profile, &conn_params);
+
+    // The request deadline bounds the connect, not NimBLE
+    TIMING_STAMP(req, TP_CONNECT);
+    int rc = ble_gap_connect(BLE_OWN_ADDR_RANDOM, &req->addr, BLE_HS_FOREVER, &conn_params,
+                             gap_event_cb, req);
+    if (rc != 0) {
+        TRACE_ERROR(TR_CONNECT_FAILED, req->id, rc, 0);
+        // Wait for the next advertisement instead
+        request_set_state(req, REQ_SCANNING);
+        ble_connect_next();
+    }
+    return rc;
+}
+
+/*
+*Complete a request from the reading a sensor broadcasts in its ESS service
+*data, without connecting.
+*returns: true if the advertisement carried a reading.
+*/
+static bool read_from_adv(gw_request_t *req, const ble_addr_t *addr,
+                          const uint8_t *ad, size_t ad_len)
+{
+    size_t len;
+    const uint8_t *data = adv_find_svc_data16(ad, ad_len, ENV_SENSING_SERVICE_UUID, &len);
+
+    env_wire_sample_t sample;
+    if (!data || env_wire_adv_decode(data, len, &sample) != 0) return false;
+
+    req->addr = *addr;
+    sensor_response_t *response = req->response;
+    int16_t reading = req->sensor_uuid == TEMPERATURE_CHARACTERISTIC_UUID ?
+                      sample.temperature : (int16_t)sample.humidity;
+    response->value = reading / 100.0;
+    response->timestamp = sample.timestamp;
+    response->discovery_latency_ms = ztimer_now(ZTIMER_MSEC) - req->start_time;
+    response->read_latency_ms = 0;
+    response->success = true;
+    request_mark_phase(req, PHASE_READ_DONE);
+
+    TRACE_INFO(TR_ADV_READING, req->id, reading, 0);
+    ble_request_complete(req);
+    return true;
+}
+
+/*
+*Scanner callback function. Runs for every advertisement heard, so foreign
+*advertisers are rejected on the raw AD bytes before anything else is done.
+*/
 void scan_cb(uint8_t type, const ble_addr_t *addr,
              const nimble_scanner_info_t *info,
              const uint8_t *ad, size_t ad_len)
 {
-    (void)type;
+    TIMING_NOW(rx_us);
+    uint8_t match = adv_filter_match(&sensor_filter, ad, ad_len);
+    if (!match) return;
 
+    presence_update(type, addr, info, ad, ad_len);
+    scan_sched_observe(addr, match);
+    registry_observe(addr, match, info->rssi);
 
-    uint16_t my_sensor_uuid = 0;
+    // Background scan with no query waiting for an advertisement
+    if (!request_find_state(REQ_SCANNING, 0)) return;
 
-    if (strcmp(target_type, "TEMP") == 0) {
-        my_sensor_uuid = TEMPERATURE_CHARACTERISTIC_UUID;  
-        printf("[INFO] Looking for sensor type: %s\n", target_type);
+    for (uint8_t i = 0; i < sensor_filter.num_uuids; i++) {
+        if (!(match & (1 << i))) continue;
 
-    } else if (strcmp(target_type, "HUM") == 0) {
-        my_sensor_uuid = HUMIDITY_CHARACTERISTIC_UUID;     
-        printf("[INFO] Looking for sensor type: %s\n", target_type);
+        // look for a request waiting for this sensor type
+        gw_request_t *req = request_find_scanning(sensor_filter.uuids[i], addr);
+        if (!req) continue;
 
-    } else {
-        printf("[ERR] Unknown sensor type: %s\n", target_type);
-        return;
-    }
+        TIMING_STAMP_AT(req, TP_ADV_RX, rx_us);
+        request_mark_phase(req, PHASE_ADV_MATCH);
 
-    if (connecting) return;
+        // Discovery and readout in one advertising event
+        if (req->broadcast_ok && read_from_adv(req, addr, ad, ad_len)) continue;
 
-    struct ble_hs_adv_fields fields;
-    if (ble_hs_adv_parse_fields(&fields, ad, ad_len) != 0) {
-        printf("[WARN] Failed to parse advertisement\n");
-        return;
-    }
+        // Sensor is busy with another request
+        if (request_find_by_addr(addr)) return;
 
-    if(DEBUG)
-        printf("[DEBUG] Device found: RSSI=%d dBm\n", info->rssi);
-
-    for (int i = 0; i < fields.num_uuids16; i++) {
-        if(DEBUG)
-            printf("[DEBUG] UUID16: 0x%04X\n", fields.uuids16[i].value);
-
-        // look for the correct UUID based on the sensor
-        if (fields.uuids16[i].value == my_sensor_uuid) {
-            uint32_t scan_time_ms = get_scan_elapsed_ms();
-
-
-            printf("[INFO] Found target sensor in %lu ms (RSSI: %d dBm)\n", 
-                scan_time_ms, info->rssi);
-            active_response->discovery_latency_ms = scan_time_ms;
-            if(DEBUG)
-                printf("[DEBUG] Found ESS device (RSSI: %d dBm)\n", info->rssi);
-            connecting = true;
-            scan_timeout_active =false;
-            
-
-            nimble_scanner_stop();
-
-            struct ble_gap_conn_params conn_params = {
-                .scan_itvl = 0x0010,    
-                .scan_window = 0x0010,  
-                .itvl_min = BLE_GAP_INITIAL_CONN_ITVL_MIN,
-                .itvl_max = BLE_GAP_INITIAL_CONN_ITVL_MAX,
-                .latency = 0,
-                .supervision_timeout = BLE_GAP_INITIAL_SUPERVISION_TIMEOUT,
-                .min_ce_len = BLE_GAP_INITIAL_CONN_MIN_CE_LEN,
-                .max_ce_len = BLE_GAP_INITIAL_CONN_MAX_CE_LEN,
-            };
-            
-            int rc = ble_gap_connect(BLE_OWN_ADDR_RANDOM, addr, 2500, &conn_params, gap_event_cb, NULL);
-            if (rc != 0) {
-                printf("[ERROR] Connection failed: %d\n", rc);
-                connecting = false;
-                nimble_scanner_start();
-            }
-            return;
-        }
+        // Take over the link of the read in progress instead of opening another,
+        // unless the query is for another node
+        gw_request_t *linked = request_find_linked();
+        if (linked && (!req->targeted || ble_addr_cmp(&linked->addr, addr) == 0)) return;
+
+        uint32_t scan_time_ms = ztimer_now(ZTIMER_MSEC) - req->start_time;
+
+        TRACE_INFO(TR_SCAN_FOUND, req->id, scan_time_ms, info->rssi);
+        req->response->discovery_latency_ms = scan_time_ms;
+        req->addr = *addr;
+
+        ble_connect_sensor(req);
+        return;
     }
-}
\ No newline at end of file
+}
@@ -12,6 +12,7 @@
 #include "host/ble_uuid.h"
 #include "nimble_scanner.h"
 #include "host/ble_hs.h"
+#include "adv_filter.h"
 #define ENV_SENSING_SERVICE_UUID     0x181A
 #define TEMPERATURE_CHARACTERISTIC_UUID 0x2A6E
 #define HUMIDITY_CHARACTERISTIC_UUID    0x2A6F
@@ -21,21 +22,33 @@
 #define DEFAULT_SCAN_INTERVAL_MS 30
 #define DEFAULT_SCAN_DURATION_MS 9000  // 9 seconds scan
 
-extern uint32_t scan_start_time;
-extern bool scan_timeout_active;
-
-
-extern const char *target_type;
 extern sensor_response_t *active_response;
+extern const adv_filter_t sensor_filter;
+
+typedef struct gw_request_t gw_request_t;
 
 void scan_cb(uint8_t type, const ble_addr_t *addr,
              const nimble_scanner_info_t *info,
              const uint8_t *ad, size_t ad_len);
 
-void generate_request_id(char *request_id, size_t size);
+int ble_scan_update(void);
+bool ble_queries_need_radio(void);
+void ble_connect_next(void);
+int ble_decode_reading(struct os_mbuf *om, uint32_t *seq, int16_t *reading,
+                       uint32_t *timestamp);
+void ble_publish_response(const sensor_response_t *response);
+void ble_request_release(gw_request_t *req);
+int ble_connect_sensor(gw_request_t *req);
+int ble_read_sensor(gw_request_t *req, uint16_t conn, uint16_t val_handle);
+int ble_discover_sensor(gw_request_t *req, uint16_t conn);
+void ble_request_complete(gw_request_t *req);
 int gap_event_cb(struct ble_gap_event *event, void *arg);
 int gatt_read_cb(uint16_t conn_handle_param, const struct ble_gatt_error *error,
                  struct ble_gatt_attr *attr, void *arg);
-void check_scan_timeout(void);
+void ble_request_timeout(gw_request_t *req);
+void ble_host_init(void);
+void ble_host_call(void (*fn)(void *arg), void *arg);
+int ble_host_cmd(int (*cmd)(int argc, char **argv), int argc, char **argv);
+bool ble_request_active(uint32_t id);
 
 #endif /* BLE_HANDLER_H */
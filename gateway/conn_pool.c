@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ztimer.h"
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_npl.h"
+#include "ble_handler.h"
+#include "request.h"
+#include "gatt_cache.h"
+#include "conn_pool.h"
+#include "conn_profile.h"
+#include "trace.h"
+
+bool conn_pool_enabled = false;
+unsigned conn_pool_max = CONN_POOL_SIZE;
+
+static conn_pool_entry_t pool[CONN_POOL_SIZE];
+// Reconnect holding the connect slot shared with the queries, NULL if none
+static conn_pool_entry_t *pool_connecting;
+
+// Maintenance timer, runs in the NimBLE host context
+static struct ble_npl_callout pool_timer;
+
+static int pool_gap_cb(struct ble_gap_event *event, void *arg);
+
+static conn_pool_entry_t *find_by_handle(uint16_t conn_handle)
+{
+    for (unsigned i = 0; i < CONN_POOL_SIZE; i++) {
+        if (pool[i].in_use && pool[i].conn_handle == conn_handle) {
+            return &pool[i];
+        }
+    }
+    return NULL;
+}
+
+// Peer address for log lines
+static const char *addr_str(const ble_addr_t *addr)
+{
+    static char buf[18];
+    snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x",
+             addr->val[5], addr->val[4], addr->val[3],
+             addr->val[2], addr->val[1], addr->val[0]);
+    return buf;
+}
+
+// Links in the pool, not counting those being closed
+static unsigned pool_count(void)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < CONN_POOL_SIZE; i++) {
+        if (pool[i].in_use && !pool[i].evicting) count++;
+    }
+    return count;
+}
+
+/*
+* Close a pooled link. A reconnect still in ble_gap_connect is cancelled,
+* the slot is freed by its connect event so a link the cancel came too late
+* for is closed rather than leaked.
+*/
+static void pool_evict(conn_pool_entry_t *e)
+{
+    if (e->conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+        if (e->reconnect_pending) {
+            // Waiting for the retry timer, no connect in progress
+            e->in_use = false;
+        } else {
+            e->evicting = true;
+            ble_gap_conn_cancel();
+        }
+        return;
+    }
+    e->evicting = true;
+    ble_gap_terminate(e->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+static conn_pool_entry_t *least_recently_used(void)
+{
+    conn_pool_entry_t *lru = NULL;
+    for (unsigned i = 0; i < CONN_POOL_SIZE; i++) {
+        if (!pool[i].in_use || pool[i].evicting) continue;
+        if (!lru || pool[i].last_used_ms < lru->last_used_ms) {
+            lru = &pool[i];
+        }
+    }
+    return lru;
+}
+
+// Move a link to the parameters of its profile, one update at a time
+static void pool_apply_profile(conn_pool_entry_t *e)
+{
+    if (e->update_pending || e->conn_handle == BLE_HS_CONN_HANDLE_NONE) return;
+    if (conn_profile_active(e->conn_handle, e->profile)) return;
+
+    if (conn_profile_update(e->conn_handle, e->profile) == 0) {
+        e->update_pending = true;
+        e->update_profile = e->profile;
+    }
+}
+
+/*
+* Reconnect a dropped link through the connect slot the queries use. Queries
+* come first: while one scans or connects, the reconnect is retried from the
+* timer without counting the attempt.
+*/
+static void pool_reconnect(conn_pool_entry_t *e)
+{
+    e->reconnect_pending = true;
+    if (pool_connecting || ble_queries_need_radio()) {
+        TRACE_DEBUG(TR_POOL_DEFERRED, e - pool, 0, 0);
+        return;
+    }
+
+    // Nothing to read yet, come back up with the idle parameters
+    struct ble_gap_conn_params conn_params;
+    e->profile = conn_profile_idle;
+    e->update_pending = false;
+    conn_profile_params(e->profile, &conn_params);
+
+    // Holding the slot stops the background scanner, NimBLE cannot do both
+    pool_connecting = e;
+    ble_scan_update();
+
+    e->retries++;
+    int rc = ble_gap_connect(BLE_OWN_ADDR_RANDOM, &e->addr, CONNECT_TIMEOUT_MS, &conn_params,
+                             pool_gap_cb, e);
+    if (rc != 0) {
+        TRACE_DEBUG(TR_POOL_DEFERRED, e - pool, rc, 0);
+        pool_connecting = NULL;
+        ble_scan_update();
+        return;
+    }
+    e->reconnect_pending = false;
+}
+
+bool conn_pool_connecting(void)
+{
+    return pool_connecting != NULL;
+}
+
+/*
+* A query needs the radio: cancel the reconnect holding the connect slot,
+* it is retried once the queries are done.
+*/
+void conn_pool_yield(void)
+{
+    conn_pool_entry_t *e = pool_connecting;
+    if (!e || e->evicting || e->yielding) return;
+
+    e->yielding = true;
+    ble_gap_conn_cancel();
+}
+
+/*
+* Arm the maintenance timer for the next thing due: a reconnect retry or
+* the earliest idle timeout.
+*/
+static void pool_schedule(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    uint32_t next = UINT32_MAX;
+
+    for (unsigned i = 0; i < CONN_POOL_SIZE; i++) {
+        conn_pool_entry_t *e = &pool[i];
+        if (!e->in_use || e->evicting) continue;
+
+        uint32_t due;
+        if (e->reconnect_pending) {
+            due = CONN_POOL_RETRY_MS;
+        } else if (e->conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+            continue;
+        } else {
+            uint32_t idle = now - e->last_used_ms;
+            due = idle >= CONN_POOL_IDLE_TIMEOUT_MS ? 0 : CONN_POOL_IDLE_TIMEOUT_MS - idle;
+        }
+        if (due < next) next = due;
+    }
+
+    if (next == UINT32_MAX) {
+        ble_npl_callout_stop(&pool_timer);
+    } else {
+        ble_npl_callout_reset(&pool_timer, ble_npl_time_ms_to_ticks32(next));
+    }
+}
+
+static void pool_timer_cb(struct ble_npl_event *ev)
+{
+    (void)ev;
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+
+    for (unsigned i = 0; i < CONN_POOL_SIZE; i++) {
+        conn_pool_entry_t *e = &pool[i];
+        if (!e->in_use || e->evicting) continue;
+
+        if (e->reconnect_pending) {
+            if (e->retries >= CONN_POOL_MAX_RETRIES) {
+                TRACE_ERROR(TR_POOL_UNREACHABLE, e - pool, e->retries, 0);
+                e->in_use = false;
+            } else {
+                pool_reconnect(e);
+            }
+        } else if (e->conn_handle != BLE_HS_CONN_HANDLE_NONE &&
+                   now - e->last_used_ms >= CONN_POOL_IDLE_TIMEOUT_MS) {
+            TRACE_INFO(TR_POOL_IDLE, e - pool, e->conn_handle, 0);
+            pool_evict(e);
+        }
+    }
+    pool_schedule();
+}
+
+/** GAP callback for links re-established by the pool */
+static int pool_gap_cb(struct ble_gap_event *event, void *arg)
+{
+    conn_pool_entry_t *e = arg;
+
+    switch (event->type) {
+        case BLE_GAP_EVENT_CONNECT:
+            if (pool_connecting == e) pool_connecting = NULL;
+            if (e->evicting) {
+                // Evicted while reconnecting, the disconnect frees the slot
+                if (event->connect.status == 0) {
+                    e->conn_handle = event->connect.conn_handle;
+                    ble_gap_terminate(e->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                } else {
+                    e->in_use = false;
+                }
+            } else if (event->connect.status == 0) {
+                e->conn_handle = event->connect.conn_handle;
+                e->reconnect_pending = false;
+                e->retries = 0;
+                e->last_used_ms = ztimer_now(ZTIMER_MSEC);
+                TRACE_INFO(TR_POOL_RESTORED, e - pool, e->conn_handle, 0);
+            } else {
+                // Cancelled for a query: the attempt does not count
+                if (e->yielding) e->retries--;
+                e->reconnect_pending = true;
+            }
+            e->yielding = false;
+            pool_schedule();
+            // The connect slot is free for the queries again
+            ble_connect_next();
+            break;
+
+        case BLE_GAP_EVENT_CONN_UPDATE:
+            conn_pool_on_update(event->conn_update.conn_handle, event->conn_update.status);
+            break;
+
+        case BLE_GAP_EVENT_DISCONNECT:
+            // Fails a query reading over the link, then back to the pool
+            return gap_event_cb(event, NULL);
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+void conn_pool_init(void)
+{
+    for (unsigned i = 0; i < CONN_POOL_SIZE; i++) {
+        pool[i].in_use = false;
+        pool[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    }
+    ble_npl_callout_init(&pool_timer, nimble_port_get_dflt_eventq(),
+                         pool_timer_cb, NULL);
+}
+
+/*
+* Keep the link of a completed read open for later queries, moved to the
+* idle connection profile. The least recently used link is closed when the
+* pool is full.
+* returns: 0 if the link was pooled, the caller must disconnect otherwise.
+*/
+int conn_pool_add(uint16_t conn_handle)
+{
+    if (!conn_pool_enabled || conn_pool_max == 0) return -1;
+
+    struct ble_gap_conn_desc desc;
+    if (ble_gap_conn_find(conn_handle, &desc) != 0) return -1;
+
+    conn_pool_entry_t *e = find_by_handle(conn_handle);
+    // An update already requested on a pooled link still completes
+    bool update_pending = e && e->update_pending;
+    uint8_t update_profile = e ? e->update_profile : 0;
+    if (!e) {
+        if (pool_count() >= conn_pool_max) {
+            conn_pool_entry_t *lru = least_recently_used();
+            if (!lru) return -1;
+            pool_evict(lru);
+        }
+        for (unsigned i = 0; i < CONN_POOL_SIZE && !e; i++) {
+            if (!pool[i].in_use) e = &pool[i];
+        }
+        // Evicted slot is only freed once its disconnect completes
+        if (!e) return -1;
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->in_use = true;
+    e->addr = desc.peer_id_addr;
+    e->conn_handle = conn_handle;
+    e->last_used_ms = ztimer_now(ZTIMER_MSEC);
+    e->update_pending = update_pending;
+    e->update_profile = update_profile;
+    e->profile = conn_profile_idle;
+    pool_apply_profile(e);
+
+    pool_schedule();
+    return 0;
+}
+
+/*
+* returns: an open pooled link to a node serving the given reading, or NULL.
+* The value handle to read is in the GATT cache of the node.
+*/
+conn_pool_entry_t *conn_pool_find(uint16_t sensor_uuid)
+{
+    if (!conn_pool_enabled) return NULL;
+
+    for (unsigned i = 0; i < CONN_POOL_SIZE; i++) {
+        conn_pool_entry_t *e = &pool[i];
+        if (e->in_use && !e->evicting && e->conn_handle != BLE_HS_CONN_HANDLE_NONE &&
+            gatt_cache_val_handle(&e->addr, sensor_uuid) != 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+* returns: the open pooled link to the node at addr if it serves the given
+* reading, or NULL.
+*/
+conn_pool_entry_t *conn_pool_find_node(const ble_addr_t *addr, uint16_t sensor_uuid)
+{
+    if (!conn_pool_enabled) return NULL;
+
+    for (unsigned i = 0; i < CONN_POOL_SIZE; i++) {
+        conn_pool_entry_t *e = &pool[i];
+        if (e->in_use && !e->evicting && e->conn_handle != BLE_HS_CONN_HANDLE_NONE &&
+            ble_addr_cmp(&e->addr, addr) == 0) {
+            return gatt_cache_val_handle(addr, sensor_uuid) != 0 ? e : NULL;
+        }
+    }
+    return NULL;
+}
+
+bool conn_pool_contains(uint16_t conn_handle)
+{
+    return find_by_handle(conn_handle) != NULL;
+}
+
+void conn_pool_touch(uint16_t conn_handle)
+{
+    conn_pool_entry_t *e = find_by_handle(conn_handle);
+    if (e) {
+        e->last_used_ms = ztimer_now(ZTIMER_MSEC);
+        pool_schedule();
+    }
+}
+
+// Forget a link, e.g. after a failed read, without reconnecting
+void conn_pool_remove(uint16_t conn_handle)
+{
+    conn_pool_entry_t *e = find_by_handle(conn_handle);
+    if (e) {
+        e->in_use = false;
+        pool_schedule();
+    }
+}
+
+/*
+* Switch a pooled link to another connection profile, e.g. to the query
+* profile while a read is served over it.
+*/
+void conn_pool_set_profile(uint16_t conn_handle, uint8_t profile)
+{
+    conn_pool_entry_t *e = find_by_handle(conn_handle);
+    if (e) {
+        e->profile = profile;
+        pool_apply_profile(e);
+    }
+}
+
+/*
+* Parameter update of a link completed. The profile may have changed again
+* while it was in progress, the link follows with another update then.
+*/
+void conn_pool_on_update(uint16_t conn_handle, int status)
+{
+    conn_pool_entry_t *e = find_by_handle(conn_handle);
+    if (!e) return;
+
+    e->update_pending = false;
+    if (status != 0) {
+        TRACE_ERROR(TR_POOL_REJECTED, e - pool, e->update_profile, status);
+    } else if (e->profile != e->update_profile) {
+        pool_apply_profile(e);
+    }
+}
+
+/*
+* Handle the disconnect of a pooled link: free the slot if we closed it,
+* reconnect otherwise.
+* returns: true if the link belonged to the pool.
+*/
+bool conn_pool_on_disconnect(uint16_t conn_handle, int reason)
+{
+    conn_pool_entry_t *e = find_by_handle(conn_handle);
+    if (!e) return false;
+
+    e->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    if (e->evicting || !conn_pool_enabled) {
+        e->in_use = false;
+    } else {
+        TRACE_ERROR(TR_POOL_DROPPED, e - pool, reason, 0);
+        e->retries = 0;
+        pool_reconnect(e);
+    }
+    pool_schedule();
+    return true;
+}
+
+void conn_pool_flush(void)
+{
+    for (unsigned i = 0; i < CONN_POOL_SIZE; i++) {
+        if (pool[i].in_use && !pool[i].evicting) pool_evict(&pool[i]);
+    }
+}
+
+void conn_pool_print(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+
+    printf("Connection pool: %s, %u/%u links (max %u)\n",
+           conn_pool_enabled ? "on" : "off", pool_count(), conn_pool_max,
+           (unsigned)CONN_POOL_SIZE);
+    for (unsigned i = 0; i < CONN_POOL_SIZE; i++) {
+        conn_pool_entry_t *e = &pool[i];
+        if (!e->in_use) continue;
+        printf("[%u] sensor %s  handle: %d  idle: %lu ms  %s%s%s\n", i,
+               addr_str(&e->addr), e->conn_handle, (unsigned long)(now - e->last_used_ms),
+               conn_profiles[e->profile].name,
+               e->update_pending ? " (updating)" : "",
+               e->reconnect_pending ? "  (reconnecting)" : "");
+    }
+}
+
+static int pool_cmd(int argc, char **argv)
+{
+    if (argc > 1) {
+        if (strcmp(argv[1], "on") == 0) {
+            conn_pool_enabled = true;
+        } else if (strcmp(argv[1], "off") == 0) {
+            conn_pool_enabled = false;
+            conn_pool_flush();
+        } else if (strcmp(argv[1], "flush") == 0) {
+            conn_pool_flush();
+        } else if (strcmp(argv[1], "max") == 0 && argc > 2) {
+            int max = atoi(argv[2]);
+            if (max < 0 || max > CONN_POOL_SIZE) {
+                printf("[ERR] max must be 0..%u\n", (unsigned)CONN_POOL_SIZE);
+                return 1;
+            }
+            conn_pool_max = max;
+            // Close the least recently used links above the new limit
+            while (pool_count() > conn_pool_max) {
+                conn_pool_entry_t *lru = least_recently_used();
+                if (!lru) break;
+                pool_evict(lru);
+            }
+        } else {
+            printf("usage: %s [on|off|flush|max <n>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    conn_pool_print();
+    return 0;
+}
+
+/**Shell command */
+int cmd_pool(int argc, char **argv)
+{
+    // Pool changes run with the GAP events
+    return ble_host_cmd(pool_cmd, argc, argv);
+}
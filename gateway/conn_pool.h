@@ -0,0 +1,56 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host/ble_hs.h"
+
+#if MYNEWT_VAL(BLE_MAX_CONNECTIONS) < 2
+#error "Connection pool needs NIMBLE_MAX_CONN >= 2"
+#endif
+
+// One connection is always left free for a query to a new sensor
+#define CONN_POOL_SIZE (MYNEWT_VAL(BLE_MAX_CONNECTIONS) - 1)
+
+// Pooled links unused for this long are closed
+#define CONN_POOL_IDLE_TIMEOUT_MS 30000
+// Delay between reconnect attempts for a dropped link
+#define CONN_POOL_RETRY_MS        500
+#define CONN_POOL_MAX_RETRIES     3
+
+// Open link to a known sensor
+typedef struct conn_pool_entry_t {
+    bool in_use;
+    bool evicting;                 // We closed the link, do not reconnect
+    bool reconnect_pending;        // Link dropped, waiting for a reconnect
+    bool yielding;                 // Reconnect cancelled for a query, not a retry
+    uint8_t retries;               // Reconnect attempts since the drop
+    ble_addr_t addr;               // Peer address
+    uint16_t conn_handle;          // BLE_HS_CONN_HANDLE_NONE while down
+    uint32_t last_used_ms;         // Last read served over this link
+    uint8_t profile;               // conn_profile_id_t the link should run with
+    uint8_t update_profile;        // Profile of the parameter update in progress
+    bool update_pending;           // Waiting for BLE_GAP_EVENT_CONN_UPDATE
+} conn_pool_entry_t;
+
+extern bool conn_pool_enabled;
+extern unsigned conn_pool_max;
+
+void conn_pool_init(void);
+int conn_pool_add(uint16_t conn_handle);
+conn_pool_entry_t *conn_pool_find(uint16_t sensor_uuid);
+conn_pool_entry_t *conn_pool_find_node(const ble_addr_t *addr, uint16_t sensor_uuid);
+bool conn_pool_contains(uint16_t conn_handle);
+bool conn_pool_connecting(void);
+void conn_pool_yield(void);
+void conn_pool_touch(uint16_t conn_handle);
+void conn_pool_remove(uint16_t conn_handle);
+void conn_pool_set_profile(uint16_t conn_handle, uint8_t profile);
+void conn_pool_on_update(uint16_t conn_handle, int status);
+bool conn_pool_on_disconnect(uint16_t conn_handle, int reason);
+void conn_pool_flush(void);
+void conn_pool_print(void);
+
+int cmd_pool(int argc, char **argv);
+
+#endif /* CONN_POOL_H */
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "conn_profile.h"
+#include "trace.h"
+
+const conn_profile_t conn_profiles[CONN_PROFILE_COUNT] = {
+    [CONN_PROFILE_DEFAULT] = {
+        .name = "default",
+        .itvl_min = BLE_GAP_INITIAL_CONN_ITVL_MIN,
+        .itvl_max = BLE_GAP_INITIAL_CONN_ITVL_MAX,
+        .latency = 0,
+        .supervision_timeout = BLE_GAP_INITIAL_SUPERVISION_TIMEOUT,
+    },
+    // 7.5 ms, the shortest interval the spec allows
+    [CONN_PROFILE_QUICK_READ] = {
+        .name = "quick-read",
+        .itvl_min = BLE_GAP_CONN_ITVL_MS(7.5),
+        .itvl_max = BLE_GAP_CONN_ITVL_MS(7.5),
+        .latency = 0,
+        .supervision_timeout = BLE_GAP_SUPERVISION_TIMEOUT_MS(1000),
+    },
+    // The sensor listens every 4th event: a read on an idle link waits up
+    // to 800 ms for it, inside READ_TIMEOUT_MS
+    [CONN_PROFILE_KEEP_ALIVE] = {
+        .name = "keep-alive",
+        .itvl_min = BLE_GAP_CONN_ITVL_MS(150),
+        .itvl_max = BLE_GAP_CONN_ITVL_MS(200),
+        .latency = 3,
+        .supervision_timeout = BLE_GAP_SUPERVISION_TIMEOUT_MS(4000),
+    },
+};
+
+// Profile of the links opened or reused for queries
+conn_profile_id_t conn_profile_query = CONN_PROFILE_QUICK_READ;
+// Profile of pooled links between queries
+conn_profile_id_t conn_profile_idle = CONN_PROFILE_KEEP_ALIVE;
+
+/*
+*returns: the profile with the given name, -1 if there is none.
+*/
+int conn_profile_find(const char *name)
+{
+    for (int i = 0; i < CONN_PROFILE_COUNT; i++) {
+        if (strcmp(conn_profiles[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+/*
+*Connect parameters of a profile. The initiator scans continuously, 10 ms
+*window every 10 ms.
+*/
+void conn_profile_params(conn_profile_id_t id, struct ble_gap_conn_params *params)
+{
+    const conn_profile_t *p = &conn_profiles[id];
+
+    memset(params, 0, sizeof(*params));
+    params->scan_itvl = 0x0010;
+    params->scan_window = 0x0010;
+    params->itvl_min = p->itvl_min;
+    params->itvl_max = p->itvl_max;
+    params->latency = p->latency;
+    params->supervision_timeout = p->supervision_timeout;
+    params->min_ce_len = BLE_GAP_INITIAL_CONN_MIN_CE_LEN;
+    params->max_ce_len = BLE_GAP_INITIAL_CONN_MAX_CE_LEN;
+}
+
+/*
+*returns: true if the link already runs with the parameters of a profile.
+*/
+bool conn_profile_active(uint16_t conn_handle, conn_profile_id_t id)
+{
+    const conn_profile_t *p = &conn_profiles[id];
+    struct ble_gap_conn_desc desc;
+
+    if (ble_gap_conn_find(conn_handle, &desc) != 0) return false;
+    return desc.conn_itvl >= p->itvl_min && desc.conn_itvl <= p->itvl_max &&
+           desc.conn_latency == p->latency;
+}
+
+/*
+*Request the parameters of a profile on an open link. The change takes
+*effect a few connection events later, with BLE_GAP_EVENT_CONN_UPDATE.
+*returns: rc of ble_gap_update_params, 0 on success.
+*/
+int conn_profile_update(uint16_t conn_handle, conn_profile_id_t id)
+{
+    const conn_profile_t *p = &conn_profiles[id];
+    struct ble_gap_upd_params params = {
+        .itvl_min = p->itvl_min,
+        .itvl_max = p->itvl_max,
+        .latency = p->latency,
+        .supervision_timeout = p->supervision_timeout,
+        .min_ce_len = BLE_GAP_INITIAL_CONN_MIN_CE_LEN,
+        .max_ce_len = BLE_GAP_INITIAL_CONN_MAX_CE_LEN,
+    };
+
+    int rc = ble_gap_update_params(conn_handle, &params);
+    if (rc != 0) {
+        // Called from GAP event callbacks, no printing on the host thread
+        TRACE_ERROR(TR_CONN_PARAMS_FAILED, conn_handle, id, rc);
+    }
+    return rc;
+}
+
+static void conn_profile_print(void)
+{
+    printf("%-11s %10s %8s %8s\n", "profile", "itvl (ms)", "latency", "timeout");
+    for (unsigned i = 0; i < CONN_PROFILE_COUNT; i++) {
+        const conn_profile_t *p = &conn_profiles[i];
+        printf("%-11s %4u-%-5u %8u %6u ms%s%s\n", p->name,
+               p->itvl_min * 5 / 4, p->itvl_max * 5 / 4, p->latency,
+               p->supervision_timeout * 10,
+               i == conn_profile_query ? "  [query]" : "",
+               i == conn_profile_idle ? "  [idle]" : "");
+    }
+}
+
+/**Shell command */
+int cmd_connprof(int argc, char **argv)
+{
+    if (argc == 3) {
+        int id = conn_profile_find(argv[2]);
+        if (id < 0) {
+            printf("[ERR] Unknown profile %s\n", argv[2]);
+            return 1;
+        }
+        if (strcmp(argv[1], "query") == 0) {
+            conn_profile_query = id;
+        } else if (strcmp(argv[1], "idle") == 0) {
+            conn_profile_idle = id;
+        } else {
+            argc = 0;
+        }
+    }
+    if (argc != 1 && argc != 3) {
+        printf("usage: %s [query|idle <profile>]\n", argv[0]);
+        return 1;
+    }
+
+    conn_profile_print();
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef CONN_PROFILE_H
+#define CONN_PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host/ble_hs.h"
+
+// Connection parameter sets, picked per query and for idle pooled links
+typedef enum conn_profile_id_t {
+    CONN_PROFILE_DEFAULT = 0,      // NimBLE initial parameters
+    CONN_PROFILE_QUICK_READ,       // Shortest interval for discovery and read
+    CONN_PROFILE_KEEP_ALIVE,       // Long interval, peripheral may skip events
+    CONN_PROFILE_COUNT
+} conn_profile_id_t;
+
+typedef struct conn_profile_t {
+    const char *name;
+    uint16_t itvl_min;             // 1.25 ms units
+    uint16_t itvl_max;
+    uint16_t latency;              // Connection events the peripheral may skip
+    uint16_t supervision_timeout;  // 10 ms units
+} conn_profile_t;
+
+extern const conn_profile_t conn_profiles[CONN_PROFILE_COUNT];
+extern conn_profile_id_t conn_profile_query;
+extern conn_profile_id_t conn_profile_idle;
+
+int conn_profile_find(const char *name);
+void conn_profile_params(conn_profile_id_t id, struct ble_gap_conn_params *params);
+bool conn_profile_active(uint16_t conn_handle, conn_profile_id_t id);
+int conn_profile_update(uint16_t conn_handle, conn_profile_id_t id);
+
+int cmd_connprof(int argc, char **argv);
+
+#endif /* CONN_PROFILE_H */
@@ -1,166 +1,354 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
-#include "thread.h"
+#include <string.h>
 #include "shell.h"
 #include "ztimer.h"
 #include "application.h"
-
-// External declarations from your main gateway app
-extern int cmd_get_temp(int argc, char **argv);
-extern int cmd_get_humid(int argc, char **argv);
-extern sensor_response_t *active_response;
+#include "host/ble_hs_adv.h"
+#include "ble_handler.h"
+#include "adv_filter.h"
+#include "gateway.h"
+#include "conn_profile.h"
+#include "sim_ble.h"
 
 #define SUCCESS_THRESHOLD_MS 100  // Success = discovery faster than 100ms
 
-// Evaluation command for temperature
-int cmd_eval_temp(int argc, char **argv) {
-    int num_runs = 100;
-    if (argc > 1) num_runs = atoi(argv[1]);
-    
-    uint32_t total_latency = 0;
-    uint32_t min_latency = UINT32_MAX;
-    uint32_t max_latency = 0;
+#define BENCH_DEFAULT_RUNS    100
+#define BENCH_MAX_RUNS        200
+#define BENCH_DEFAULT_GAP_MS  1000
+#define BENCH_RUN_TIMEOUT_MS  10000  // Longer than all phase deadlines together
+
+// Rows of the end-to-end and connect-to-read figures in the sample table
+#define BENCH_TOTAL        PHASE_COUNT
+#define BENCH_CONNECT_READ (PHASE_COUNT + 1)
+#define BENCH_ROWS         (PHASE_COUNT + 2)
+
+static const char *const bench_row_name[BENCH_ROWS] = {
+    [PHASE_SCAN_START] = "scan start",
+    [PHASE_ADV_MATCH]  = "adv match",
+    [PHASE_CONNECTED]  = "connect",
+    [PHASE_SVC_FOUND]  = "service",
+    [PHASE_CHR_FOUND]  = "characteristic",
+    [PHASE_READ_DONE]  = "read",
+    [BENCH_TOTAL]      = "end-to-end",
+    [BENCH_CONNECT_READ] = "connect-to-read",
+};
+
+// Per-run duration of each phase, since the previous phase reached
+static uint16_t bench_samples[BENCH_ROWS][BENCH_MAX_RUNS];
+static unsigned bench_count[BENCH_ROWS];
+
+static sensor_response_t bench_response;
+
+static void bench_add(unsigned row, uint32_t ms)
+{
+    bench_samples[row][bench_count[row]++] = ms > UINT16_MAX ? UINT16_MAX : ms;
+}
+
+// Split the phase timestamps of a response into per-phase durations
+static void bench_record(const sensor_response_t *response)
+{
+    uint32_t prev = 0;
+
+    for (unsigned p = 0; p < PHASE_COUNT; p++) {
+        if (!(response->phases & (1 << p))) continue;
+        bench_add(p, response->phase_ms[p] - prev);
+        prev = response->phase_ms[p];
+    }
+    if (response->phases & (1 << PHASE_READ_DONE)) {
+        bench_add(BENCH_TOTAL, response->phase_ms[PHASE_READ_DONE]);
+    }
+    // What the connection parameters decide: discovery and read on the link
+    if ((response->phases & (1 << PHASE_CONNECTED)) &&
+        (response->phases & (1 << PHASE_READ_DONE))) {
+        bench_add(BENCH_CONNECT_READ,
+                  response->phase_ms[PHASE_READ_DONE] - response->phase_ms[PHASE_CONNECTED]);
+    }
+}
+
+static void bench_sort(uint16_t *v, unsigned n)
+{
+    for (unsigned i = 1; i < n; i++) {
+        uint16_t x = v[i];
+        unsigned j = i;
+        while (j > 0 && v[j - 1] > x) {
+            v[j] = v[j - 1];
+            j--;
+        }
+        v[j] = x;
+    }
+}
+
+// Nearest-rank percentile of a sorted sample
+static uint16_t bench_percentile(const uint16_t *v, unsigned n, unsigned pct)
+{
+    unsigned rank = (pct * n + 99) / 100;
+    return v[rank > 0 ? rank - 1 : 0];
+}
+
+// End-to-end distribution in power of two buckets
+static void bench_histogram(const uint16_t *sorted, unsigned n)
+{
+    unsigned i = 0;
+
+    printf("End-to-end histogram:\n");
+    for (uint32_t limit = 8; i < n; limit *= 2) {
+        unsigned count = 0;
+        while (i < n && sorted[i] < limit) {
+            count++;
+            i++;
+        }
+        if (count == 0) continue;
+        printf("  < %5lu ms %4u ", (unsigned long)limit, count);
+        for (unsigned k = 0; k < (count * 40 + n - 1) / n; k++) printf("#");
+        printf("\n");
+    }
+}
+
+static void bench_report(void)
+{
+    printf("%-15s %5s %6s %6s %6s %6s\n", "phase (ms)", "n", "p50", "p90", "p99", "max");
+    for (unsigned row = 0; row < BENCH_ROWS; row++) {
+        unsigned n = bench_count[row];
+        if (n == 0) continue;
+
+        uint16_t *v = bench_samples[row];
+        bench_sort(v, n);
+        printf("%-15s %5u %6u %6u %6u %6u\n", bench_row_name[row], n,
+               bench_percentile(v, n, 50), bench_percentile(v, n, 90),
+               bench_percentile(v, n, 99), v[n - 1]);
+    }
+    if (bench_count[BENCH_TOTAL] > 0) {
+        bench_histogram(bench_samples[BENCH_TOTAL], bench_count[BENCH_TOTAL]);
+    }
+}
+
+/*
+*Benchmark engine shared by the eval commands: issue one query at a time,
+*wait for its completion and collect the duration of every phase.
+*usage: <cmd> [runs] [gap_ms] [-b] [-p profile]
+*/
+static int run_benchmark(int sensor_type, int argc, char **argv)
+{
+    int num_runs = BENCH_DEFAULT_RUNS;
+    uint32_t gap_ms = BENCH_DEFAULT_GAP_MS;
+    uint8_t flags = 0;
+    int positional = 0;
+    int profile = conn_profile_query;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            flags |= QUERY_BROADCAST;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            profile = conn_profile_find(argv[++i]);
+            if (profile < 0) {
+                printf("[ERR] Unknown profile %s\n", argv[i]);
+                return 1;
+            }
+        } else if (positional == 0) {
+            num_runs = atoi(argv[i]);
+            positional++;
+        } else {
+            gap_ms = strtoul(argv[i], NULL, 10);
+        }
+    }
+    if (num_runs <= 0 || num_runs > BENCH_MAX_RUNS) {
+        printf("usage: %s [runs 1..%d] [gap_ms] [-b] [-p profile]\n", argv[0], BENCH_MAX_RUNS);
+        return 1;
+    }
+
     int successful_runs = 0;
+    int failed_runs = 0;
     int fast_discoveries = 0;  // Discoveries under 100ms
-    
-    printf("Starting temperature evaluation: %d runs\n", num_runs);
-    printf("Success threshold: < %d ms discovery latency\n", SUCCESS_THRESHOLD_MS);
-    
+
+    memset(bench_count, 0, sizeof(bench_count));
+    // Queries of the run connect with the profile under test
+    conn_profile_id_t saved_profile = conn_profile_query;
+    conn_profile_query = profile;
+
+    printf("Starting %s evaluation: %d runs, %lu ms apart, %s connections%s\n",
+           sensor_type == SENSOR_TEMP ? "temperature" : "humidity", num_runs,
+           (unsigned long)gap_ms, conn_profiles[profile].name,
+           (flags & QUERY_BROADCAST) ? ", broadcast allowed" : "");
+
     for (int i = 0; i < num_runs; i++) {
         printf("Run %d/%d - ", i + 1, num_runs);
-        cmd_get_temp(0, NULL);
-        
-        // Wait a moment for the response to be populated
-        ztimer_sleep(ZTIMER_MSEC, 100);
-        
-        // Check if we have a valid response with discovery latency
-        if (active_response != NULL) {
-            printf("Discovery latency: %" PRIu32 " ms", active_response->discovery_latency_ms);
-            
-            // Check if this is a "success" (discovery < 100ms)
-            bool is_fast_discovery = (active_response->discovery_latency_ms < SUCCESS_THRESHOLD_MS);
-            
-            if (active_response->success) {
-                successful_runs++;
-                total_latency += active_response->discovery_latency_ms;
-                
-                if (active_response->discovery_latency_ms < min_latency) {
-                    min_latency = active_response->discovery_latency_ms;
-                }
-                if (active_response->discovery_latency_ms > max_latency) {
-                    max_latency = active_response->discovery_latency_ms;
-                }
-                
-                // Count fast discoveries
-                if (is_fast_discovery) {
-                    fast_discoveries++;
-                    printf(" - FAST SUCCESS: %.2f %s\n", active_response->value, active_response->unit);
-                } else {
-                    printf(" - SLOW SUCCESS: %.2f %s\n", active_response->value, active_response->unit);
-                }
-            } else {
-                printf(" - FAILED: %s\n", active_response->error_message);
+
+        if (ble_query_wait(sensor_type, flags, NULL, &bench_response,
+                           BENCH_RUN_TIMEOUT_MS) < 0) {
+            printf("No response received\n");
+            failed_runs++;
+        } else if (bench_response.success) {
+            successful_runs++;
+            if (bench_response.discovery_latency_ms < SUCCESS_THRESHOLD_MS) {
+                fast_discoveries++;
             }
+            bench_record(&bench_response);
+            printf("SUCCESS in %lu ms: %.2f %s\n",
+                   (unsigned long)bench_response.phase_ms[PHASE_READ_DONE],
+                   bench_response.value, bench_response.unit);
         } else {
-            printf(" - No response received\n");
+            failed_runs++;
+            printf("FAILED: %s\n", bench_response.error_message);
         }
-        
-        ztimer_sleep(ZTIMER_MSEC, 1000); // Wait 1 second between runs
+
+        ztimer_sleep(ZTIMER_MSEC, gap_ms);
     }
-    
+
+    conn_profile_query = saved_profile;
+
     // Print statistics
     printf("Total runs: %d\n", num_runs);
     printf("Successful readings: %d\n", successful_runs);
+    printf("Failed readings: %d\n", failed_runs);
     printf("Fast discoveries (<%d ms): %d\n", SUCCESS_THRESHOLD_MS, fast_discoveries);
-    printf("Success rate (fast discovery): %.1f%%\n", (fast_discoveries * 100.0) / num_runs);
-    
     if (successful_runs > 0) {
-        printf("Average discovery latency: %.2f ms\n", (double)total_latency / successful_runs);
-        printf("Minimum discovery latency: %" PRIu32 " ms\n", min_latency);
-        printf("Maximum discovery latency: %" PRIu32 " ms\n", max_latency);
-        
-        // Additional latency distribution info
-        printf("Readings under %d ms: %d (%.1f%% of successes)\n", 
-               SUCCESS_THRESHOLD_MS, fast_discoveries, (fast_discoveries * 100.0) / successful_runs);
-    }
-    
+        bench_report();
+    }
+
     printf("Evaluation completed.\n");
     return 0;
 }
 
+// Evaluation command for temperature
+int cmd_eval_temp(int argc, char **argv) {
+    return run_benchmark(SENSOR_TEMP, argc, argv);
+}
+
 // Evaluation command for humidity
 int cmd_eval_humid(int argc, char **argv) {
-    int num_runs = 100;
-    if (argc > 1) num_runs = atoi(argv[1]);
-    
-    uint32_t total_latency = 0;
-    uint32_t min_latency = UINT32_MAX;
-    uint32_t max_latency = 0;
-    int successful_runs = 0;
-    int fast_discoveries = 0;  // Discoveries under 100ms
-    
-    printf("Starting humidity evaluation: %d runs\n", num_runs);
-    printf("Success threshold: < %d ms discovery latency\n", SUCCESS_THRESHOLD_MS);
-    
-    for (int i = 0; i < num_runs; i++) {
-        printf("Run %d/%d - ", i + 1, num_runs);
-        cmd_get_humid(0, NULL);
-        
-        // Wait a moment for the response to be populated
-        ztimer_sleep(ZTIMER_MSEC, 100);
-        
-        // Check if we have a valid response with discovery latency
-        if (active_response != NULL) {
-            printf("Discovery latency: %" PRIu32 " ms", active_response->discovery_latency_ms);
-            
-            // Check if this is a "success" (discovery < 100ms)
-            bool is_fast_discovery = (active_response->discovery_latency_ms < SUCCESS_THRESHOLD_MS);
-            
-            if (active_response->success) {
-                successful_runs++;
-                total_latency += active_response->discovery_latency_ms;
-                
-                if (active_response->discovery_latency_ms < min_latency) {
-                    min_latency = active_response->discovery_latency_ms;
-                }
-                if (active_response->discovery_latency_ms > max_latency) {
-                    max_latency = active_response->discovery_latency_ms;
-                }
-                
-                // Count fast discoveries
-                if (is_fast_discovery) {
-                    fast_discoveries++;
-                    printf(" - FAST SUCCESS: %.2f %s\n", active_response->value, active_response->unit);
-                } else {
-                    printf(" - SLOW SUCCESS: %.2f %s\n", active_response->value, active_response->unit);
-                }
-            } else {
-                printf(" - FAILED: %s\n", active_response->error_message);
+    return run_benchmark(SENSOR_HUM, argc, argv);
+}
+
+// Advertisements captured next to the gateway, replayed by cmd_eval_filter
+static const uint8_t adv_env_1[] = {
+    0x02, 0x01, 0x06,
+    0x08, 0x09, 'E', 'n', 'v', 'N', 'o', 'd', 'e',
+    0x05, 0x03, 0x6e, 0x2a, 0x6f, 0x2a,
+    0x0c, 0x16, 0x1a, 0x18, 0x01, 0xe2, 0x08, 0x5c, 0x12, 0x10, 0x27, 0x00, 0x00,
+};
+static const uint8_t adv_env_2[] = {
+    0x02, 0x01, 0x06,
+    0x08, 0x09, 'E', 'n', 'v', 'N', 'o', 'd', 'e',
+    0x05, 0x03, 0x6e, 0x2a, 0x6f, 0x2a,
+    0x0c, 0x16, 0x1a, 0x18, 0x01, 0x9a, 0x08, 0xd8, 0x13, 0x34, 0x2f, 0x00, 0x00,
+};
+static const uint8_t adv_ibeacon[] = {
+    0x02, 0x01, 0x06,
+    0x1a, 0xff, 0x4c, 0x00, 0x02, 0x15,
+    0xe2, 0xc5, 0x6d, 0xb5, 0xdf, 0xfb, 0x48, 0xd2,
+    0xb0, 0x60, 0xd0, 0xf5, 0xa7, 0x10, 0x96, 0xe0,
+    0x00, 0x01, 0x00, 0x02, 0xc5,
+};
+static const uint8_t adv_phone[] = {
+    0x02, 0x01, 0x1a,
+    0x0a, 0xff, 0x4c, 0x00, 0x10, 0x05, 0x01, 0x18, 0x3f, 0x21, 0x7c,
+};
+static const uint8_t adv_eddystone[] = {
+    0x02, 0x01, 0x06,
+    0x03, 0x03, 0xaa, 0xfe,
+    0x17, 0x16, 0xaa, 0xfe, 0x00, 0xe7, 0x00, 0x01, 0x02, 0x03, 0x04,
+    0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x00, 0x00,
+};
+static const uint8_t adv_swift_pair[] = {
+    0x1e, 0xff, 0x06, 0x00, 0x01, 0x09, 0x20, 0x02, 0x8e, 0x1f, 0x60, 0x3a,
+    0x41, 0x2d, 0x21, 0x0b, 0x6e, 0x9c, 0x4b, 0x80, 0x91, 0x33, 0x10, 0x5d,
+    0x7f, 0x02, 0xa4, 0x0c, 0x19, 0x5b, 0x00,
+};
+static const uint8_t adv_heart_rate[] = {
+    0x02, 0x01, 0x06,
+    0x05, 0x03, 0x0d, 0x18, 0x0a, 0x18,
+    0x07, 0x09, 'H', 'R', 'M', '-', '4', '2',
+};
+
+static const struct {
+    const uint8_t *ad;
+    size_t len;
+} adv_capture[] = {
+    { adv_env_1, sizeof(adv_env_1) },
+    { adv_ibeacon, sizeof(adv_ibeacon) },
+    { adv_phone, sizeof(adv_phone) },
+    { adv_eddystone, sizeof(adv_eddystone) },
+    { adv_swift_pair, sizeof(adv_swift_pair) },
+    { adv_phone, sizeof(adv_phone) },
+    { adv_heart_rate, sizeof(adv_heart_rate) },
+    { adv_env_2, sizeof(adv_env_2) },
+};
+#define ADV_CAPTURE_COUNT (sizeof(adv_capture) / sizeof(adv_capture[0]))
+
+#if !GATEWAY_SIM
+// Previous scan_cb path: parse every advertisement into ble_hs_adv_fields
+static uint8_t match_parsed(const uint8_t *ad, size_t ad_len)
+{
+    struct ble_hs_adv_fields fields;
+    uint8_t found = 0;
+
+    if (ble_hs_adv_parse_fields(&fields, ad, ad_len) != 0) return 0;
+
+    for (int i = 0; i < fields.num_uuids16; i++) {
+        for (uint8_t j = 0; j < sensor_filter.num_uuids; j++) {
+            if (fields.uuids16[i].value == sensor_filter.uuids[j]) found |= 1 << j;
+        }
+    }
+    return found;
+}
+#endif
+
+// Microbenchmark of the scan_cb advertisement filter on the captured payloads
+int cmd_eval_filter(int argc, char **argv) {
+    int iterations = 10000;
+    if (argc > 1) iterations = atoi(argv[1]);
+    if (iterations <= 0) {
+        printf("usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    unsigned packets = iterations * ADV_CAPTURE_COUNT;
+    unsigned matches_fast = 0;
+
+    printf("Replaying %u captured advertisements %d times\n",
+           (unsigned)ADV_CAPTURE_COUNT, iterations);
+
+    uint32_t start = ztimer_now(ZTIMER_USEC);
+    for (int i = 0; i < iterations; i++) {
+        for (unsigned j = 0; j < ADV_CAPTURE_COUNT; j++) {
+            if (adv_filter_match(&sensor_filter, adv_capture[j].ad, adv_capture[j].len)) {
+                matches_fast++;
             }
-        } else {
-            printf(" - No response received\n");
         }
-        
-        ztimer_sleep(ZTIMER_MSEC, 500); 
     }
-    
-    // Print statistics
-    printf("Total runs: %d\n", num_runs);
-    printf("Successful readings: %d\n", successful_runs);
-    printf("Fast discoveries (<%d ms): %d\n", SUCCESS_THRESHOLD_MS, fast_discoveries);
-    printf("Success rate (fast discovery): %.1f%%\n", (fast_discoveries * 100.0) / num_runs);
-    
-    if (successful_runs > 0) {
-        printf("Average discovery latency: %.2f ms\n", (double)total_latency / successful_runs);
-        printf("Minimum discovery latency: %" PRIu32 " ms\n", min_latency);
-        printf("Maximum discovery latency: %" PRIu32 " ms\n", max_latency);
-        
-        // Additional latency distribution info
-        printf("Readings under %d ms: %d (%.1f%% of successes)\n", 
-               SUCCESS_THRESHOLD_MS, fast_discoveries, (fast_discoveries * 100.0) / successful_runs);
-    }
-    
+    uint32_t fast_us = ztimer_now(ZTIMER_USEC) - start;
+
+    printf("Raw AD filter:   %" PRIu32 " us total, %.3f us/packet, %u matches\n",
+           fast_us, (double)fast_us / packets, matches_fast);
+
+#if !GATEWAY_SIM
+    // The simulation has no NimBLE host to parse with
+    unsigned matches_parsed = 0;
+    start = ztimer_now(ZTIMER_USEC);
+    for (int i = 0; i < iterations; i++) {
+        for (unsigned j = 0; j < ADV_CAPTURE_COUNT; j++) {
+            if (match_parsed(adv_capture[j].ad, adv_capture[j].len)) {
+                matches_parsed++;
+            }
+        }
+    }
+    uint32_t parsed_us = ztimer_now(ZTIMER_USEC) - start;
+
+    printf("Parsed fields:   %" PRIu32 " us total, %.3f us/packet, %u matches\n",
+           parsed_us, (double)parsed_us / packets, matches_parsed);
+    if (fast_us > 0) {
+        printf("Speedup: %.1fx\n", (double)parsed_us / fast_us);
+    }
+    if (matches_fast != matches_parsed) {
+        printf("[ERROR] Filter results differ\n");
+        return 1;
+    }
+#endif
+
     printf("Evaluation completed.\n");
     return 0;
-}
\ No newline at end of file
+}
@@ -8,6 +8,7 @@ extern sensor_response_t *active_response;
 
 int cmd_eval_temp(int argc, char **argv);
 int cmd_eval_humid(int argc, char **argv);
+int cmd_eval_filter(int argc, char **argv);
 
 #ifdef __cplusplus
 }
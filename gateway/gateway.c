@@ -2,8 +2,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include "thread.h"
 #include "shell.h"
+#include "sema.h"
 #include "ztimer.h"
 #include "nimble_scanner.h"
 #include "nimble_scanlist.h"
@@ -11,89 +11,366 @@
 #include "ble_handler.h"
 #include "gateway.h"
 #include "evaluation.h"
+#include "trace.h"
+#include "presence.h"
+#include "conn_pool.h"
+#include "conn_profile.h"
+#include "gatt_cache.h"
+#include "request.h"
+#include "response_pool.h"
+#include "subscribe.h"
+#include "backlog.h"
+#include "series.h"
+#include "read_cache.h"
+#include "scan_sched.h"
+#include "registry.h"
+#include "poll.h"
+#include "padv.h"
+#include "timing.h"
+#include "sim_ble.h"
 // default scan interval 
 
 
-void check_scan_timeout(void) {
-    if (!scan_timeout_active || scan_start_time == 0) return;
-    uint32_t elapsed = ztimer_now(ZTIMER_MSEC) - scan_start_time;
-    if (elapsed >= SCAN_TIMEOUT_MS) {
-        printf("[TIMEOUT] Scan timeout after %lu ms - no %s sensor found\n",
-               elapsed, target_type ? target_type : "unknown");
-
-        nimble_scanner_stop();
-        scan_timeout_active = false;
-
-        if (active_response) {
-            active_response->success = false;
-            snprintf(active_response->error_message, sizeof(active_response->error_message),
-                     "Scan timeout - no %s sensor found after %lu ms",
-                     target_type ? target_type : "sensor", elapsed);
-            print_sensor_response(active_response);
-            free(active_response);
-            active_response = NULL;
-        }
-
-        target_type = NULL;
-        scan_start_time = 0;
-    }
+/*
+*Query Sensor
+*returns: the request number, or -1 if the query could not be started.
+*/
+int ble_query_sensor(const int sensor_type, uint8_t flags) {
+    return ble_query_node(sensor_type, flags, NULL);
 }
-//**Query Sensor */
-void ble_query_sensor(const int sensor_type ) {
-    if (!active_response) {
-        active_response = malloc(sizeof(sensor_response_t));
-        memset(active_response, 0, sizeof(sensor_response_t));
-    }
-
-    generate_request_id(active_response->request_id, sizeof(active_response->request_id));
 
+/*
+*Query the sensor of the registered node at addr, any node of the type if
+*addr is NULL. Runs on the NimBLE host thread.
+*returns: the request number, or -1 if the query could not be started.
+*/
+static int query_start(const int sensor_type, uint8_t flags, const ble_addr_t *addr,
+                       query_waiter_t *waiter) {
+    uint16_t sensor_uuid;
     switch (sensor_type) {
         case SENSOR_TEMP:
-            strcpy(active_response->unit, "Celsius");
-            target_type = "TEMP";
+            sensor_uuid = TEMPERATURE_CHARACTERISTIC_UUID;
             break;
 
         case SENSOR_HUM:
-            strcpy(active_response->unit, "Percent");
-            target_type = "HUM";
+            sensor_uuid = HUMIDITY_CHARACTERISTIC_UUID;
             break;
 
         default:
             printf("[ERR] Unknown sensor type ID: %d\n", sensor_type);
-            return;
+            return -1;
     }
 
-    scan_start_time = ztimer_now(ZTIMER_MSEC);
-    scan_timeout_active = true;
+    // The registry may have been cleared since the caller looked the node up
+    const registry_node_t *node = addr ? registry_find(addr) : NULL;
+    if (addr && !node) {
+        printf("[ERR] Node no longer registered, see nodes\n");
+        return -1;
+    }
+
+    // sensor_filter lists the sensor types in SENSOR_* order
+    if (node && !(node->sensors & (1 << sensor_type))) {
+        printf("[ERR] Node %s has no %s sensor\n", registry_name(node),
+               sensor_type == SENSOR_TEMP ? "TEMP" : "HUM");
+        return -1;
+    }
+
+    gw_request_t *req = request_alloc(sensor_uuid);
+    if (!req) {
+        printf("[ERR] Too many requests in flight (max %d)\n", MAX_REQUESTS);
+        return -1;
+    }
+    int id = req->id;
+    req->waiter = waiter;
+    req->broadcast_ok = flags & QUERY_BROADCAST;
+    req->subscribe = flags & QUERY_SUBSCRIBE;
+    req->backlog = flags & QUERY_BACKLOG;
+    req->conn_profile = conn_profile_query;
+    if (node) {
+        req->targeted = true;
+        req->addr = node->addr;
+    }
+    bool one_shot = !req->subscribe && !req->backlog;
+
+    // A read in progress hands its link over once done, wait for it
+    gw_request_t *linked = one_shot ? request_find_linked() : NULL;
+    if (linked && (!req->targeted || ble_addr_cmp(&linked->addr, &req->addr) == 0)) {
+        request_set_state(req, REQ_SCANNING);
+        request_mark_phase(req, PHASE_SCAN_START);
+        printf("[INFO] Waiting for the link of the read in progress\n");
+        ble_scan_update();
+        return id;
+    }
+
+    // Serve the read over an open link when the pool has one
+    conn_pool_entry_t *pooled = NULL;
+    if (!req->subscribe) {
+        pooled = req->targeted ? conn_pool_find_node(&req->addr, sensor_uuid)
+                               : conn_pool_find(sensor_uuid);
+    }
+    if (pooled && !request_find_by_conn(pooled->conn_handle)) {
+        printf("[INFO] Reusing open link to %s sensor, handle: %d\n",
+               req->type_name, pooled->conn_handle);
+        conn_pool_touch(pooled->conn_handle);
+        // The read does not wait for the update, it takes a few connection events
+        conn_pool_set_profile(pooled->conn_handle, req->conn_profile);
+        req->addr = pooled->addr;
+        uint16_t val_handle = gatt_cache_val_handle(&pooled->addr, sensor_uuid);
+        int rc = req->backlog ? ble_discover_sensor(req, pooled->conn_handle)
+                              : ble_read_sensor(req, pooled->conn_handle, val_handle);
+        if (rc == 0) {
+            return id;
+        }
+        conn_pool_remove(pooled->conn_handle);
+        ble_gap_terminate(pooled->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+    }
+
+    // Address known: the initiator looks for the node, no scan needed
+    if (req->targeted && !request_find_by_addr(&req->addr)) {
+        printf("[INFO] Connecting to node %s\n", registry_name(node));
+        if (ble_connect_sensor(req) != 0) {
+            printf("[WARN] Direct connect failed, falling back to active scan\n");
+        }
+        return id;
+    }
 
-    int rc = nimble_scanner_start();
+    // Skip the cold scan when the background scan saw the sensor recently
+    presence_entry_t entry;
+    if (!req->targeted && presence_lookup(sensor_uuid, PRESENCE_MAX_AGE_MS, &entry) &&
+        !request_find_by_addr(&entry.addr)) {
+        req->response->discovery_latency_ms = ztimer_now(ZTIMER_MSEC) - req->start_time;
+        printf("[INFO] Known %s sensor seen %lu ms ago (RSSI: %d dBm), connecting\n",
+               req->type_name, (unsigned long)entry.last_seen_ms, entry.rssi);
+        req->addr = entry.addr;
+        if (ble_connect_sensor(req) != 0) {
+            // Request is back to scanning
+            printf("[WARN] Direct connect failed, falling back to active scan\n");
+        }
+        return id;
+    }
+
+    request_set_state(req, REQ_SCANNING);
+    request_mark_phase(req, PHASE_SCAN_START);
+
+    int rc = ble_scan_update();
     if (rc != 0) {
         printf("[ERROR] Failed to start scanner, rc: %d\n", rc);
-        scan_timeout_active = false;
-        active_response->success = false;
-        snprintf(active_response->error_message, sizeof(active_response->error_message),
+        req->response->success = false;
+        snprintf(req->response->error_message, sizeof(req->response->error_message),
                  "Failed to start scanner: %d", rc);
-        print_sensor_response(active_response);
-        free(active_response);
-        active_response = NULL;
-        return;
+        ble_request_complete(req);
+        return id;
+    }
+
+    printf("[INFO] Scanner started, looking for %s sensor...\n", req->type_name);
+    return id;
+}
+
+typedef struct query_call_t {
+    int sensor_type;
+    uint8_t flags;
+    const ble_addr_t *addr;
+    query_waiter_t *waiter;
+    int id;
+} query_call_t;
+
+static void query_call_cb(void *arg)
+{
+    query_call_t *call = arg;
+    call->id = query_start(call->sensor_type, call->flags, call->addr, call->waiter);
+}
+
+/*
+*Query the sensor of the registered node at addr, any node of the type if
+*addr is NULL. Started on the NimBLE host thread from any thread.
+*returns: the request number, or -1 if the query could not be started.
+*/
+int ble_query_node(const int sensor_type, uint8_t flags, const ble_addr_t *addr) {
+    query_call_t call = { .sensor_type = sensor_type, .flags = flags, .addr = addr };
+    ble_host_call(query_call_cb, &call);
+    return call.id;
+}
+
+// Detach the waiter of a request that timed out, unless it was answered
+static void wait_detach_cb(void *arg)
+{
+    query_call_t *call = arg;
+    gw_request_t *req = request_find_by_id(call->id);
+    if (req && req->waiter == call->waiter) {
+        req->waiter = NULL;
     }
+}
+
+/*
+*Query the sensor of a node like ble_query_node() and block until the
+*response is published, copied to response.
+*returns: the request number, or -1 if the query could not be started or
+*timed out.
+*/
+int ble_query_wait(int sensor_type, uint8_t flags, const ble_addr_t *addr,
+                   sensor_response_t *response, uint32_t timeout_ms) {
+    query_waiter_t waiter = { .response = response };
+    query_call_t call = { .sensor_type = sensor_type, .flags = flags, .addr = addr,
+                          .waiter = &waiter };
 
-    printf("[INFO] Scanner started, looking for %s sensor...\n", target_type);
+    // The request holds the waiter before the query is dispatched, so even
+    // a query completed within query_start hands its response over
+    sema_create(&waiter.done, 0);
+    ble_host_call(query_call_cb, &call);
+    if (call.id < 0) return -1;
+
+    if (sema_wait_timed_ztimer(&waiter.done, ZTIMER_MSEC, timeout_ms) == 0) {
+        return call.id;
+    }
+    // The response may have been handed over since the timeout
+    ble_host_call(wait_detach_cb, &call);
+    return sema_try_wait(&waiter.done) == 0 ? call.id : -1;
 }
 
 /**Shell commands */
+// Registry lookup of a shell command, registry_observe inserts on the host.
+// The node is copied out, the registry may be cleared once the call returns.
+typedef struct node_call_t {
+    const char *name;
+    int sensor_type;
+    unsigned next;
+    bool found;
+    ble_addr_t addr;
+    char node_name[18];
+} node_call_t;
+
+static void node_call_copy(node_call_t *call, const registry_node_t *node)
+{
+    call->found = true;
+    call->addr = node->addr;
+    snprintf(call->node_name, sizeof(call->node_name), "%s", registry_name(node));
+}
+
+static void resolve_call_cb(void *arg)
+{
+    node_call_t *call = arg;
+    registry_node_t *node = registry_resolve(call->name);
+    call->found = false;
+    if (node) node_call_copy(call, node);
+}
+
+// The first node with a sensor of the type from index next on
+static void next_call_cb(void *arg)
+{
+    node_call_t *call = arg;
+    call->found = false;
+    while (call->next < registry_count()) {
+        registry_node_t *node = registry_node(call->next++);
+        if (node->sensors & (1 << call->sensor_type)) {
+            node_call_copy(call, node);
+            return;
+        }
+    }
+}
+
+// Arguments of the get commands
+typedef struct get_args_t {
+    uint8_t flags;
+    uint32_t max_age_ms;
+    bool targeted;
+    ble_addr_t addr;
+} get_args_t;
+
+// [node] [max_age_ms] [-b]: node is a label, n<id> or address from `nodes`,
+// a cached reading up to max_age_ms old is good enough, -b accepts the
+// reading broadcast in the advertisement instead of connecting
+static int get_args(int argc, char **argv, get_args_t *args) {
+    memset(args, 0, sizeof(*args));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            args->flags |= QUERY_BROADCAST;
+        } else if (argv[i][0] >= '0' && argv[i][0] <= '9' && !strchr(argv[i], ':')) {
+            args->max_age_ms = strtoul(argv[i], NULL, 10);
+        } else {
+            node_call_t call = { .name = argv[i] };
+            ble_host_call(resolve_call_cb, &call);
+            if (!call.found) {
+                printf("[ERR] Unknown node %s, see nodes\n", argv[i]);
+                return -1;
+            }
+            args->targeted = true;
+            args->addr = call.addr;
+        }
+    }
+    return 0;
+}
+
+// The gateway cache holds the last reading of a type, not of every node
+static void get_reading(int sensor_type, const get_args_t *args) {
+    if (args->targeted) {
+        ble_query_node(sensor_type, args->flags, &args->addr);
+    } else {
+        read_cache_get(sensor_type, args->flags, args->max_age_ms);
+    }
+}
+
 int cmd_get_temp(int argc, char **argv) {
-    (void)argc; (void)argv;
+    get_args_t args;
+    if (get_args(argc, argv, &args) != 0) return 1;
     printf("Querying temperature sensor...\n");
-    ble_query_sensor(SENSOR_TEMP);
+    get_reading(SENSOR_TEMP, &args);
     return 0;
 }
 
 int cmd_get_humid(int argc, char **argv) {
-    (void)argc; (void)argv;
+    get_args_t args;
+    if (get_args(argc, argv, &args) != 0) return 1;
     printf("Querying humidity sensor...\n");
-    ble_query_sensor(SENSOR_HUM);
+    get_reading(SENSOR_HUM, &args);
+    return 0;
+}
+
+// Both readings of one node, over a single connection
+int cmd_get_env(int argc, char **argv) {
+    get_args_t args;
+    if (get_args(argc, argv, &args) != 0) return 1;
+    printf("Querying temperature and humidity...\n");
+    get_reading(SENSOR_TEMP, &args);
+    get_reading(SENSOR_HUM, &args);
+    return 0;
+}
+
+static sensor_response_t get_all_response;
+
+// One reading from every registered node of a type, one node after the other
+int cmd_get_all(int argc, char **argv) {
+    int sensor_type;
+    if (argc > 1 && strcmp(argv[1], "temp") == 0) {
+        sensor_type = SENSOR_TEMP;
+    } else if (argc > 1 && strcmp(argv[1], "hum") == 0) {
+        sensor_type = SENSOR_HUM;
+    } else {
+        printf("usage: %s <temp|hum> [-b]\n", argv[0]);
+        return 1;
+    }
+    uint8_t flags = (argc > 2 && strcmp(argv[2], "-b") == 0) ? QUERY_BROADCAST : 0;
+
+    unsigned queried = 0, answered = 0;
+    node_call_t call = { .sensor_type = sensor_type };
+
+    for (ble_host_call(next_call_cb, &call); call.found;
+         ble_host_call(next_call_cb, &call)) {
+        queried++;
+        if (ble_query_wait(sensor_type, flags, &call.addr, &get_all_response,
+                           GET_ALL_TIMEOUT_MS) < 0) {
+            printf("%-11s no response\n", call.node_name);
+        } else if (get_all_response.success) {
+            answered++;
+            printf("%-11s %.2f %s in %lu ms\n", call.node_name,
+                   get_all_response.value, get_all_response.unit,
+                   (unsigned long)(get_all_response.discovery_latency_ms +
+                                   get_all_response.read_latency_ms));
+        } else {
+            printf("%-11s %s\n", call.node_name, get_all_response.error_message);
+        }
+    }
+
+    printf("%u/%u nodes answered\n", answered, queried);
     return 0;
 }
 
@@ -101,11 +378,35 @@ int cmd_help(int argc, char **argv) {
     (void)argc; (void)argv;
     printf("BLE Sensor Gateway Application\n");
     printf("Available commands:\n");
-    printf(" get_temp  - Query temperature sensor\n");
-    printf(" get_humid - Query humidity sensor\n");
+    printf(" get_temp [node] [max_age_ms] [-b]  - Query temperature sensor (-b: accept advertised reading)\n");
+    printf(" get_humid [node] [max_age_ms] [-b] - Query humidity sensor (-b: accept advertised reading)\n");
+    printf(" get_env [node] [max_age_ms] [-b]   - Query temperature and humidity in one connection\n");
+    printf("   node: label, n<id> or address from nodes, any node of the type if omitted\n");
+    printf("   max_age_ms: answer from the gateway cache if its reading is this fresh\n");
+    printf(" get_all <temp|hum> [-b] - Query every registered node of a type\n");
+    printf(" nodes [label <node> [label]|clear] - Sensor nodes heard by the gateway\n");
+    printf(" poll [start|stop|clear] - Periodic readings, earliest deadline first\n");
+    printf("   poll add <node|all> <temp|hum> <period_ms> [deadline_ms], poll del <node|all> [temp|hum]\n");
     printf(" help      - Show this help message\n");
-    printf(" eval_temp  - Run temperature evaluation 100 times\n");
-    printf(" eval_humid - Run humidity evaluation 100 times\n");
+    printf(" eval_temp [runs] [gap_ms] [-b] [-p profile]  - Temperature latency benchmark per phase\n");
+    printf(" eval_humid [runs] [gap_ms] [-b] [-p profile] - Humidity latency benchmark per phase\n");
+    printf(" eval_filter [n] - Benchmark the advertisement filter\n");
+    printf(" presence [on|off|clear] - Background scan and known sensors\n");
+    printf(" pool [on|off|flush|max <n>] - Persistent connection pool\n");
+    printf(" connprof [query|idle <profile>] - Connection parameters of queries and pooled links\n");
+    printf(" scan [on|off|clear] - Scan windows placed on learned advertising timing\n");
+    printf(" requests  - List queries in flight\n");
+    printf(" subscribe [temp|hum] [stop] - Stream notifications from a sensor\n");
+    printf(" padv [sync|stop <node|all>] - Follow periodic advertising trains, no connection\n");
+    printf(" backlog [get|clear] - Download the sample history of a node\n");
+    printf(" cache [clear] - Cached readings and hit counts\n");
+    printf(" history [temp|hum|clear] [n] - Last readings kept by the gateway\n");
+    printf(" stats <temp|hum> [window] - Min/max/mean over the last window (s, m or h)\n");
+    printf(" trace [dump|clear] - BLE event trace\n");
+    printf(" timing [dump|clear] - Microseconds per query stage, dump exports CSV\n");
+#if GATEWAY_SIM
+    printf(" sim [add [adv_ms] [connect_ms] [att_ms] [loss_pct]|clear|seed <n>] - Virtual sensors\n");
+#endif
 
     return 0;
 }
@@ -113,22 +414,33 @@ int cmd_help(int argc, char **argv) {
 const shell_command_t shell_commands[] = {
     { "get_temp", "Query temperature sensor", cmd_get_temp },
     { "get_humid", "Query humidity sensor", cmd_get_humid },
+    { "get_env", "Query temperature and humidity", cmd_get_env },
+    { "get_all", "Query every node of a type <temp|hum> [-b]", cmd_get_all },
+    { "nodes", "Sensor registry [label <node> [label]|clear]", cmd_nodes },
+    { "poll", "Periodic polling scheduler [start|stop|clear|add|del]", cmd_poll },
     { "help", "Show help message", cmd_help },
-    { "eval_temp", "Run temperature evaluation (100 runs)", cmd_eval_temp },
-    { "eval_humid", "Run humidity evaluation (100 runs)", cmd_eval_humid },
+    { "eval_temp", "Temperature latency benchmark [runs] [gap_ms] [-b] [-p profile]", cmd_eval_temp },
+    { "eval_humid", "Humidity latency benchmark [runs] [gap_ms] [-b] [-p profile]", cmd_eval_humid },
+    { "eval_filter", "Benchmark advertisement filter", cmd_eval_filter },
+    { "presence", "Background scan presence table [on|off|clear]", cmd_presence },
+    { "scan", "Adaptive scan windows [on|off|clear]", cmd_scan },
+    { "pool", "Persistent connection pool [on|off|flush|max <n>]", cmd_pool },
+    { "connprof", "Connection parameter profiles [query|idle <profile>]", cmd_connprof },
+    { "requests", "List queries in flight", cmd_requests },
+    { "subscribe", "Stream sensor notifications [temp|hum] [stop]", cmd_subscribe },
+    { "padv", "Periodic advertising syncs [sync|stop <node|all>]", cmd_padv },
+    { "backlog", "Download sensor sample history [get [node]|clear]", cmd_backlog },
+    { "cache", "Read-through cache of the last readings [clear]", cmd_cache },
+    { "history", "Readings kept by the gateway [temp|hum|clear] [node] [n]", cmd_history },
+    { "stats", "Reading statistics over a window <temp|hum> [node] [window]", cmd_stats },
+    { "trace", "BLE event trace [dump|clear]", cmd_trace },
+    { "timing", "Query pipeline timing records [dump|clear]", cmd_timing },
+#if GATEWAY_SIM
+    { "sim", "Virtual sensors [add|clear|seed]", cmd_sim },
+#endif
     { NULL, NULL, NULL }
 };
 
-/**Timeout */
-static void *timeout_thread(void *arg) {
-    (void)arg;
-    while (1) {
-        check_scan_timeout();
-        ztimer_sleep(ZTIMER_MSEC, 100);
-    }
-    return NULL;
-}
-
 //**Main function */
 int main(void) {
     printf("=== BLE Sensor Gateway Application Started ===\n");
@@ -137,6 +449,11 @@ int main(void) {
     printf(" get_humid - Query humidity sensor\n");
     printf(" help      - Show this help message\n");
 
+#if GATEWAY_SIM
+    // Virtual sensors and host task must exist before the scanner is used
+    sim_init();
+#endif
+
     nimble_scanner_cfg_t params = {
         .itvl_ms = DEFAULT_SCAN_INTERVAL_MS,
         .win_ms = DEFAULT_SCAN_INTERVAL_MS,
@@ -153,14 +470,18 @@ int main(void) {
         printf("[ERROR] Failed to initialize scanner, rc: %d\n", rc);
         return 1;
     }
+    ble_host_init();
+    response_print_init();
+    response_pool_init();
+    presence_init();
+    conn_pool_init();
+    read_cache_init();
+    scan_sched_init();
+    poll_init();
+    padv_init();
 
 
-    static char timeout_stack[THREAD_STACKSIZE_SMALL];
-        thread_create(timeout_stack, sizeof(timeout_stack),
-                    THREAD_PRIORITY_MAIN - 1, THREAD_CREATE_STACKTEST,
-                    timeout_thread, NULL, "timeout_checker");
-
-        char line_buf[SHELL_DEFAULT_BUFSIZE];
-        shell_run(shell_commands, line_buf, SHELL_DEFAULT_BUFSIZE);
-        return 0;
+    char line_buf[SHELL_DEFAULT_BUFSIZE];
+    shell_run(shell_commands, line_buf, SHELL_DEFAULT_BUFSIZE);
+    return 0;
 }
\ No newline at end of file
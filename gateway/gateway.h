@@ -12,11 +12,20 @@
 #define DEFAULT_DURATION_MS        (1 * MS_PER_SEC)
 #define SENSOR_TEMP  0
 #define SENSOR_HUM   1
-#define SCAN_TIMEOUT_MS 2000
 
-extern bool connecting;
 extern sensor_response_t *active_response;
 
-void ble_query_sensor(int sensor_type);
+// ble_query_sensor() flags
+#define QUERY_BROADCAST  0x01   // Accept a reading broadcast in an advertisement
+#define QUERY_SUBSCRIBE  0x02   // Enable notifications instead of one read
+#define QUERY_BACKLOG    0x04   // Download the sample history of the node
+
+// get_all gives up on a node after this, longer than all phase deadlines together
+#define GET_ALL_TIMEOUT_MS 10000
+
+int ble_query_sensor(int sensor_type, uint8_t flags);
+int ble_query_node(int sensor_type, uint8_t flags, const ble_addr_t *addr);
+int ble_query_wait(int sensor_type, uint8_t flags, const ble_addr_t *addr,
+                   sensor_response_t *response, uint32_t timeout_ms);
 
 #endif
@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "ztimer.h"
+#include "ble_handler.h"
+#include "gatt_cache.h"
+
+static gatt_cache_entry_t cache[GATT_CACHE_SIZE];
+
+static gatt_cache_entry_t *find(const ble_addr_t *addr)
+{
+    for (unsigned i = 0; i < GATT_CACHE_SIZE; i++) {
+        if (cache[i].in_use && ble_addr_cmp(&cache[i].addr, addr) == 0) {
+            return &cache[i];
+        }
+    }
+    return NULL;
+}
+
+// Find the entry of a peer, replacing the least recently used one if needed
+static gatt_cache_entry_t *find_or_add(const ble_addr_t *addr)
+{
+    gatt_cache_entry_t *e = find(addr);
+    if (e) return e;
+
+    e = &cache[0];
+    for (unsigned i = 0; i < GATT_CACHE_SIZE; i++) {
+        if (!cache[i].in_use) {
+            e = &cache[i];
+            break;
+        }
+        if (cache[i].last_used_ms < e->last_used_ms) {
+            e = &cache[i];
+        }
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->in_use = true;
+    e->addr = *addr;
+    return e;
+}
+
+void gatt_cache_store_svc(const ble_addr_t *addr, uint16_t start, uint16_t end)
+{
+    gatt_cache_entry_t *e = find_or_add(addr);
+    e->svc_start = start;
+    e->svc_end = end;
+    e->last_used_ms = ztimer_now(ZTIMER_MSEC);
+}
+
+void gatt_cache_store_chr(const ble_addr_t *addr, uint16_t uuid, uint16_t val_handle)
+{
+    gatt_cache_entry_t *e = find_or_add(addr);
+    if (uuid == TEMPERATURE_CHARACTERISTIC_UUID) {
+        e->temp_val_handle = val_handle;
+    } else if (uuid == HUMIDITY_CHARACTERISTIC_UUID) {
+        e->hum_val_handle = val_handle;
+    }
+    e->last_used_ms = ztimer_now(ZTIMER_MSEC);
+}
+
+/*
+* returns: the cached value handle of a characteristic, 0 if unknown.
+*/
+uint16_t gatt_cache_val_handle(const ble_addr_t *addr, uint16_t uuid)
+{
+    gatt_cache_entry_t *e = find(addr);
+    if (!e) return 0;
+
+    e->last_used_ms = ztimer_now(ZTIMER_MSEC);
+    if (uuid == TEMPERATURE_CHARACTERISTIC_UUID) return e->temp_val_handle;
+    if (uuid == HUMIDITY_CHARACTERISTIC_UUID) return e->hum_val_handle;
+    return 0;
+}
+
+/*
+* returns: true with the cached ESS handle range of a peer, false if unknown.
+*/
+bool gatt_cache_svc(const ble_addr_t *addr, uint16_t *start, uint16_t *end)
+{
+    gatt_cache_entry_t *e = find(addr);
+    if (!e || e->svc_start == 0) return false;
+
+    e->last_used_ms = ztimer_now(ZTIMER_MSEC);
+    *start = e->svc_start;
+    *end = e->svc_end;
+    return true;
+}
+
+// Drop a peer whose handles no longer work, e.g. after a firmware update
+void gatt_cache_invalidate(const ble_addr_t *addr)
+{
+    gatt_cache_entry_t *e = find(addr);
+    if (e) e->in_use = false;
+}
@@ -0,0 +1,28 @@
+#ifndef GATT_CACHE_H
+#define GATT_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host/ble_hs.h"
+
+// Number of peers whose handles are remembered
+#define GATT_CACHE_SIZE 8
+
+// ESS layout of one peer, handles are 0 until discovered
+typedef struct gatt_cache_entry_t {
+    bool in_use;
+    ble_addr_t addr;               // Peer address
+    uint16_t svc_start;            // ESS service handle range
+    uint16_t svc_end;
+    uint16_t temp_val_handle;      // Temperature characteristic value handle
+    uint16_t hum_val_handle;       // Humidity characteristic value handle
+    uint32_t last_used_ms;         // For least recently used replacement
+} gatt_cache_entry_t;
+
+void gatt_cache_store_svc(const ble_addr_t *addr, uint16_t start, uint16_t end);
+void gatt_cache_store_chr(const ble_addr_t *addr, uint16_t uuid, uint16_t val_handle);
+uint16_t gatt_cache_val_handle(const ble_addr_t *addr, uint16_t uuid);
+bool gatt_cache_svc(const ble_addr_t *addr, uint16_t *start, uint16_t *end);
+void gatt_cache_invalidate(const ble_addr_t *addr);
+
+#endif /* GATT_CACHE_H */
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "padv.h"
+
+#if MYNEWT_VAL(BLE_PERIODIC_ADV) && !GATEWAY_SIM
+
+#include "mutex.h"
+#include "ztimer.h"
+#include "nimble/nimble_port.h"
+#include "env_wire.h"
+#include "adv_filter.h"
+#include "ble_handler.h"
+#include "registry.h"
+#include "trace.h"
+
+static padv_sync_t syncs[PADV_MAX_SYNCS];
+static bool create_pending;            // The controller takes one sync create at a time
+static unsigned next_create;           // Round robin over the trains waiting
+static struct ble_npl_callout padv_timer;
+static mutex_t padv_lock = MUTEX_INIT;
+
+static padv_sync_t *find_addr(const ble_addr_t *addr)
+{
+    for (unsigned i = 0; i < PADV_MAX_SYNCS; i++) {
+        if (syncs[i].in_use && ble_addr_cmp(&syncs[i].addr, addr) == 0) return &syncs[i];
+    }
+    return NULL;
+}
+
+static padv_sync_t *find_handle(uint16_t sync_handle)
+{
+    for (unsigned i = 0; i < PADV_MAX_SYNCS; i++) {
+        if (syncs[i].in_use && syncs[i].state == PADV_SYNCED &&
+            syncs[i].sync_handle == sync_handle) {
+            return &syncs[i];
+        }
+    }
+    return NULL;
+}
+
+// Registry id of a node for trace records, -1 if it is not registered
+static int32_t padv_node_id(const ble_addr_t *addr)
+{
+    registry_node_t *node = registry_find(addr);
+    return node ? (int32_t)registry_id(node) : -1;
+}
+
+static void padv_schedule(uint32_t ms)
+{
+    ble_npl_callout_reset(&padv_timer, ble_npl_time_ms_to_ticks32(ms));
+}
+
+/*
+*Publish both readings of a sample like any query response, so the cache,
+*the series and the polling statistics see them.
+*/
+static void padv_publish(const ble_addr_t *addr, uint32_t seq, const env_wire_sample_t *sample)
+{
+    sensor_response_t response = {0};
+    response.success = true;
+    response.timestamp = sample->timestamp;
+
+    snprintf(response.request_id, sizeof(response.request_id), "PADV_%s_%lu",
+             registry_addr_name(addr), (unsigned long)seq);
+    response.addr = *addr;
+    strcpy(response.unit, "Celsius");
+    response.value = sample->temperature / 100.0;
+    ble_publish_response(&response);
+
+    strcpy(response.unit, "Percent");
+    response.value = sample->humidity / 100.0;
+    ble_publish_response(&response);
+}
+
+static void padv_on_sync(const ble_addr_t *addr, uint8_t status, uint16_t sync_handle,
+                         uint16_t itvl, uint8_t phy)
+{
+    ble_npl_callout_stop(&padv_timer);
+
+    mutex_lock(&padv_lock);
+    create_pending = false;
+    padv_sync_t *s = find_addr(addr);
+    if (s && s->state != PADV_CREATING) s = NULL;
+    if (s) {
+        if (status == 0) {
+            s->state = PADV_SYNCED;
+            s->sync_handle = sync_handle;
+            s->itvl_ms = itvl * 5 / 4;
+            s->phy = phy;
+            s->last_report_ms = ztimer_now(ZTIMER_MSEC);
+        } else {
+            s->state = PADV_WANTED;
+        }
+    }
+    mutex_unlock(&padv_lock);
+
+    if (status != 0) {
+        TRACE_ERROR(TR_PADV_SYNC_FAILED, padv_node_id(addr), status, 0);
+    } else if (!s) {
+        // Stopped while the sync was being created
+        ble_gap_periodic_adv_sync_terminate(sync_handle);
+    } else {
+        TRACE_INFO(TR_PADV_SYNCED, padv_node_id(addr), itvl * 5 / 4, phy);
+    }
+    // Back to the scan the queries or presence want
+    ble_scan_update();
+    padv_schedule(status == 0 ? 0 : PADV_RESYNC_MS);
+}
+
+static void padv_on_report(uint16_t sync_handle, int8_t rssi, uint8_t data_status,
+                           const uint8_t *data, size_t data_len)
+{
+    if (data_status != BLE_HCI_PERIODIC_DATA_STATUS_COMPLETE) return;
+
+    size_t len;
+    const uint8_t *svc = adv_find_svc_data16(data, data_len, ENV_SENSING_SERVICE_UUID, &len);
+    uint32_t seq;
+    env_wire_sample_t sample;
+    if (!svc || env_wire_padv_decode(svc, len, &seq, &sample) != 0) return;
+
+    mutex_lock(&padv_lock);
+    padv_sync_t *s = find_handle(sync_handle);
+    bool fresh = false;
+    ble_addr_t addr;
+    if (s) {
+        s->reports++;
+        s->rssi = rssi;
+        s->last_report_ms = ztimer_now(ZTIMER_MSEC);
+        // The train repeats a sample until the next one is taken
+        fresh = s->samples == 0 || (int32_t)(seq - s->last_seq) > 0;
+        if (fresh) {
+            if (s->samples > 0) s->missed += seq - s->last_seq - 1;
+            s->last_seq = seq;
+            s->samples++;
+            addr = s->addr;
+        }
+    }
+    mutex_unlock(&padv_lock);
+
+    if (fresh) padv_publish(&addr, seq, &sample);
+}
+
+static void padv_on_lost(uint16_t sync_handle, int reason)
+{
+    mutex_lock(&padv_lock);
+    padv_sync_t *s = find_handle(sync_handle);
+    ble_addr_t addr;
+    if (s) {
+        s->state = PADV_WANTED;
+        s->lost++;
+        addr = s->addr;
+    }
+    mutex_unlock(&padv_lock);
+
+    if (!s) return;
+    TRACE_ERROR(TR_PADV_LOST, padv_node_id(&addr), reason, 0);
+    padv_schedule(PADV_RESYNC_MS);
+}
+
+static int padv_gap_cb(struct ble_gap_event *event, void *arg)
+{
+    (void)arg;
+
+    switch (event->type) {
+    case BLE_GAP_EVENT_PERIODIC_SYNC:
+        padv_on_sync(&event->periodic_sync.adv_addr, event->periodic_sync.status,
+                     event->periodic_sync.sync_handle, event->periodic_sync.per_adv_ival,
+                     event->periodic_sync.adv_phy);
+        break;
+    case BLE_GAP_EVENT_PERIODIC_REPORT:
+        padv_on_report(event->periodic_report.sync_handle, event->periodic_report.rssi,
+                       event->periodic_report.data_status, event->periodic_report.data,
+                       event->periodic_report.data_length);
+        break;
+    case BLE_GAP_EVENT_PERIODIC_SYNC_LOST:
+        padv_on_lost(event->periodic_sync_lost.sync_handle,
+                     event->periodic_sync_lost.reason);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/*
+*Start the sync to the next train waiting, or give up on the one being
+*created once PADV_CREATE_TIMEOUT_MS passed. Runs on the NimBLE event queue.
+*/
+static void padv_timer_cb(struct ble_npl_event *ev)
+{
+    (void)ev;
+
+    if (create_pending) {
+        // Completes with a failed BLE_GAP_EVENT_PERIODIC_SYNC
+        TRACE_ERROR(TR_PADV_NOT_FOUND, 0, 0, 0);
+        ble_gap_periodic_adv_sync_create_cancel();
+        return;
+    }
+
+    padv_sync_t *s = NULL;
+    ble_addr_t addr;
+    mutex_lock(&padv_lock);
+    for (unsigned i = 0; i < PADV_MAX_SYNCS; i++) {
+        unsigned k = (next_create + i) % PADV_MAX_SYNCS;
+        if (syncs[k].in_use && syncs[k].state == PADV_WANTED) {
+            s = &syncs[k];
+            next_create = k + 1;
+            s->state = PADV_CREATING;
+            addr = s->addr;
+            create_pending = true;
+            break;
+        }
+    }
+    mutex_unlock(&padv_lock);
+    if (!s) return;
+
+    struct ble_gap_periodic_sync_params params = {
+        .skip = 0,
+        .sync_timeout = PADV_SYNC_TIMEOUT_MS / 10,
+    };
+    int rc = ble_gap_periodic_adv_sync_create(&addr, ENV_WIRE_PADV_SID, &params,
+                                              padv_gap_cb, NULL);
+    if (rc != 0) {
+        TRACE_ERROR(TR_PADV_SYNC_FAILED, padv_node_id(&addr), rc, 0);
+        mutex_lock(&padv_lock);
+        create_pending = false;
+        if (s->state == PADV_CREATING) s->state = PADV_WANTED;
+        mutex_unlock(&padv_lock);
+        padv_schedule(PADV_RESYNC_MS);
+        return;
+    }
+    // The controller finds the train through the extended advertisements
+    ble_scan_update();
+    padv_schedule(PADV_CREATE_TIMEOUT_MS);
+}
+
+/*
+*Whether a sync is being created, the scanner has to run for it.
+*/
+bool padv_scan_wanted(void)
+{
+    return create_pending;
+}
+
+void padv_init(void)
+{
+    ble_npl_callout_init(&padv_timer, nimble_port_get_dflt_eventq(), padv_timer_cb, NULL);
+}
+
+/*
+*Follow the train of a node.
+*returns: 0 on success, -1 if every sync slot is taken.
+*/
+static int padv_add(const registry_node_t *node)
+{
+    int rc = 0;
+    mutex_lock(&padv_lock);
+    if (!find_addr(&node->addr)) {
+        padv_sync_t *s = NULL;
+        for (unsigned i = 0; i < PADV_MAX_SYNCS && !s; i++) {
+            if (!syncs[i].in_use) s = &syncs[i];
+        }
+        if (s) {
+            memset(s, 0, sizeof(*s));
+            s->in_use = true;
+            s->addr = node->addr;
+            s->state = PADV_WANTED;
+        } else {
+            rc = -1;
+        }
+    }
+    mutex_unlock(&padv_lock);
+    return rc;
+}
+
+static void padv_remove(padv_sync_t *s)
+{
+    mutex_lock(&padv_lock);
+    padv_state_t state = s->state;
+    uint16_t sync_handle = s->sync_handle;
+    s->in_use = false;
+    mutex_unlock(&padv_lock);
+
+    if (state == PADV_SYNCED) {
+        ble_gap_periodic_adv_sync_terminate(sync_handle);
+    } else if (state == PADV_CREATING) {
+        ble_gap_periodic_adv_sync_create_cancel();
+    }
+}
+
+static void padv_print(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    static const char *const state_names[] = { "waiting", "syncing", "synced" };
+
+    printf("Periodic syncs: max %u\n", (unsigned)PADV_MAX_SYNCS);
+    printf("%-11s %-8s %6s %5s %7s %7s %6s %4s %5s %8s\n", "node", "state", "itvl",
+           "phy", "reports", "samples", "missed", "lost", "rssi", "last");
+    for (unsigned i = 0; i < PADV_MAX_SYNCS; i++) {
+        padv_sync_t *s = &syncs[i];
+        if (!s->in_use) continue;
+        printf("%-11s %-8s %4u ms %5s %7lu %7lu %6lu %4lu %5d", registry_addr_name(&s->addr),
+               state_names[s->state], s->itvl_ms,
+               s->phy == BLE_HCI_LE_PHY_CODED ? "coded" : "1M",
+               (unsigned long)s->reports, (unsigned long)s->samples,
+               (unsigned long)s->missed, (unsigned long)s->lost, s->rssi);
+        if (s->state == PADV_SYNCED) {
+            printf(" %5lu ms\n", (unsigned long)(now - s->last_report_ms));
+        } else {
+            printf(" %8s\n", "-");
+        }
+    }
+}
+
+static int padv_cmd(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "sync") == 0) {
+        bool all = strcmp(argv[2], "all") == 0;
+        registry_node_t *node = all ? NULL : registry_resolve(argv[2]);
+        if (!all && !node) {
+            printf("[ERR] Unknown node %s\n", argv[2]);
+            return 1;
+        }
+        for (unsigned i = 0; all ? i < registry_count() : i < 1; i++) {
+            if (all) node = registry_node(i);
+            if (padv_add(node) != 0) {
+                printf("[WARN] All %u periodic syncs taken, %s not followed\n",
+                       (unsigned)PADV_MAX_SYNCS, registry_name(node));
+                break;
+            }
+        }
+        ble_npl_callout_reset(&padv_timer, 0);
+    } else if (argc == 3 && strcmp(argv[1], "stop") == 0) {
+        bool all = strcmp(argv[2], "all") == 0;
+        registry_node_t *node = all ? NULL : registry_resolve(argv[2]);
+        padv_sync_t *s = node ? find_addr(&node->addr) : NULL;
+        if (!all && !s) {
+            printf("[ERR] Not synced to %s\n", argv[2]);
+            return 1;
+        }
+        for (unsigned i = 0; i < PADV_MAX_SYNCS; i++) {
+            if (syncs[i].in_use && (all || &syncs[i] == s)) padv_remove(&syncs[i]);
+        }
+    } else if (argc != 1) {
+        printf("usage: %s [sync|stop <node|all>]\n", argv[0]);
+        return 1;
+    }
+
+    padv_print();
+    return 0;
+}
+
+/**Shell command */
+int cmd_padv(int argc, char **argv)
+{
+    // Nodes are looked up next to registry_observe
+    return ble_host_cmd(padv_cmd, argc, argv);
+}
+
+#else
+
+bool padv_scan_wanted(void)
+{
+    return false;
+}
+
+void padv_init(void)
+{
+}
+
+/**Shell command */
+int cmd_padv(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    printf("[ERR] Built without periodic sync, rebuild with PERIODIC_SYNC=1\n");
+    return 1;
+}
+
+#endif /* MYNEWT_VAL(BLE_PERIODIC_ADV) && !GATEWAY_SIM */
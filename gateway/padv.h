@@ -0,0 +1,50 @@
+#ifndef PADV_H
+#define PADV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host/ble_hs.h"
+
+// Periodic advertising trains followed at once, limited by the controller
+#if MYNEWT_VAL(BLE_PERIODIC_ADV)
+#define PADV_MAX_SYNCS          MYNEWT_VAL(BLE_MAX_PERIODIC_SYNCS)
+#else
+#define PADV_MAX_SYNCS          1
+#endif
+// A sync is lost after this long without a report
+#define PADV_SYNC_TIMEOUT_MS    5000
+// Time to find the train of a node before trying the next one
+#define PADV_CREATE_TIMEOUT_MS  10000
+// Delay before syncing again after a failed or lost sync
+#define PADV_RESYNC_MS          1000
+
+typedef enum padv_state_t {
+    PADV_WANTED,                   // Waiting for its turn to sync
+    PADV_CREATING,                 // Sync create pending, only one at a time
+    PADV_SYNCED,
+} padv_state_t;
+
+// Periodic advertising train of one sensor node the gateway follows
+typedef struct padv_sync_t {
+    bool in_use;
+    ble_addr_t addr;
+    padv_state_t state;
+    uint16_t sync_handle;
+    uint16_t itvl_ms;              // Train interval, known once synced
+    uint8_t phy;
+    int8_t rssi;                   // Of the last report
+    uint32_t last_report_ms;
+    uint32_t last_seq;
+    // Statistics since the train was added
+    uint32_t reports;              // Complete reports received
+    uint32_t samples;              // New samples published
+    uint32_t missed;               // Samples skipped in the sequence numbers
+    uint32_t lost;                 // Syncs lost
+} padv_sync_t;
+
+void padv_init(void);
+bool padv_scan_wanted(void);
+
+int cmd_padv(int argc, char **argv);
+
+#endif /* PADV_H */
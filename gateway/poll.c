@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mutex.h"
+#include "ztimer.h"
+#include "nimble/nimble_port.h"
+#include "gateway.h"
+#include "registry.h"
+#include "ble_handler.h"
+#include "poll.h"
+
+static poll_job_t jobs[POLL_MAX_JOBS];
+static mutex_t poll_lock = MUTEX_INIT;
+static bool poll_running;
+static uint32_t last_start_ms;     // Last query started, for POLL_SPREAD_MS
+static bool started_any;
+
+// Scheduler timer, runs in the NimBLE host context
+static struct ble_npl_callout poll_timer;
+
+static const char *const type_names[] = { "TEMP", "HUM" };
+
+static unsigned inflight(void)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < POLL_MAX_JOBS; i++) {
+        if (jobs[i].in_use && jobs[i].request_id >= 0) count++;
+    }
+    return count;
+}
+
+/*
+*Release every job whose period started. A release still waiting for a
+*request slot when the next one comes is skipped.
+*/
+static void release_due(uint32_t now)
+{
+    for (unsigned i = 0; i < POLL_MAX_JOBS; i++) {
+        poll_job_t *j = &jobs[i];
+        if (!j->in_use) continue;
+
+        while ((int32_t)(now - j->release_ms) >= 0) {
+            if (j->pending) j->skipped++;
+            j->pending = true;
+            j->released++;
+            j->abs_deadline_ms = j->release_ms + j->deadline_ms;
+            j->release_ms += j->period_ms;
+        }
+    }
+}
+
+/*
+*Earliest deadline first among the released jobs without a query in
+*flight. Releases whose deadline already passed are skipped.
+*/
+static poll_job_t *edf_pick(uint32_t now)
+{
+    poll_job_t *best = NULL;
+
+    for (unsigned i = 0; i < POLL_MAX_JOBS; i++) {
+        poll_job_t *j = &jobs[i];
+        if (!j->in_use || !j->pending || j->request_id >= 0) continue;
+
+        if ((int32_t)(now - j->abs_deadline_ms) > 0) {
+            j->pending = false;
+            j->skipped++;
+            continue;
+        }
+        if (!best || (int32_t)(j->abs_deadline_ms - best->abs_deadline_ms) < 0) {
+            best = j;
+        }
+    }
+    return best;
+}
+
+// Job of a node and sensor type, NULL if there is none
+static poll_job_t *find_job(const ble_addr_t *addr, uint8_t sensor_type)
+{
+    for (unsigned i = 0; i < POLL_MAX_JOBS; i++) {
+        poll_job_t *j = &jobs[i];
+        if (j->in_use && j->sensor_type == sensor_type &&
+            ble_addr_cmp(&j->addr, addr) == 0) {
+            return j;
+        }
+    }
+    return NULL;
+}
+
+// Time until the next release, UINT32_MAX if there are no jobs
+static uint32_t next_release(uint32_t now)
+{
+    uint32_t next = UINT32_MAX;
+    for (unsigned i = 0; i < POLL_MAX_JOBS; i++) {
+        if (!jobs[i].in_use) continue;
+        uint32_t due = jobs[i].release_ms - now;
+        if ((int32_t)due < 0) due = 0;
+        if (due < next) next = due;
+    }
+    return next;
+}
+
+/*
+*Release due jobs and start the query of the most urgent one. Queries
+*are started at least POLL_SPREAD_MS apart, so their connects do not
+*compete for the radio.
+*/
+static void poll_run(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    poll_job_t *j = NULL;
+
+    mutex_lock(&poll_lock);
+    if (!poll_running) {
+        mutex_unlock(&poll_lock);
+        return;
+    }
+    release_due(now);
+    uint32_t next = next_release(now);
+
+    if (inflight() < POLL_MAX_INFLIGHT) {
+        uint32_t gap = now - last_start_ms;
+        if (started_any && gap < POLL_SPREAD_MS) {
+            if (POLL_SPREAD_MS - gap < next) next = POLL_SPREAD_MS - gap;
+        } else {
+            j = edf_pick(now);
+        }
+    }
+    ble_addr_t addr;
+    uint8_t sensor_type = 0;
+    if (j) {
+        addr = j->addr;
+        sensor_type = j->sensor_type;
+        // Claim the number the query will get, so poll_on_response accounts
+        // a query answered before ble_query_node returns
+        j->request_id = request_next_id();
+        j->start_ms = now;
+        j->query_deadline_ms = j->abs_deadline_ms;
+    }
+    mutex_unlock(&poll_lock);
+
+    if (j) {
+        // Not under the lock, a failing query publishes its response right away
+        registry_node_t *node = registry_find(&addr);
+        bool serves = node && (node->sensors & (1 << sensor_type));
+        int id = serves ? ble_query_node(sensor_type, 0, &addr) : -1;
+
+        mutex_lock(&poll_lock);
+        // The job may have been removed meanwhile, look it up again
+        j = find_job(&addr, sensor_type);
+        if (!j) {
+            // Removed, its response finds no job
+        } else if (!serves) {
+            // Node forgotten by the registry
+            j->request_id = -1;
+            j->pending = false;
+            j->skipped++;
+        } else if (id < 0) {
+            // Request slots taken by the shell, try again shortly
+            j->request_id = -1;
+            if (POLL_RETRY_MS < next) next = POLL_RETRY_MS;
+        } else {
+            j->pending = false;
+            last_start_ms = now;
+            started_any = true;
+            next = POLL_SPREAD_MS;
+        }
+        mutex_unlock(&poll_lock);
+    }
+
+    if (next != UINT32_MAX) {
+        ble_npl_callout_reset(&poll_timer, ble_npl_time_ms_to_ticks32(next));
+    }
+}
+
+static void poll_timer_cb(struct ble_npl_event *ev)
+{
+    (void)ev;
+    poll_run();
+}
+
+void poll_init(void)
+{
+    memset(jobs, 0, sizeof(jobs));
+    ble_npl_callout_init(&poll_timer, nimble_port_get_dflt_eventq(), poll_timer_cb, NULL);
+}
+
+/*
+*Account a published reading to the job whose query it answers.
+*/
+void poll_on_response(const sensor_response_t *response)
+{
+    if (strncmp(response->request_id, "REQ_", 4) != 0) return;
+    int id = strtoul(response->request_id + 4, NULL, 10);
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    bool found = false;
+
+    mutex_lock(&poll_lock);
+    for (unsigned i = 0; i < POLL_MAX_JOBS && !found; i++) {
+        poll_job_t *j = &jobs[i];
+        if (!j->in_use || j->request_id != id) continue;
+
+        found = true;
+        j->request_id = -1;
+        uint32_t took = now - j->start_ms;
+        j->service_ms = j->service_ms ? (3 * j->service_ms + took) / 4 : took;
+
+        int32_t late = now - j->query_deadline_ms;
+        if (!response->success) {
+            j->failed++;
+        } else if (late > 0) {
+            j->late++;
+            if ((uint32_t)late > j->max_late_ms) j->max_late_ms = late;
+        } else {
+            j->done++;
+        }
+    }
+    mutex_unlock(&poll_lock);
+
+    // Its slot is free once the request is released, dispatch after that
+    if (found) {
+        ble_npl_callout_reset(&poll_timer, 0);
+    }
+}
+
+/*
+*Schedule a node, or update its period. Releases of new jobs are spread
+*over the period so nodes added together are not polled at once.
+*returns: 0 on success, -1 if the job table is full.
+*/
+static int poll_add(const registry_node_t *node, int sensor_type,
+                    uint32_t period_ms, uint32_t deadline_ms)
+{
+    poll_job_t *free_job = NULL;
+    poll_job_t *j = NULL;
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < POLL_MAX_JOBS; i++) {
+        if (!jobs[i].in_use) {
+            if (!free_job) free_job = &jobs[i];
+            continue;
+        }
+        count++;
+        if (jobs[i].sensor_type == sensor_type &&
+            ble_addr_cmp(&jobs[i].addr, &node->addr) == 0) {
+            j = &jobs[i];
+        }
+    }
+    if (!j) {
+        if (!free_job) return -1;
+        j = free_job;
+        memset(j, 0, sizeof(*j));
+        j->in_use = true;
+        j->addr = node->addr;
+        j->sensor_type = sensor_type;
+        j->request_id = -1;
+        j->added_ms = ztimer_now(ZTIMER_MSEC);
+        j->release_ms = j->added_ms + (count * POLL_SPREAD_MS) % period_ms;
+    }
+    j->period_ms = period_ms;
+    j->deadline_ms = deadline_ms;
+    return 0;
+}
+
+static unsigned poll_del(const registry_node_t *node, int sensor_type)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < POLL_MAX_JOBS; i++) {
+        poll_job_t *j = &jobs[i];
+        if (!j->in_use) continue;
+        if (node && ble_addr_cmp(&j->addr, &node->addr) != 0) continue;
+        if (sensor_type >= 0 && j->sensor_type != sensor_type) continue;
+        j->in_use = false;
+        count++;
+    }
+    return count;
+}
+
+// Restart every job from now, releases spread as when added
+static void poll_restart(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < POLL_MAX_JOBS; i++) {
+        poll_job_t *j = &jobs[i];
+        if (!j->in_use) continue;
+        j->pending = false;
+        j->release_ms = now + (count++ * POLL_SPREAD_MS) % j->period_ms;
+    }
+}
+
+static void poll_clear_stats(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    for (unsigned i = 0; i < POLL_MAX_JOBS; i++) {
+        poll_job_t *j = &jobs[i];
+        j->added_ms = now;
+        j->released = j->done = j->late = j->failed = j->skipped = 0;
+        j->max_late_ms = 0;
+    }
+}
+
+static void poll_print(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    uint32_t utilization = 0;      // Per mille of the gateway's query time
+    unsigned count = 0;
+
+    printf("%-11s %-4s %7s %7s %6s %5s %5s %5s %5s %13s %6s %7s\n",
+           "node", "type", "period", "dline", "rel", "done", "late", "fail", "skip",
+           "rate (/min)", "svc", "maxlate");
+    mutex_lock(&poll_lock);
+    for (unsigned i = 0; i < POLL_MAX_JOBS; i++) {
+        poll_job_t *j = &jobs[i];
+        if (!j->in_use) continue;
+        count++;
+
+        uint32_t service = j->service_ms ? j->service_ms : POLL_EST_SERVICE_MS;
+        utilization += service * 1000 / j->period_ms;
+
+        registry_node_t *node = registry_find(&j->addr);
+        uint32_t elapsed = now - j->added_ms;
+        double rate = elapsed ? (j->done + j->late) * 60000.0 / elapsed : 0;
+        printf("%-11s %-4s %7lu %7lu %6lu %5lu %5lu %5lu %5lu %6.1f/%-6.1f %6lu %7lu\n",
+               node ? registry_name(node) : "?", type_names[j->sensor_type],
+               (unsigned long)j->period_ms, (unsigned long)j->deadline_ms,
+               (unsigned long)j->released, (unsigned long)j->done,
+               (unsigned long)j->late, (unsigned long)j->failed,
+               (unsigned long)j->skipped, rate, 60000.0 / j->period_ms,
+               (unsigned long)service, (unsigned long)j->max_late_ms);
+    }
+
+    unsigned in_flight = inflight();
+    mutex_unlock(&poll_lock);
+
+    // Queries share POLL_MAX_INFLIGHT slots but connects run one at a time
+    printf("Poller: %s, %u jobs, %u in flight, load %lu.%lu%%%s\n",
+           poll_running ? "running" : "stopped", count, in_flight,
+           (unsigned long)(utilization / 10), (unsigned long)(utilization % 10),
+           utilization > 1000 ? " - deadlines cannot all be met" : "");
+}
+
+static int sensor_arg(const char *arg)
+{
+    if (strcmp(arg, "temp") == 0) return SENSOR_TEMP;
+    if (strcmp(arg, "hum") == 0) return SENSOR_HUM;
+    return -1;
+}
+
+static int poll_usage(const char *cmd)
+{
+    printf("usage: %s [start|stop|clear]\n", cmd);
+    printf("       %s add <node|all> <temp|hum> <period_ms> [deadline_ms]\n", cmd);
+    printf("       %s del <node|all> [temp|hum]\n", cmd);
+    return 1;
+}
+
+static int poll_cmd(int argc, char **argv)
+{
+    if (argc == 2 && strcmp(argv[1], "start") == 0) {
+        mutex_lock(&poll_lock);
+        poll_restart();
+        poll_running = true;
+        mutex_unlock(&poll_lock);
+        ble_npl_callout_reset(&poll_timer, 0);
+    } else if (argc == 2 && strcmp(argv[1], "stop") == 0) {
+        // Queries in flight complete and are still accounted
+        mutex_lock(&poll_lock);
+        poll_running = false;
+        mutex_unlock(&poll_lock);
+        ble_npl_callout_stop(&poll_timer);
+    } else if (argc == 2 && strcmp(argv[1], "clear") == 0) {
+        mutex_lock(&poll_lock);
+        poll_clear_stats();
+        mutex_unlock(&poll_lock);
+    } else if (argc >= 5 && argc <= 6 && strcmp(argv[1], "add") == 0) {
+        int sensor_type = sensor_arg(argv[3]);
+        uint32_t period_ms = strtoul(argv[4], NULL, 10);
+        uint32_t deadline_ms = argc > 5 ? strtoul(argv[5], NULL, 10) : period_ms;
+        if (sensor_type < 0 || period_ms < POLL_MIN_PERIOD_MS ||
+            deadline_ms == 0 || deadline_ms > period_ms) {
+            printf("[ERR] Period must be at least %u ms, deadline 1..period\n",
+                   (unsigned)POLL_MIN_PERIOD_MS);
+            return 1;
+        }
+
+        bool all = strcmp(argv[2], "all") == 0;
+        registry_node_t *node = all ? NULL : registry_resolve(argv[2]);
+        if (!all && !node) {
+            printf("[ERR] Unknown node %s, see nodes\n", argv[2]);
+            return 1;
+        }
+
+        unsigned added = 0;
+        mutex_lock(&poll_lock);
+        for (unsigned i = 0; i < registry_count(); i++) {
+            registry_node_t *n = all ? registry_node(i) : node;
+            if (n->sensors & (1 << sensor_type)) {
+                if (poll_add(n, sensor_type, period_ms, deadline_ms) != 0) {
+                    printf("[WARN] Poll table full (%u jobs)\n", (unsigned)POLL_MAX_JOBS);
+                    break;
+                }
+                added++;
+            }
+            if (!all) break;
+        }
+        mutex_unlock(&poll_lock);
+        printf("[INFO] Polling %u node(s) every %lu ms\n", added, (unsigned long)period_ms);
+        if (poll_running) ble_npl_callout_reset(&poll_timer, 0);
+    } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "del") == 0) {
+        bool all = strcmp(argv[2], "all") == 0;
+        registry_node_t *node = all ? NULL : registry_resolve(argv[2]);
+        int sensor_type = argc > 3 ? sensor_arg(argv[3]) : -1;
+        if ((!all && !node) || (argc > 3 && sensor_type < 0)) {
+            return poll_usage(argv[0]);
+        }
+        mutex_lock(&poll_lock);
+        unsigned removed = poll_del(node, sensor_type);
+        mutex_unlock(&poll_lock);
+        printf("[INFO] Removed %u job(s)\n", removed);
+    } else if (argc != 1) {
+        return poll_usage(argv[0]);
+    }
+
+    poll_print();
+    return 0;
+}
+
+/**Shell command */
+int cmd_poll(int argc, char **argv)
+{
+    // Nodes are looked up next to registry_observe
+    return ble_host_cmd(poll_cmd, argc, argv);
+}
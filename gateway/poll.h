@@ -0,0 +1,51 @@
+#ifndef POLL_H
+#define POLL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host/ble_hs.h"
+#include "application.h"
+#include "request.h"
+
+// Periodic readings scheduled at once, one per node and sensor type
+#define POLL_MAX_JOBS          64
+// Queries the poller keeps in flight, one request slot is left for the shell
+#define POLL_MAX_INFLIGHT      (MAX_REQUESTS - 1)
+// Minimum gap between two polls started, so their connects do not collide
+#define POLL_SPREAD_MS         50
+// Retry delay when no request slot is free
+#define POLL_RETRY_MS          20
+// Service time assumed for a job until one is measured
+#define POLL_EST_SERVICE_MS    300
+#define POLL_MIN_PERIOD_MS     100
+
+// Periodic reading of one sensor type from one node
+typedef struct poll_job_t {
+    bool in_use;
+    ble_addr_t addr;               // Node, looked up in the registry per release
+    uint8_t sensor_type;           // SENSOR_TEMP or SENSOR_HUM
+    uint32_t period_ms;
+    uint32_t deadline_ms;          // Relative to the release, at most the period
+    uint32_t release_ms;           // Next release
+    uint32_t abs_deadline_ms;      // Deadline of the pending release
+    bool pending;                  // Released, query not started yet
+    int request_id;                // Query in flight, -1 if none
+    uint32_t start_ms;             // Query start, for the service time
+    uint32_t query_deadline_ms;    // Deadline of the release the query serves
+    uint32_t service_ms;           // Moving average of the query duration
+    // Statistics since the job was added
+    uint32_t added_ms;
+    uint32_t released;
+    uint32_t done;                 // Readings before their deadline
+    uint32_t late;                 // Readings after their deadline
+    uint32_t failed;               // Queries that returned an error
+    uint32_t skipped;              // Releases dropped, deadline passed before a slot
+    uint32_t max_late_ms;
+} poll_job_t;
+
+void poll_init(void);
+void poll_on_response(const sensor_response_t *response);
+
+int cmd_poll(int argc, char **argv);
+
+#endif /* POLL_H */
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ztimer.h"
+#include "nimble_scanner.h"
+#include "nimble_scanlist.h"
+#include "ble_handler.h"
+#include "presence.h"
+
+bool presence_enabled = false;
+
+/*
+* returns: true if the UUID16 lists of an advertisement carry the given
+* sensor characteristic UUID. A node advertises every reading it serves.
+*/
+static bool ad_has_sensor(const uint8_t *ad, size_t ad_len, uint16_t sensor_uuid)
+{
+    uint8_t match = adv_filter_match(&sensor_filter, ad, ad_len);
+
+    for (uint8_t i = 0; i < sensor_filter.num_uuids; i++) {
+        if ((match & (1 << i)) && sensor_filter.uuids[i] == sensor_uuid) return true;
+    }
+    return false;
+}
+
+static uint32_t entry_age_ms(const nimble_scanlist_entry_t *e)
+{
+    // scanlist stamps entries with ZTIMER_USEC
+    return (ztimer_now(ZTIMER_USEC) - e->last_update) / US_PER_MS;
+}
+
+void presence_init(void)
+{
+    nimble_scanlist_init();
+}
+
+/*
+* Record an advertisement in the presence table. scan_cb only passes on our
+* sensors, so the bounded scanlist is not filled up by foreign advertisers.
+*/
+void presence_update(uint8_t type, const ble_addr_t *addr,
+                     const nimble_scanner_info_t *info,
+                     const uint8_t *ad, size_t ad_len)
+{
+    if (!presence_enabled) return;
+
+    nimble_scanlist_update(type, addr, info, ad, ad_len);
+}
+
+/*
+* Find the freshest known sensor of the given type.
+* returns: true if an entry younger than max_age_ms exists.
+*/
+bool presence_lookup(uint16_t sensor_uuid, uint32_t max_age_ms,
+                     presence_entry_t *entry)
+{
+    if (!presence_enabled) return false;
+
+    bool found = false;
+    uint32_t best_age = UINT32_MAX;
+
+    for (nimble_scanlist_entry_t *e = nimble_scanlist_get_by_pos(0); e;
+         e = nimble_scanlist_get_next(e)) {
+        if (!ad_has_sensor(e->ad, e->ad_len, sensor_uuid)) continue;
+
+        uint32_t age = entry_age_ms(e);
+        if (age > max_age_ms || age >= best_age) continue;
+
+        best_age = age;
+        memcpy(&entry->addr, &e->addr, sizeof(ble_addr_t));
+        entry->sensor_uuid = sensor_uuid;
+        entry->rssi = e->last_rssi;
+        entry->last_seen_ms = age;
+        found = true;
+    }
+    return found;
+}
+
+static int scan_configure(uint32_t itvl_ms, uint32_t win_ms)
+{
+    nimble_scanner_cfg_t params = {
+        .itvl_ms = itvl_ms,
+        .win_ms = win_ms,
+        #if IS_USED(MODULE_NIMBLE_PHY_CODED)
+                .flags = NIMBLE_SCANNER_PHY_1M | NIMBLE_SCANNER_PHY_CODED,
+        #else
+                .flags = NIMBLE_SCANNER_PHY_1M,
+        #endif
+    };
+
+    nimble_scanner_stop();
+    return nimble_scanner_init(&params, scan_cb);
+}
+
+/*
+* Switch the scanner to full duty cycle for a query that has no fresh entry.
+*/
+int presence_scan_active(void)
+{
+    int rc = scan_configure(DEFAULT_SCAN_INTERVAL_MS, DEFAULT_SCAN_INTERVAL_MS);
+    if (rc != 0) return rc;
+    return nimble_scanner_start();
+}
+
+/*
+* Called once a query is over: go back to low duty background scanning, or
+* stay idle if background mode is off.
+*/
+int presence_scan_resume(void)
+{
+    if (!presence_enabled) {
+        nimble_scanner_stop();
+        return 0;
+    }
+
+    int rc = scan_configure(PRESENCE_SCAN_INTERVAL_MS, PRESENCE_SCAN_WINDOW_MS);
+    if (rc != 0) return rc;
+    return nimble_scanner_start();
+}
+
+void presence_print(void)
+{
+    printf("Background scan: %s\n", presence_enabled ? "on" : "off");
+
+    unsigned count = 0;
+    for (nimble_scanlist_entry_t *e = nimble_scanlist_get_by_pos(0); e;
+         e = nimble_scanlist_get_next(e)) {
+        bool temp = ad_has_sensor(e->ad, e->ad_len, TEMPERATURE_CHARACTERISTIC_UUID);
+        bool hum = ad_has_sensor(e->ad, e->ad_len, HUMIDITY_CHARACTERISTIC_UUID);
+        printf("[%u] %02x:%02x:%02x:%02x:%02x:%02x  %s %s  RSSI: %d dBm  seen %lu ms ago\n",
+               count++,
+               e->addr.val[5], e->addr.val[4], e->addr.val[3],
+               e->addr.val[2], e->addr.val[1], e->addr.val[0],
+               temp ? "TEMP" : "    ", hum ? "HUM" : "   ",
+               e->last_rssi, (unsigned long)entry_age_ms(e));
+    }
+    if (count == 0) {
+        printf("No sensors known\n");
+    }
+}
+
+static int presence_cmd(int argc, char **argv)
+{
+    if (argc > 1) {
+        if (strcmp(argv[1], "on") == 0) {
+            presence_enabled = true;
+        } else if (strcmp(argv[1], "off") == 0) {
+            presence_enabled = false;
+        } else if (strcmp(argv[1], "clear") == 0) {
+            nimble_scanlist_clear();
+        } else {
+            printf("usage: %s [on|off|clear]\n", argv[0]);
+            return 1;
+        }
+
+        int rc = ble_scan_update();
+        if (rc != 0) {
+            printf("[ERROR] Failed to restart scanner, rc: %d\n", rc);
+        }
+    }
+
+    presence_print();
+    return 0;
+}
+
+/**Shell command */
+int cmd_presence(int argc, char **argv)
+{
+    // The scanner and the scan list belong to the host
+    return ble_host_cmd(presence_cmd, argc, argv);
+}
@@ -0,0 +1,39 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "nimble_scanner.h"
+#include "host/ble_hs.h"
+
+// Background scan: 30 ms window every 300 ms (10% duty cycle)
+#define PRESENCE_SCAN_INTERVAL_MS 300
+#define PRESENCE_SCAN_WINDOW_MS   30
+
+// Entries older than this are stale and a query falls back to an active scan
+#define PRESENCE_MAX_AGE_MS       2000
+
+// Presence table entry, filled from the nimble_scanlist record of a sensor
+typedef struct presence_entry_t {
+    ble_addr_t addr;          // Advertiser address
+    uint16_t sensor_uuid;     // Characteristic UUID looked up (sensor type)
+    int8_t rssi;              // Last RSSI seen
+    uint32_t last_seen_ms;    // Time since the last advertisement
+} presence_entry_t;
+
+extern bool presence_enabled;
+
+void presence_init(void);
+void presence_update(uint8_t type, const ble_addr_t *addr,
+                     const nimble_scanner_info_t *info,
+                     const uint8_t *ad, size_t ad_len);
+bool presence_lookup(uint16_t sensor_uuid, uint32_t max_age_ms,
+                     presence_entry_t *entry);
+int presence_scan_active(void);
+int presence_scan_resume(void);
+void presence_print(void);
+
+int cmd_presence(int argc, char **argv);
+
+#endif /* PRESENCE_H */
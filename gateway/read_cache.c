@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mutex.h"
+#include "ztimer.h"
+#include "gateway.h"
+#include "ble_handler.h"
+#include "read_cache.h"
+
+#define READ_CACHE_SENSORS 2
+
+static read_cache_entry_t entries[READ_CACHE_SENSORS];
+static mutex_t cache_lock = MUTEX_INIT;
+
+static const char *const cache_names[READ_CACHE_SENSORS] = { "TEMP", "HUM" };
+
+void read_cache_init(void)
+{
+    memset(entries, 0, sizeof(entries));
+    for (unsigned i = 0; i < READ_CACHE_SENSORS; i++) {
+        entries[i].inflight_id = -1;
+    }
+}
+
+/*
+*Read through the cache: a reading younger than max_age_ms is printed
+*right away, a query of the same sensor type already in flight is joined,
+*anything else starts a new query.
+*returns: the request number serving the get, 0 for a cache hit, -1 on
+*error.
+*/
+int read_cache_get(int sensor_type, uint8_t flags, uint32_t max_age_ms)
+{
+    if (sensor_type < 0 || sensor_type >= READ_CACHE_SENSORS) {
+        return ble_query_sensor(sensor_type, flags);
+    }
+    read_cache_entry_t *e = &entries[sensor_type];
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+
+    mutex_lock(&cache_lock);
+    if (e->valid && max_age_ms > 0 && now - e->received_ms <= max_age_ms) {
+        sensor_response_t response = e->response;
+        e->hits++;
+        mutex_unlock(&cache_lock);
+
+        print_sensor_response(&response);
+        printf("[CACHE] %s reading is %lu ms old\n", cache_names[sensor_type],
+               (unsigned long)(now - e->received_ms));
+        return 0;
+    }
+    int inflight = e->inflight_id;
+    mutex_unlock(&cache_lock);
+
+    // The request table is asked on the host thread, without cache_lock held
+    // as the host takes it to publish responses
+    if (inflight >= 0 && ble_request_active(inflight)) {
+        mutex_lock(&cache_lock);
+        bool joined = e->inflight_id == inflight;
+        if (joined) {
+            e->waiters++;
+            e->coalesced++;
+        }
+        mutex_unlock(&cache_lock);
+
+        if (joined) {
+            printf("[CACHE] Joined %s query %d in flight\n", cache_names[sensor_type], inflight);
+            return inflight;
+        }
+    }
+    mutex_lock(&cache_lock);
+    e->misses++;
+    e->waiters = 0;
+    mutex_unlock(&cache_lock);
+
+    int id = ble_query_sensor(sensor_type, flags);
+
+    // The query may already be over, e.g. if the scanner failed to start
+    bool active = id >= 0 && ble_request_active(id);
+    mutex_lock(&cache_lock);
+    e->inflight_id = active ? id : -1;
+    mutex_unlock(&cache_lock);
+    return id;
+}
+
+/*
+*Refresh the cache from any published reading and close the query in
+*flight it answers.
+*/
+void read_cache_on_response(const sensor_response_t *response)
+{
+    int t;
+    if (strcmp(response->unit, "Celsius") == 0) {
+        t = SENSOR_TEMP;
+    } else if (strcmp(response->unit, "Percent") == 0) {
+        t = SENSOR_HUM;
+    } else {
+        return;
+    }
+    read_cache_entry_t *e = &entries[t];
+
+    mutex_lock(&cache_lock);
+    if (response->success) {
+        e->valid = true;
+        e->response = *response;
+        e->received_ms = ztimer_now(ZTIMER_MSEC);
+    }
+    unsigned waiters = 0;
+    if (e->inflight_id >= 0 && strncmp(response->request_id, "REQ_", 4) == 0 &&
+        strtoul(&response->request_id[4], NULL, 10) == (unsigned long)e->inflight_id) {
+        waiters = e->waiters;
+        e->inflight_id = -1;
+        e->waiters = 0;
+    }
+    mutex_unlock(&cache_lock);
+
+    if (waiters > 0) {
+        printf("[CACHE] %s response shared with %u joined gets\n", cache_names[t], waiters);
+    }
+}
+
+/**Shell command */
+int cmd_cache(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "clear") == 0) {
+        mutex_lock(&cache_lock);
+        for (unsigned i = 0; i < READ_CACHE_SENSORS; i++) {
+            entries[i].valid = false;
+            entries[i].hits = entries[i].misses = entries[i].coalesced = 0;
+        }
+        mutex_unlock(&cache_lock);
+        return 0;
+    } else if (argc > 1) {
+        printf("usage: %s [clear]\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    for (unsigned i = 0; i < READ_CACHE_SENSORS; i++) {
+        read_cache_entry_t *e = &entries[i];
+        printf("%-4s ", cache_names[i]);
+        if (e->valid) {
+            printf("%.2f %s, %lu ms old", e->response.value, e->response.unit,
+                   (unsigned long)(now - e->received_ms));
+        } else {
+            printf("empty");
+        }
+        printf("  hits: %lu  misses: %lu  joined: %lu\n", (unsigned long)e->hits,
+               (unsigned long)e->misses, (unsigned long)e->coalesced);
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef READ_CACHE_H
+#define READ_CACHE_H
+
+#include <stdint.h>
+#include "application.h"
+
+// Last reading of one sensor type, and the query refreshing it
+typedef struct read_cache_entry_t {
+    bool valid;
+    sensor_response_t response;    // Last successful reading
+    uint32_t received_ms;          // Gateway time it arrived
+    int inflight_id;               // Request number of the query in flight, -1 if none
+    unsigned waiters;              // Gets joined onto the query in flight
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t coalesced;
+} read_cache_entry_t;
+
+void read_cache_init(void);
+int read_cache_get(int sensor_type, uint8_t flags, uint32_t max_age_ms);
+void read_cache_on_response(const sensor_response_t *response);
+
+int cmd_cache(int argc, char **argv);
+
+#endif /* READ_CACHE_H */
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ztimer.h"
+#include "ble_handler.h"
+#include "registry.h"
+
+#if (REGISTRY_BUCKETS & (REGISTRY_BUCKETS - 1)) != 0
+#error "REGISTRY_BUCKETS must be a power of two"
+#endif
+
+// Index buckets hold the node index + 1
+#define BUCKET_EMPTY    0
+#define BUCKET_REMOVED  UINT16_MAX     // Label moved away, keep probing past it
+
+static registry_node_t nodes[REGISTRY_MAX_NODES];
+static unsigned node_count;
+static bool full_warned;
+
+// Open addressing with linear probing, by address and by label
+static uint16_t addr_index[REGISTRY_BUCKETS];
+static uint16_t label_index[REGISTRY_BUCKETS];
+
+// FNV-1a
+static uint32_t hash_bytes(uint32_t h, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t addr_hash(const ble_addr_t *addr)
+{
+    uint32_t h = hash_bytes(2166136261u, &addr->type, 1);
+    return hash_bytes(h, addr->val, sizeof(addr->val));
+}
+
+static uint32_t label_hash(const char *label)
+{
+    return hash_bytes(2166136261u, (const uint8_t *)label, strlen(label));
+}
+
+/*
+*Bucket of an address: the one holding its node, or the empty one it
+*would go into.
+*/
+static uint16_t *addr_bucket(const ble_addr_t *addr)
+{
+    uint32_t b = addr_hash(addr);
+    for (unsigned probe = 0; probe < REGISTRY_BUCKETS; probe++, b++) {
+        uint16_t *bucket = &addr_index[b & (REGISTRY_BUCKETS - 1)];
+        if (*bucket == BUCKET_EMPTY ||
+            ble_addr_cmp(&nodes[*bucket - 1].addr, addr) == 0) {
+            return bucket;
+        }
+    }
+    // Cannot happen, the index has twice as many buckets as nodes
+    return NULL;
+}
+
+static uint16_t *label_bucket(const char *label)
+{
+    uint32_t b = label_hash(label);
+    for (unsigned probe = 0; probe < REGISTRY_BUCKETS; probe++, b++) {
+        uint16_t *bucket = &label_index[b & (REGISTRY_BUCKETS - 1)];
+        if (*bucket == BUCKET_EMPTY) return NULL;
+        if (*bucket != BUCKET_REMOVED && strcmp(nodes[*bucket - 1].label, label) == 0) {
+            return bucket;
+        }
+    }
+    return NULL;
+}
+
+registry_node_t *registry_find(const ble_addr_t *addr)
+{
+    uint16_t *bucket = addr_bucket(addr);
+    return bucket && *bucket != BUCKET_EMPTY ? &nodes[*bucket - 1] : NULL;
+}
+
+/*
+*Record an advertisement of one of our sensors, called from scan_cb.
+*returns: the node, NULL if it is new and the registry is full.
+*/
+registry_node_t *registry_observe(const ble_addr_t *addr, uint8_t sensors, int8_t rssi)
+{
+    uint16_t *bucket = addr_bucket(addr);
+    if (!bucket) return NULL;
+
+    registry_node_t *node;
+    if (*bucket != BUCKET_EMPTY) {
+        node = &nodes[*bucket - 1];
+    } else {
+        if (node_count >= REGISTRY_MAX_NODES) {
+            if (!full_warned) {
+                printf("[WARN] Sensor registry full, new nodes are ignored\n");
+                full_warned = true;
+            }
+            return NULL;
+        }
+        node = &nodes[node_count++];
+        memset(node, 0, sizeof(*node));
+        node->addr = *addr;
+        *bucket = node_count;
+    }
+    node->sensors = sensors;
+    node->rssi = rssi;
+    node->last_seen_ms = ztimer_now(ZTIMER_MSEC);
+    return node;
+}
+
+registry_node_t *registry_node(unsigned id)
+{
+    return id < node_count ? &nodes[id] : NULL;
+}
+
+unsigned registry_id(const registry_node_t *node)
+{
+    return node - nodes;
+}
+
+unsigned registry_count(void)
+{
+    return node_count;
+}
+
+// Address written as on the log lines, most significant byte first
+static bool parse_addr(const char *str, uint8_t *val)
+{
+    for (int i = 5; i >= 0; i--) {
+        char *end;
+        unsigned long byte = strtoul(str, &end, 16);
+        if (end != str + 2 || byte > 0xff) return false;
+        if (i > 0 && *end != ':') return false;
+        if (i == 0 && *end != '\0') return false;
+        val[i] = byte;
+        str = end + 1;
+    }
+    return true;
+}
+
+/*
+*Look up a node by label, by ID as "n<id>" or by address.
+*returns: the node, NULL if none matches.
+*/
+registry_node_t *registry_resolve(const char *name)
+{
+    uint16_t *bucket = label_bucket(name);
+    if (bucket) return &nodes[*bucket - 1];
+
+    if (name[0] == 'n' && name[1] >= '0' && name[1] <= '9') {
+        char *end;
+        unsigned long id = strtoul(name + 1, &end, 10);
+        if (*end == '\0') return registry_node(id);
+    }
+
+    ble_addr_t addr;
+    if (!parse_addr(name, addr.val)) return NULL;
+    addr.type = BLE_ADDR_RANDOM;
+    registry_node_t *node = registry_find(&addr);
+    if (!node) {
+        addr.type = BLE_ADDR_PUBLIC;
+        node = registry_find(&addr);
+    }
+    return node;
+}
+
+// Label of a node, or its ID if it has none
+const char *registry_name(const registry_node_t *node)
+{
+    static char buf[8];
+    if (node->label[0] != '\0') return node->label;
+    snprintf(buf, sizeof(buf), "n%u", registry_id(node));
+    return buf;
+}
+
+// Name of the node at addr, its address if it is not registered
+const char *registry_addr_name(const ble_addr_t *addr)
+{
+    static char buf[18];
+    registry_node_t *node = registry_find(addr);
+    if (node) return registry_name(node);
+    snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x",
+             addr->val[5], addr->val[4], addr->val[3],
+             addr->val[2], addr->val[1], addr->val[0]);
+    return buf;
+}
+
+/*
+*Label a node, an empty label removes it.
+*returns: 0 on success, -1 if the label is too long, looks like a node ID,
+*a max_age_ms or a flag of the get commands, or is taken by another node.
+*/
+int registry_set_label(registry_node_t *node, const char *label)
+{
+    if (strlen(label) >= REGISTRY_LABEL_LEN) return -1;
+    if (label[0] == 'n' && label[1] >= '0' && label[1] <= '9') return -1;
+    if ((label[0] >= '0' && label[0] <= '9') || label[0] == '-') return -1;
+
+    uint16_t *bucket = label_bucket(label);
+    if (label[0] != '\0' && bucket) {
+        return &nodes[*bucket - 1] == node ? 0 : -1;
+    }
+
+    if (node->label[0] != '\0' && (bucket = label_bucket(node->label))) {
+        *bucket = BUCKET_REMOVED;
+    }
+    strcpy(node->label, label);
+    if (label[0] == '\0') return 0;
+
+    uint32_t b = label_hash(label);
+    for (unsigned probe = 0; probe < REGISTRY_BUCKETS; probe++, b++) {
+        bucket = &label_index[b & (REGISTRY_BUCKETS - 1)];
+        if (*bucket == BUCKET_EMPTY || *bucket == BUCKET_REMOVED) {
+            *bucket = registry_id(node) + 1;
+            return 0;
+        }
+    }
+    // Every bucket removed or taken, the label still names the node in listings
+    return 0;
+}
+
+/*
+*Forget every node. Runs on the host thread; node pointers are not kept
+*past a host call, queries and jobs refer to nodes by address.
+*/
+void registry_clear(void)
+{
+    node_count = 0;
+    full_warned = false;
+    memset(addr_index, 0, sizeof(addr_index));
+    memset(label_index, 0, sizeof(label_index));
+}
+
+static void registry_print(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+
+    printf("Sensor registry: %u/%u nodes\n", node_count, (unsigned)REGISTRY_MAX_NODES);
+    for (unsigned i = 0; i < node_count; i++) {
+        registry_node_t *n = &nodes[i];
+        printf("n%-3u %02x:%02x:%02x:%02x:%02x:%02x  %-11s %s%s  RSSI: %d dBm"
+               "  seen %lu ms ago\n", i,
+               n->addr.val[5], n->addr.val[4], n->addr.val[3],
+               n->addr.val[2], n->addr.val[1], n->addr.val[0],
+               n->label[0] != '\0' ? n->label : "-",
+               (n->sensors & 1) ? "TEMP " : "",
+               (n->sensors & 2) ? "HUM" : "",
+               n->rssi, (unsigned long)(now - n->last_seen_ms));
+    }
+}
+
+static int nodes_cmd(int argc, char **argv)
+{
+    if (argc > 1) {
+        if (strcmp(argv[1], "clear") == 0 && argc == 2) {
+            registry_clear();
+        } else if (strcmp(argv[1], "label") == 0 && (argc == 3 || argc == 4)) {
+            registry_node_t *node = registry_resolve(argv[2]);
+            if (!node) {
+                printf("[ERR] Unknown node %s\n", argv[2]);
+                return 1;
+            }
+            if (registry_set_label(node, argc == 4 ? argv[3] : "") != 0) {
+                printf("[ERR] Label must be unique, not n<id>, not start with a digit or -,"
+                       " and be shorter than %d characters\n", REGISTRY_LABEL_LEN);
+                return 1;
+            }
+        } else {
+            printf("usage: %s [label <node> [label]|clear]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    registry_print();
+    return 0;
+}
+
+/**Shell command */
+int cmd_nodes(int argc, char **argv)
+{
+    // registry_observe inserts from the scan callback
+    return ble_host_cmd(nodes_cmd, argc, argv);
+}
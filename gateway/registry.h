@@ -0,0 +1,36 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host/ble_hs.h"
+
+// Sensor nodes remembered, new ones are ignored once full
+#define REGISTRY_MAX_NODES  256
+// Hash buckets per index, a power of two at twice the nodes keeps probes short
+#define REGISTRY_BUCKETS    (2 * REGISTRY_MAX_NODES)
+#define REGISTRY_LABEL_LEN  12
+
+// Sensor node heard by the gateway, its ID is its index and stays until cleared
+typedef struct registry_node_t {
+    ble_addr_t addr;
+    char label[REGISTRY_LABEL_LEN];  // User label, empty if none
+    uint8_t sensors;               // sensor_filter match bits of its advertisements
+    int8_t rssi;                   // Last RSSI heard
+    uint32_t last_seen_ms;
+} registry_node_t;
+
+registry_node_t *registry_observe(const ble_addr_t *addr, uint8_t sensors, int8_t rssi);
+registry_node_t *registry_find(const ble_addr_t *addr);
+registry_node_t *registry_node(unsigned id);
+registry_node_t *registry_resolve(const char *name);
+unsigned registry_id(const registry_node_t *node);
+unsigned registry_count(void);
+const char *registry_name(const registry_node_t *node);
+const char *registry_addr_name(const ble_addr_t *addr);
+int registry_set_label(registry_node_t *node, const char *label);
+void registry_clear(void);
+
+int cmd_nodes(int argc, char **argv);
+
+#endif /* REGISTRY_H */
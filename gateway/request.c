@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ztimer.h"
+#include "nimble/nimble_port.h"
+#include "ble_handler.h"
+#include "request.h"
+#include "response_pool.h"
+
+static gw_request_t requests[MAX_REQUESTS];
+// Request numbers start at 1, read_cache_get() returns 0 for a cache hit
+static uint32_t next_id = 1;
+
+// Deadline of each phase in ms, 0 for none
+static const uint32_t phase_timeout_ms[] = {
+    [REQ_SCANNING]        = SCAN_TIMEOUT_MS,
+    [REQ_CONNECT_PENDING] = CONNECT_TIMEOUT_MS,
+    [REQ_CONNECTING]      = CONNECT_TIMEOUT_MS,
+    [REQ_DISCOVERING]     = DISCOVERY_TIMEOUT_MS,
+    [REQ_READING]         = READ_TIMEOUT_MS,
+    [REQ_SUBSCRIBING]     = DISCOVERY_TIMEOUT_MS,
+    [REQ_DRAINING]        = DRAIN_TIMEOUT_MS,
+};
+
+// ztimer callback, runs in interrupt context: defer to the NimBLE host
+static void deadline_cb(void *arg)
+{
+    gw_request_t *req = arg;
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &req->timeout_ev);
+}
+
+static void timeout_ev_cb(struct ble_npl_event *ev)
+{
+    ble_request_timeout(ble_npl_event_get_arg(ev));
+}
+
+static void deadline_clear(gw_request_t *req)
+{
+    ztimer_remove(ZTIMER_MSEC, &req->deadline);
+    ble_npl_eventq_remove(nimble_port_get_dflt_eventq(), &req->timeout_ev);
+}
+
+/*
+* Move a request to its next phase and arm the deadline of that phase.
+* The deadline of the previous phase is cancelled.
+*/
+void request_set_state(gw_request_t *req, request_state_t state)
+{
+    deadline_clear(req);
+    req->state = state;
+    req->timed_out = false;
+
+    uint32_t timeout = 0;
+    if ((size_t)state < sizeof(phase_timeout_ms) / sizeof(phase_timeout_ms[0])) {
+        timeout = phase_timeout_ms[state];
+    }
+    if (timeout > 0) {
+        ztimer_set(ZTIMER_MSEC, &req->deadline, timeout);
+    }
+}
+
+/*
+* Timestamp a phase of the query in its response, for the benchmarks.
+*/
+void request_mark_phase(gw_request_t *req, query_phase_t phase)
+{
+    req->response->phase_ms[phase] = ztimer_now(ZTIMER_MSEC) - req->start_time;
+    req->response->phases |= 1 << phase;
+    TIMING_STAMP_PHASE(req, phase);
+}
+
+/*
+* Take a free request slot and its response record.
+* returns: the request, or NULL if MAX_REQUESTS queries are in flight.
+*/
+gw_request_t *request_alloc(uint16_t sensor_uuid)
+{
+    gw_request_t *req = NULL;
+    for (unsigned i = 0; i < MAX_REQUESTS; i++) {
+        if (requests[i].state == REQ_FREE) {
+            req = &requests[i];
+            break;
+        }
+    }
+    if (!req) return NULL;
+
+    sensor_response_t *response = response_acquire();
+    if (!response) return NULL;
+
+    memset(req, 0, sizeof(*req));
+    req->deadline.callback = deadline_cb;
+    req->deadline.arg = req;
+    ble_npl_event_init(&req->timeout_ev, timeout_ev_cb, req);
+    req->id = next_id++;
+    // Numbers are returned as int, -1 for an error: wrap before INT32_MAX
+    if (next_id > INT32_MAX) next_id = 1;
+    req->sensor_uuid = sensor_uuid;
+    req->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    req->start_time = ztimer_now(ZTIMER_MSEC);
+    req->response = response;
+    req->state = REQ_STARTING;
+    TIMING_BEGIN(req);
+
+    snprintf(response->request_id, sizeof(response->request_id), "REQ_%lu_%lu",
+             (unsigned long)req->id, (unsigned long)req->start_time);
+    if (sensor_uuid == TEMPERATURE_CHARACTERISTIC_UUID) {
+        req->type_name = "TEMP";
+        strcpy(response->unit, "Celsius");
+    } else {
+        req->type_name = "HUM";
+        strcpy(response->unit, "Percent");
+    }
+    return req;
+}
+
+void request_free(gw_request_t *req)
+{
+    TIMING_COMMIT(req);
+    response_release(req->response);
+    req->response = NULL;
+    request_set_state(req, REQ_FREE);
+}
+
+// Number the next request allocated gets
+int request_next_id(void)
+{
+    return next_id;
+}
+
+gw_request_t *request_find_by_id(uint32_t id)
+{
+    for (unsigned i = 0; i < MAX_REQUESTS; i++) {
+        if (requests[i].state != REQ_FREE && requests[i].id == id) {
+            return &requests[i];
+        }
+    }
+    return NULL;
+}
+
+gw_request_t *request_find_by_conn(uint16_t conn_handle)
+{
+    if (conn_handle == BLE_HS_CONN_HANDLE_NONE) return NULL;
+
+    for (unsigned i = 0; i < MAX_REQUESTS; i++) {
+        if (requests[i].state != REQ_FREE && requests[i].conn_handle == conn_handle) {
+            return &requests[i];
+        }
+    }
+    return NULL;
+}
+
+// Request that already owns a sensor, so two queries never target one node
+gw_request_t *request_find_by_addr(const ble_addr_t *addr)
+{
+    for (unsigned i = 0; i < MAX_REQUESTS; i++) {
+        if (requests[i].state > REQ_SCANNING &&
+            ble_addr_cmp(&requests[i].addr, addr) == 0) {
+            return &requests[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+* returns: the oldest request in the given state, for any sensor type if
+* sensor_uuid is 0.
+*/
+gw_request_t *request_find_state(request_state_t state, uint16_t sensor_uuid)
+{
+    gw_request_t *oldest = NULL;
+    for (unsigned i = 0; i < MAX_REQUESTS; i++) {
+        gw_request_t *req = &requests[i];
+        if (req->state != state) continue;
+        if (sensor_uuid != 0 && req->sensor_uuid != sensor_uuid) continue;
+        if (!oldest || req->id < oldest->id) oldest = req;
+    }
+    return oldest;
+}
+
+// Whether a request addressed to one node accepts the node at addr
+static bool request_accepts(const gw_request_t *req, const ble_addr_t *addr)
+{
+    return !req->targeted || ble_addr_cmp(&req->addr, addr) == 0;
+}
+
+/*
+* returns: the oldest request scanning for the given sensor type that the
+* advertiser at addr can answer, or NULL.
+*/
+gw_request_t *request_find_scanning(uint16_t sensor_uuid, const ble_addr_t *addr)
+{
+    gw_request_t *oldest = NULL;
+    for (unsigned i = 0; i < MAX_REQUESTS; i++) {
+        gw_request_t *req = &requests[i];
+        if (req->state != REQ_SCANNING || req->sensor_uuid != sensor_uuid) continue;
+        if (!request_accepts(req, addr)) continue;
+        if (!oldest || req->id < oldest->id) oldest = req;
+    }
+    return oldest;
+}
+
+/*
+* returns: the oldest one-shot read that has no link yet, i.e. is scanning
+* or waiting for the connect slot, and may be served by the node at addr,
+* or NULL.
+*/
+gw_request_t *request_find_waiting(const ble_addr_t *addr)
+{
+    gw_request_t *oldest = NULL;
+    for (unsigned i = 0; i < MAX_REQUESTS; i++) {
+        gw_request_t *req = &requests[i];
+        if (req->subscribe || req->backlog) continue;
+        if (!request_accepts(req, addr)) continue;
+        if (req->state != REQ_SCANNING && req->state != REQ_CONNECT_PENDING) continue;
+        if (!oldest || req->id < oldest->id) oldest = req;
+    }
+    return oldest;
+}
+
+/*
+* returns: a one-shot read that holds or is opening a link, or NULL. Every
+* node serves both readings, so waiting reads can take that link over.
+*/
+gw_request_t *request_find_linked(void)
+{
+    for (unsigned i = 0; i < MAX_REQUESTS; i++) {
+        gw_request_t *req = &requests[i];
+        if (req->subscribe || req->backlog) continue;
+        if (req->state == REQ_CONNECTING || req->state == REQ_DISCOVERING ||
+            req->state == REQ_READING) {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+const char *request_state_str(request_state_t state)
+{
+    switch (state) {
+        case REQ_FREE:            return "free";
+        case REQ_STARTING:        return "starting";
+        case REQ_SCANNING:        return "scanning";
+        case REQ_CONNECT_PENDING: return "connect-pending";
+        case REQ_CONNECTING:      return "connecting";
+        case REQ_DISCOVERING:     return "discovering";
+        case REQ_READING:         return "reading";
+        case REQ_SUBSCRIBING:     return "subscribing";
+        case REQ_DRAINING:        return "draining";
+    }
+    return "unknown";
+}
+
+// Runs on the host thread, the table only changes there
+static void requests_print(void *arg)
+{
+    (void)arg;
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < MAX_REQUESTS; i++) {
+        gw_request_t *req = &requests[i];
+        if (req->state == REQ_FREE) continue;
+        printf("%s  %s  %s  handle: %d  age: %lu ms\n",
+               req->response->request_id, req->type_name,
+               request_state_str(req->state), req->conn_handle,
+               (unsigned long)(now - req->start_time));
+        count++;
+    }
+    printf("%u/%u requests in flight\n", count, (unsigned)MAX_REQUESTS);
+}
+
+/**Shell command */
+int cmd_requests(int argc, char **argv)
+{
+    (void)argc; (void)argv;
+    ble_host_call(requests_print, NULL);
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "application.h"
+#include "ztimer.h"
+#include "sema.h"
+#include "host/ble_hs.h"
+#include "nimble/nimble_npl.h"
+#include "timing.h"
+
+// Queries in flight at once, one connection each
+#define MAX_REQUESTS MYNEWT_VAL(BLE_MAX_CONNECTIONS)
+
+// Deadline of each request phase
+#define SCAN_TIMEOUT_MS       2000
+#define CONNECT_TIMEOUT_MS    2500
+#define DISCOVERY_TIMEOUT_MS  2000
+#define READ_TIMEOUT_MS       1000
+// Each ATT exchange of a backlog download: MTU, ack or one blob of the batch
+#define DRAIN_TIMEOUT_MS      1000
+
+// Life cycle of a query
+typedef enum request_state_t {
+    REQ_FREE = 0,
+    REQ_STARTING,           // Allocated, query not dispatched yet
+    REQ_SCANNING,           // Waiting for an advertisement of the sensor type
+    REQ_CONNECT_PENDING,    // Sensor found, waiting for the connect slot
+    REQ_CONNECTING,         // ble_gap_connect() in progress
+    REQ_DISCOVERING,        // Looking up the ESS service and characteristic
+    REQ_READING,            // ATT read in progress
+    REQ_SUBSCRIBING,        // Enabling notifications through the CCCD
+    REQ_DRAINING,           // Downloading the sample history
+} request_state_t;
+
+// Caller blocked on a request in ble_query_wait()
+typedef struct query_waiter_t {
+    sema_t done;                   // Posted once the response is copied
+    sensor_response_t *response;   // Destination of the response
+} query_waiter_t;
+
+// State of one query, looked up by request ID or connection handle
+typedef struct gw_request_t {
+    request_state_t state;
+    uint32_t id;                   // Request number, also in request_id
+    uint16_t sensor_uuid;          // Characteristic UUID of the sensor type
+    const char *type_name;         // "TEMP" or "HUM"
+    uint16_t conn_handle;          // BLE_HS_CONN_HANDLE_NONE until connected
+    ble_addr_t addr;               // Sensor address, once known
+    bool ess_found;                // ESS service seen during discovery
+    bool cached_read;              // Read issued with handles from the cache
+    bool timed_out;                // Connect cancelled by its deadline
+    bool broadcast_ok;             // Reading may come from an advertisement
+    bool targeted;                 // Only the node at addr may answer
+    bool subscribe;                // Stream notifications instead of one read
+    bool backlog;                  // Download the sample history instead of one read
+    uint8_t conn_profile;          // conn_profile_id_t of the link used for the query
+    uint16_t val_handle;           // Characteristic value handle, once known
+    uint16_t end_handle;           // Last handle of that characteristic, for its descriptors
+    uint32_t start_time;           // Query start, for discovery latency
+    uint32_t connect_time;         // Connection complete, for read latency
+    sensor_response_t *response;   // Result from the response pool, owned until request_free
+    query_waiter_t *waiter;        // Caller waiting for the response, NULL if none
+    ztimer_t deadline;             // Deadline of the current phase
+    struct ble_npl_event timeout_ev; // Runs the timeout in the NimBLE host
+#if TIMING_ENABLE
+    timing_rec_t timing;           // Pipeline timestamps, kept by request_free
+#endif
+} gw_request_t;
+
+gw_request_t *request_alloc(uint16_t sensor_uuid);
+void request_free(gw_request_t *req);
+void request_set_state(gw_request_t *req, request_state_t state);
+void request_mark_phase(gw_request_t *req, query_phase_t phase);
+int request_next_id(void);
+gw_request_t *request_find_by_id(uint32_t id);
+gw_request_t *request_find_by_conn(uint16_t conn_handle);
+gw_request_t *request_find_by_addr(const ble_addr_t *addr);
+gw_request_t *request_find_state(request_state_t state, uint16_t sensor_uuid);
+gw_request_t *request_find_scanning(uint16_t sensor_uuid, const ble_addr_t *addr);
+gw_request_t *request_find_waiting(const ble_addr_t *addr);
+gw_request_t *request_find_linked(void);
+const char *request_state_str(request_state_t state);
+
+int cmd_requests(int argc, char **argv);
+
+#endif /* REQUEST_H */
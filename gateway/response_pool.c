@@ -0,0 +1,53 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "irq.h"
+#include "response_pool.h"
+
+// Free records are chained through their own storage
+typedef union response_slot_t {
+    sensor_response_t response;
+    union response_slot_t *next;
+} response_slot_t;
+
+static response_slot_t slots[RESPONSE_POOL_SIZE];
+static response_slot_t *free_list;
+
+void response_pool_init(void)
+{
+    free_list = NULL;
+    for (unsigned i = RESPONSE_POOL_SIZE; i > 0; i--) {
+        slots[i - 1].next = free_list;
+        free_list = &slots[i - 1];
+    }
+}
+
+/*
+* Take a zeroed response record from the pool. The caller owns it until
+* response_release().
+* returns: the record, or NULL if the pool is exhausted.
+*/
+sensor_response_t *response_acquire(void)
+{
+    unsigned state = irq_disable();
+    response_slot_t *slot = free_list;
+    if (slot) {
+        free_list = slot->next;
+    }
+    irq_restore(state);
+
+    if (!slot) return NULL;
+    memset(&slot->response, 0, sizeof(slot->response));
+    return &slot->response;
+}
+
+void response_release(sensor_response_t *response)
+{
+    if (!response) return;
+
+    response_slot_t *slot = (response_slot_t *)response;
+    unsigned state = irq_disable();
+    slot->next = free_list;
+    free_list = slot;
+    irq_restore(state);
+}
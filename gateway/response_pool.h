@@ -0,0 +1,14 @@
+#ifndef RESPONSE_POOL_H
+#define RESPONSE_POOL_H
+
+#include "application.h"
+#include "request.h"
+
+// One response record per request slot, so a free slot always finds one
+#define RESPONSE_POOL_SIZE MAX_REQUESTS
+
+void response_pool_init(void);
+sensor_response_t *response_acquire(void);
+void response_release(sensor_response_t *response);
+
+#endif /* RESPONSE_POOL_H */
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ztimer.h"
+#include "nimble_scanner.h"
+#include "nimble/nimble_port.h"
+#include "ble_handler.h"
+#include "presence.h"
+#include "request.h"
+#include "scan_sched.h"
+
+bool scan_sched_enabled = true;
+
+/*
+* Scanning for a query: continuously, or in a short window placed on the
+* predicted advertisement of a node whose timing is known.
+*/
+typedef enum sched_state_t {
+    SCHED_IDLE = 0,
+    SCHED_CONTINUOUS,       // Full duty cycle until the query finds a sensor
+    SCHED_WAITING,          // Scanner off until the window opens
+    SCHED_OPEN,             // Scanning in the window
+} sched_state_t;
+
+static const char *const sched_state_names[] = {
+    "idle", "continuous", "waiting", "window",
+};
+
+static scan_node_t nodes[SCAN_SCHED_MAX_NODES];
+
+static struct {
+    sched_state_t state;
+    uint16_t sensor_uuid;          // Sensor type of the query scanned for
+    scan_node_t *target;           // Node the window is placed on
+    uint32_t target_seen_ms;       // Its last advertisement when the window opened
+    uint32_t close_ms;             // End of the window
+    uint32_t scan_start_ms;        // Scanner turned on for the query
+    struct ble_npl_callout timer;
+} sched;
+
+static struct {
+    uint32_t windows;              // Windows opened
+    uint32_t hits;                 // Windows that heard their node
+    uint32_t misses;
+    uint32_t continuous;           // Query scans without a usable prediction
+    uint32_t window_ms;            // Scanner time spent in windows
+    uint32_t continuous_ms;        // Scanner time spent scanning continuously
+} stats;
+
+static uint8_t sensor_bit(uint16_t sensor_uuid)
+{
+    for (uint8_t i = 0; i < sensor_filter.num_uuids; i++) {
+        if (sensor_filter.uuids[i] == sensor_uuid) return 1 << i;
+    }
+    return 0;
+}
+
+// Node of an address, the one heard least recently is replaced if new
+static scan_node_t *node_get(const ble_addr_t *addr)
+{
+    scan_node_t *lru = &nodes[0];
+    for (unsigned i = 0; i < SCAN_SCHED_MAX_NODES; i++) {
+        scan_node_t *n = &nodes[i];
+        if (n->in_use && ble_addr_cmp(&n->addr, addr) == 0) return n;
+        if (!n->in_use) {
+            lru = n;
+        } else if (lru->in_use && n->last_seen_ms < lru->last_seen_ms) {
+            lru = n;
+        }
+    }
+    if (lru == sched.target) {
+        sched.target = NULL;
+    }
+    memset(lru, 0, sizeof(*lru));
+    lru->addr = *addr;
+    return lru;
+}
+
+/*
+* Learn from an advertisement of one of our sensors. The gap to the last
+* one heard is a whole number of advertising intervals, as events are
+* missed while the scanner is off; the period estimate follows gap / k.
+*/
+void scan_sched_observe(const ble_addr_t *addr, uint8_t sensors)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    scan_node_t *n = node_get(addr);
+
+    if (n->in_use) {
+        uint32_t gap = now - n->last_seen_ms;
+        if (gap < SCAN_SCHED_MIN_PERIOD_MS) return;
+
+        uint32_t k = n->period_ms ? (gap + n->period_ms / 2) / n->period_ms : 0;
+        if (n->period_ms == 0 || k == 0) {
+            // First interval, or a shorter one: the old estimate spanned missed events
+            n->period_ms = gap;
+            n->samples = 1;
+        } else if (k <= 8) {
+            int32_t err = (int32_t)(gap / k) - (int32_t)n->period_ms;
+            n->period_ms += err / 4;
+            if (n->samples < UINT8_MAX) n->samples++;
+        }
+    }
+    n->in_use = true;
+    n->sensors = sensors;
+    n->last_seen_ms = now;
+    n->misses = 0;
+
+    if (sched.state == SCHED_OPEN && n == sched.target) {
+        stats.hits++;
+    }
+}
+
+/*
+* Pick the node of a sensor type whose next advertisement can be caught
+* first with a short window.
+* returns: the node, NULL if none is predictable enough.
+*/
+static scan_node_t *plan(uint16_t sensor_uuid, uint32_t now,
+                         uint32_t *open_ms, uint32_t *close_ms)
+{
+    uint8_t bit = sensor_bit(sensor_uuid);
+    scan_node_t *best = NULL;
+
+    for (unsigned i = 0; i < SCAN_SCHED_MAX_NODES; i++) {
+        scan_node_t *n = &nodes[i];
+        if (!n->in_use || !(n->sensors & bit) || n->period_ms == 0) continue;
+        if (n->samples < SCAN_SCHED_MIN_SAMPLES || n->misses >= SCAN_SCHED_MAX_MISSES) continue;
+
+        // Next event after now, and how far the phase may have drifted by then
+        uint32_t events = (now - n->last_seen_ms) / n->period_ms + 1;
+        uint32_t expected = n->last_seen_ms + events * n->period_ms;
+        uint32_t half = SCAN_SCHED_GUARD_MS + events * SCAN_SCHED_DRIFT_MS;
+        if (2 * half >= n->period_ms) continue;
+
+        uint32_t open = expected - half;
+        if ((int32_t)(open - now) < 0) open = now;
+        uint32_t close = expected + half;
+        if (close - now > SCAN_SCHED_MAX_WAIT_MS) continue;
+
+        if (!best || (int32_t)(close - *close_ms) < 0) {
+            best = n;
+            *open_ms = open;
+            *close_ms = close;
+        }
+    }
+    return best;
+}
+
+// Charge the scanner time of the query scan that ends now
+static void scan_account(void)
+{
+    uint32_t on = ztimer_now(ZTIMER_MSEC) - sched.scan_start_ms;
+    if (sched.state == SCHED_OPEN) {
+        stats.window_ms += on;
+    } else if (sched.state == SCHED_CONTINUOUS) {
+        stats.continuous_ms += on;
+    }
+}
+
+static int scan_continuous(uint16_t sensor_uuid)
+{
+    if (sched.state != SCHED_CONTINUOUS || sched.sensor_uuid != sensor_uuid) {
+        scan_sched_cancel();
+        stats.continuous++;
+        sched.state = SCHED_CONTINUOUS;
+        sched.sensor_uuid = sensor_uuid;
+        sched.scan_start_ms = ztimer_now(ZTIMER_MSEC);
+    }
+    return presence_scan_active();
+}
+
+static void window_open(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+
+    sched.state = SCHED_OPEN;
+    sched.scan_start_ms = now;
+    sched.target_seen_ms = sched.target->last_seen_ms;
+    stats.windows++;
+    ble_npl_callout_reset(&sched.timer, ble_npl_time_ms_to_ticks32(sched.close_ms - now));
+
+    int rc = presence_scan_active();
+    if (rc != 0) {
+        printf("[ERROR] Failed to open scan window, rc: %d\n", rc);
+    }
+}
+
+static void window_close(void)
+{
+    scan_node_t *n = sched.target;
+
+    // A node heard in its window is busy or taken; anything else is a miss
+    if (n && n->last_seen_ms == sched.target_seen_ms) {
+        n->misses++;
+        stats.misses++;
+        if (DEBUG) {
+            printf("[DEBUG] Scan window missed, %u in a row\n", n->misses);
+        }
+    }
+    scan_account();
+    sched.state = SCHED_IDLE;
+    sched.target = NULL;
+
+    // Next window, or continuous scanning once the node keeps missing
+    ble_scan_update();
+}
+
+static void timer_cb(struct ble_npl_event *ev)
+{
+    (void)ev;
+
+    if (sched.state == SCHED_WAITING) {
+        if (!sched.target) {
+            sched.state = SCHED_IDLE;
+            ble_scan_update();
+            return;
+        }
+        window_open();
+    } else if (sched.state == SCHED_OPEN) {
+        window_close();
+    }
+}
+
+void scan_sched_init(void)
+{
+    memset(nodes, 0, sizeof(nodes));
+    ble_npl_callout_init(&sched.timer, nimble_port_get_dflt_eventq(), timer_cb, NULL);
+}
+
+/*
+*Scan for a query of a sensor type: wait for the predicted advertisement
+*of a known node with the scanner off, or scan continuously if no node is
+*predictable.
+*returns: rc of the scanner, 0 on success.
+*/
+int scan_sched_query(uint16_t sensor_uuid)
+{
+    if (!scan_sched_enabled) {
+        return scan_continuous(sensor_uuid);
+    }
+    // Window already planned for this query
+    if ((sched.state == SCHED_WAITING || sched.state == SCHED_OPEN) &&
+        sched.sensor_uuid == sensor_uuid) {
+        return 0;
+    }
+
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    uint32_t open_ms, close_ms;
+    scan_node_t *n = plan(sensor_uuid, now, &open_ms, &close_ms);
+    if (!n) {
+        return scan_continuous(sensor_uuid);
+    }
+
+    scan_sched_cancel();
+    sched.sensor_uuid = sensor_uuid;
+    sched.target = n;
+    sched.close_ms = close_ms;
+    if (open_ms == now) {
+        window_open();
+        return 0;
+    }
+
+    nimble_scanner_stop();
+    sched.state = SCHED_WAITING;
+    ble_npl_callout_reset(&sched.timer, ble_npl_time_ms_to_ticks32(open_ms - now));
+    if (DEBUG) {
+        printf("[DEBUG] Scan window in %lu ms for %lu ms, period %lu ms\n",
+               (unsigned long)(open_ms - now), (unsigned long)(close_ms - open_ms),
+               (unsigned long)n->period_ms);
+    }
+    return 0;
+}
+
+/*
+*Stop scanning for a query, e.g. once it found its sensor. The scanner
+*itself is left to the caller.
+*/
+void scan_sched_cancel(void)
+{
+    ble_npl_callout_stop(&sched.timer);
+    scan_account();
+    sched.state = SCHED_IDLE;
+    sched.target = NULL;
+}
+
+static void scan_print(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    unsigned count = 0;
+
+    printf("Adaptive scan: %s, %s\n", scan_sched_enabled ? "on" : "off",
+           sched_state_names[sched.state]);
+    printf("Windows: %lu  hit: %lu  missed: %lu  continuous scans: %lu\n",
+           (unsigned long)stats.windows, (unsigned long)stats.hits,
+           (unsigned long)stats.misses, (unsigned long)stats.continuous);
+    printf("Scanner time: %lu ms in windows, %lu ms continuous\n",
+           (unsigned long)stats.window_ms, (unsigned long)stats.continuous_ms);
+
+    for (unsigned i = 0; i < SCAN_SCHED_MAX_NODES; i++) {
+        scan_node_t *n = &nodes[i];
+        if (!n->in_use) continue;
+        printf("[%u] %02x:%02x:%02x:%02x:%02x:%02x  period: %lu ms (%u)  misses: %u"
+               "  seen %lu ms ago\n", i,
+               n->addr.val[5], n->addr.val[4], n->addr.val[3],
+               n->addr.val[2], n->addr.val[1], n->addr.val[0],
+               (unsigned long)n->period_ms, n->samples, n->misses,
+               (unsigned long)(now - n->last_seen_ms));
+        count++;
+    }
+    if (count == 0) {
+        printf("No advertising timing learned yet\n");
+    }
+}
+
+static void scan_clear(void)
+{
+    scan_sched_cancel();
+    memset(nodes, 0, sizeof(nodes));
+    memset(&stats, 0, sizeof(stats));
+    ble_scan_update();
+}
+
+static int scan_cmd(int argc, char **argv)
+{
+    if (argc > 1) {
+        if (strcmp(argv[1], "on") == 0) {
+            scan_sched_enabled = true;
+        } else if (strcmp(argv[1], "off") == 0) {
+            scan_sched_enabled = false;
+        } else if (strcmp(argv[1], "clear") == 0) {
+            scan_clear();
+        } else {
+            printf("usage: %s [on|off|clear]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    scan_print();
+    return 0;
+}
+
+/**Shell command */
+int cmd_scan(int argc, char **argv)
+{
+    // Scan windows are placed by the host
+    return ble_host_cmd(scan_cmd, argc, argv);
+}
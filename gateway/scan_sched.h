@@ -0,0 +1,46 @@
+#ifndef SCAN_SCHED_H
+#define SCAN_SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host/ble_hs.h"
+
+// Advertisers whose timing is learned
+#define SCAN_SCHED_MAX_NODES      8
+
+// Reports closer than this belong to the same advertising event
+#define SCAN_SCHED_MIN_PERIOD_MS  20
+// Intervals seen before the learned period is trusted
+#define SCAN_SCHED_MIN_SAMPLES    3
+// Scan before and after the predicted advertisement, covers the 0-10 ms
+// advDelay the advertiser adds to every event
+#define SCAN_SCHED_GUARD_MS       15
+// Extra window per advertising event since the last one heard, the
+// random advDelay makes the phase drift
+#define SCAN_SCHED_DRIFT_MS       2
+// A window must open this soon, or the query scans continuously
+#define SCAN_SCHED_MAX_WAIT_MS    (SCAN_TIMEOUT_MS / 2)
+// Windows missed in a row before a node is scanned for continuously
+#define SCAN_SCHED_MAX_MISSES     2
+
+// Learned advertising timing of one sensor node
+typedef struct scan_node_t {
+    bool in_use;
+    ble_addr_t addr;
+    uint8_t sensors;               // sensor_filter match bits of its advertisements
+    uint32_t last_seen_ms;         // Phase: time of the last advertisement heard
+    uint32_t period_ms;            // Advertising interval, 0 until measured
+    uint8_t samples;               // Intervals measured, saturating
+    uint8_t misses;                // Windows missed in a row
+} scan_node_t;
+
+extern bool scan_sched_enabled;
+
+void scan_sched_init(void);
+void scan_sched_observe(const ble_addr_t *addr, uint8_t sensors);
+int scan_sched_query(uint16_t sensor_uuid);
+void scan_sched_cancel(void);
+
+int cmd_scan(int argc, char **argv);
+
+#endif /* SCAN_SCHED_H */
@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mutex.h"
+#include "ztimer.h"
+#include "gateway.h"
+#include "series.h"
+#include "registry.h"
+#include "ble_handler.h"
+
+#define SERIES_SENSORS 2
+
+// Aggregate of the readings that arrived within one bucket
+typedef struct series_bucket_t {
+    uint32_t slot;                 // time_ms / SERIES_BUCKET_MS of the readings
+    uint32_t count;
+    int32_t sum;
+    int16_t min;
+    int16_t max;
+} series_bucket_t;
+
+/*
+* Readings of one sensor of a node: a ring of the last SERIES_SIZE samples
+* for the history, and a ring of per-bucket aggregates updated on insert, so
+* a stats query combines at most SERIES_BUCKETS buckets however many
+* readings they hold.
+*/
+typedef struct series_t {
+    series_sample_t ring[SERIES_SIZE];
+    uint32_t next;                 // Readings added so far
+    series_bucket_t buckets[SERIES_BUCKETS];
+} series_t;
+
+// Series of one node, keyed by address so they outlive a registry clear
+typedef struct series_node_t {
+    bool in_use;
+    ble_addr_t addr;
+    uint32_t last_ms;              // Time of the newest reading
+    series_t series[SERIES_SENSORS];
+} series_node_t;
+
+static series_node_t nodes[SERIES_NODES];
+static mutex_t series_lock = MUTEX_INIT;
+
+static const char *const series_names[SERIES_SENSORS] = { "temp", "hum" };
+static const char *const series_units[SERIES_SENSORS] = { "C", "%" };
+
+// Series of a node, NULL if it has none. Called with series_lock held.
+static series_node_t *node_find(const ble_addr_t *addr)
+{
+    for (unsigned i = 0; i < SERIES_NODES; i++) {
+        if (nodes[i].in_use && ble_addr_cmp(&nodes[i].addr, addr) == 0) {
+            return &nodes[i];
+        }
+    }
+    return NULL;
+}
+
+// Series of a node, recycling the one heard from longest ago for a new node
+static series_node_t *node_get(const ble_addr_t *addr)
+{
+    series_node_t *n = node_find(addr);
+    if (n) return n;
+
+    series_node_t *oldest = &nodes[0];
+    for (unsigned i = 0; i < SERIES_NODES; i++) {
+        if (!nodes[i].in_use) {
+            oldest = &nodes[i];
+            break;
+        }
+        if ((int32_t)(nodes[i].last_ms - oldest->last_ms) < 0) oldest = &nodes[i];
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->in_use = true;
+    oldest->addr = *addr;
+    return oldest;
+}
+
+/*
+*Record a reading of a node's sensor, value in its unit.
+*/
+void series_add(const ble_addr_t *addr, int sensor_type, uint32_t time_ms, double value)
+{
+    if (sensor_type < 0 || sensor_type >= SERIES_SENSORS) return;
+
+    int16_t v = (int16_t)(value * 100.0 + (value < 0 ? -0.5 : 0.5));
+    uint32_t slot = time_ms / SERIES_BUCKET_MS;
+
+    mutex_lock(&series_lock);
+    series_node_t *n = node_get(addr);
+    n->last_ms = time_ms;
+    series_t *s = &n->series[sensor_type];
+    s->ring[s->next++ % SERIES_SIZE] = (series_sample_t){ .time_ms = time_ms, .value = v };
+
+    // A bucket left over from an older slot starts again
+    series_bucket_t *b = &s->buckets[slot % SERIES_BUCKETS];
+    if (b->slot != slot || b->count == 0) {
+        *b = (series_bucket_t){ .slot = slot, .min = v, .max = v };
+    }
+    b->count++;
+    b->sum += v;
+    if (v < b->min) b->min = v;
+    if (v > b->max) b->max = v;
+    mutex_unlock(&series_lock);
+}
+
+/*
+*Record a published response if it carries a temperature or humidity
+*reading.
+*/
+void series_add_response(const sensor_response_t *response)
+{
+    if (!response->success) return;
+
+    if (strcmp(response->unit, "Celsius") == 0) {
+        series_add(&response->addr, SENSOR_TEMP, ztimer_now(ZTIMER_MSEC), response->value);
+    } else if (strcmp(response->unit, "Percent") == 0) {
+        series_add(&response->addr, SENSOR_HUM, ztimer_now(ZTIMER_MSEC), response->value);
+    }
+}
+
+static void stats_add(series_stats_t *stats, int64_t *sum, uint32_t count, int32_t total,
+                      int16_t min, int16_t max)
+{
+    if (stats->count == 0 || min < stats->min) stats->min = min;
+    if (stats->count == 0 || max > stats->max) stats->max = max;
+    stats->count += count;
+    *sum += total;
+}
+
+/*
+*Aggregate the readings of a node's sensor over the last window_ms, capped
+*at SERIES_MAX_WINDOW_MS. Whole buckets cover the window, the part of the
+*oldest bucket inside it comes from the samples. Once the samples no longer
+*reach back that far the whole oldest bucket is taken, stats->span_ms tells
+*the time actually aggregated.
+*returns: true if the window holds any reading.
+*/
+bool series_stats(const ble_addr_t *addr, int sensor_type, uint32_t window_ms,
+                  series_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (sensor_type < 0 || sensor_type >= SERIES_SENSORS) return false;
+    if (window_ms > SERIES_MAX_WINDOW_MS) window_ms = SERIES_MAX_WINDOW_MS;
+
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    uint32_t start = now > window_ms ? now - window_ms : 0;
+    uint32_t now_slot = now / SERIES_BUCKET_MS;
+    // First bucket entirely inside the window, the current one always is
+    uint32_t first = (start + SERIES_BUCKET_MS - 1) / SERIES_BUCKET_MS;
+    if (first + SERIES_BUCKETS <= now_slot) first = now_slot - SERIES_BUCKETS + 1;
+    uint32_t edge = first * SERIES_BUCKET_MS;
+
+    int64_t sum = 0;
+    mutex_lock(&series_lock);
+    series_node_t *n = node_find(addr);
+    if (!n) {
+        mutex_unlock(&series_lock);
+        return false;
+    }
+    const series_t *s = &n->series[sensor_type];
+
+    for (uint32_t slot = first; slot <= now_slot; slot++) {
+        const series_bucket_t *b = &s->buckets[slot % SERIES_BUCKETS];
+        if (b->slot != slot || b->count == 0) continue;
+        stats_add(stats, &sum, b->count, b->sum, b->min, b->max);
+    }
+    stats->span_ms = now - edge;
+
+    if (start < edge) {
+        // The samples hold every reading since the oldest one kept
+        const series_sample_t *oldest = &s->ring[s->next % SERIES_SIZE];
+        if (s->next <= SERIES_SIZE || oldest->time_ms <= start) {
+            uint32_t held = s->next < SERIES_SIZE ? s->next : SERIES_SIZE;
+            for (uint32_t i = s->next - held; i != s->next; i++) {
+                const series_sample_t *r = &s->ring[i % SERIES_SIZE];
+                if (r->time_ms < start || r->time_ms >= edge) continue;
+                stats_add(stats, &sum, 1, r->value, r->value, r->value);
+            }
+            stats->span_ms = now - start;
+        } else if (first - 1 + SERIES_BUCKETS > now_slot) {
+            const series_bucket_t *b = &s->buckets[(first - 1) % SERIES_BUCKETS];
+            if (b->slot == first - 1 && b->count > 0) {
+                stats_add(stats, &sum, b->count, b->sum, b->min, b->max);
+            }
+            stats->span_ms = now - (edge - SERIES_BUCKET_MS);
+        }
+    }
+    mutex_unlock(&series_lock);
+
+    if (stats->count == 0) return false;
+    stats->mean = (double)sum / stats->count / 100.0;
+    return true;
+}
+
+/*
+*Copy the newest readings of a node's sensor, oldest first.
+*returns: number of readings copied.
+*/
+unsigned series_read(const ble_addr_t *addr, int sensor_type, series_sample_t *out,
+                     unsigned max)
+{
+    if (sensor_type < 0 || sensor_type >= SERIES_SENSORS) return 0;
+
+    mutex_lock(&series_lock);
+    series_node_t *n = node_find(addr);
+    if (!n) {
+        mutex_unlock(&series_lock);
+        return 0;
+    }
+    const series_t *s = &n->series[sensor_type];
+    uint32_t held = s->next < SERIES_SIZE ? s->next : SERIES_SIZE;
+    unsigned count = held < max ? held : max;
+    for (unsigned i = 0; i < count; i++) {
+        out[i] = s->ring[(s->next - count + i) % SERIES_SIZE];
+    }
+    mutex_unlock(&series_lock);
+    return count;
+}
+
+void series_clear(void)
+{
+    mutex_lock(&series_lock);
+    memset(nodes, 0, sizeof(nodes));
+    mutex_unlock(&series_lock);
+}
+
+static int parse_sensor(const char *arg)
+{
+    for (int i = 0; i < SERIES_SENSORS; i++) {
+        if (strcmp(arg, series_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Window in seconds, or with an m or h suffix
+static uint32_t parse_window(const char *arg)
+{
+    char *end;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (*end == 'h') return n * 3600 * MS_PER_SEC;
+    if (*end == 'm') return n * 60 * MS_PER_SEC;
+    return n * MS_PER_SEC;
+}
+
+// Addresses of the nodes with a series
+static unsigned series_nodes(ble_addr_t *out)
+{
+    unsigned count = 0;
+    mutex_lock(&series_lock);
+    for (unsigned i = 0; i < SERIES_NODES; i++) {
+        if (nodes[i].in_use) out[count++] = nodes[i].addr;
+    }
+    mutex_unlock(&series_lock);
+    return count;
+}
+
+/*
+*Arguments of history and stats after the sensor type: a node from `nodes`,
+*and a count or a window, told apart by the leading digit.
+*returns: 0 on success, -1 if the node is unknown.
+*/
+static int series_args(int argc, char **argv, int first, ble_addr_t *addr,
+                       bool *has_node, const char **number)
+{
+    *has_node = false;
+    *number = NULL;
+    for (int i = first; i < argc; i++) {
+        if (argv[i][0] >= '0' && argv[i][0] <= '9' && !strchr(argv[i], ':')) {
+            *number = argv[i];
+            continue;
+        }
+        registry_node_t *node = registry_resolve(argv[i]);
+        if (!node) {
+            printf("[ERR] Unknown node %s, see nodes\n", argv[i]);
+            return -1;
+        }
+        *addr = node->addr;
+        *has_node = true;
+    }
+    return 0;
+}
+
+static int history_cmd(int argc, char **argv)
+{
+    static series_sample_t samples[SERIES_SIZE];
+    ble_addr_t addrs[SERIES_NODES];
+
+    if (argc > 1 && strcmp(argv[1], "clear") == 0) {
+        series_clear();
+        return 0;
+    }
+    int first = 0, last = SERIES_SENSORS - 1;
+    int arg = 1;
+    if (argc > 1 && parse_sensor(argv[1]) >= 0) {
+        first = last = parse_sensor(argv[1]);
+        arg = 2;
+    }
+    bool has_node;
+    const char *number;
+    if (series_args(argc, argv, arg, &addrs[0], &has_node, &number) != 0) {
+        printf("usage: %s [temp|hum|clear] [node] [n]\n", argv[0]);
+        return 1;
+    }
+    unsigned count_nodes = has_node ? 1 : series_nodes(addrs);
+    unsigned max = number ? (unsigned)atoi(number) : 10;
+    if (max > SERIES_SIZE) max = SERIES_SIZE;
+
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    for (unsigned n = 0; n < count_nodes; n++) {
+        for (int t = first; t <= last; t++) {
+            unsigned count = series_read(&addrs[n], t, samples, max);
+            printf("%s %s: %u readings\n", registry_addr_name(&addrs[n]),
+                   series_names[t], count);
+            for (unsigned i = 0; i < count; i++) {
+                printf("  %lu ms ago  %.2f %s\n", (unsigned long)(now - samples[i].time_ms),
+                       samples[i].value / 100.0, series_units[t]);
+            }
+        }
+    }
+    if (count_nodes == 0) {
+        printf("No readings kept yet\n");
+    }
+    return 0;
+}
+
+/**Shell command */
+int cmd_history(int argc, char **argv)
+{
+    // Nodes are named next to registry_observe
+    return ble_host_cmd(history_cmd, argc, argv);
+}
+
+static int stats_cmd(int argc, char **argv)
+{
+    ble_addr_t addrs[SERIES_NODES];
+    int t = argc > 1 ? parse_sensor(argv[1]) : -1;
+    bool has_node;
+    const char *number;
+    if (t < 0 || series_args(argc, argv, 2, &addrs[0], &has_node, &number) != 0) {
+        printf("usage: %s <temp|hum> [node] [window, e.g. 90, 10m, 1h]\n", argv[0]);
+        return 1;
+    }
+    uint32_t window_ms = number ? parse_window(number) : SERIES_MAX_WINDOW_MS;
+    if (window_ms > SERIES_MAX_WINDOW_MS) {
+        printf("[WARN] Window capped at %lu s\n",
+               (unsigned long)(SERIES_MAX_WINDOW_MS / MS_PER_SEC));
+        window_ms = SERIES_MAX_WINDOW_MS;
+    }
+
+    unsigned count_nodes = has_node ? 1 : series_nodes(addrs);
+    for (unsigned n = 0; n < count_nodes; n++) {
+        const char *name = registry_addr_name(&addrs[n]);
+        series_stats_t st;
+        if (!series_stats(&addrs[n], t, window_ms, &st)) {
+            printf("%s: no %s readings in the last %lu s\n", name, series_names[t],
+                   (unsigned long)(window_ms / MS_PER_SEC));
+            continue;
+        }
+        // The span differs from the window where whole buckets were taken
+        printf("%s %s over %lu s: count %lu  min %.2f  max %.2f  mean %.2f %s\n",
+               name, series_names[t], (unsigned long)(st.span_ms / MS_PER_SEC),
+               (unsigned long)st.count, st.min / 100.0, st.max / 100.0, st.mean,
+               series_units[t]);
+    }
+    if (count_nodes == 0) {
+        printf("No %s readings kept yet\n", series_names[t]);
+    }
+    return 0;
+}
+
+/**Shell command */
+int cmd_stats(int argc, char **argv)
+{
+    // Nodes are named next to registry_observe
+    return ble_host_cmd(stats_cmd, argc, argv);
+}
@@ -0,0 +1,57 @@
+#ifndef SERIES_H
+#define SERIES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "application.h"
+#include "host/ble_hs.h"
+
+// Nodes with a series, the one heard from longest ago is recycled
+#ifndef SERIES_NODES
+#define SERIES_NODES       4
+#endif
+
+// Readings kept per node and sensor for the history command and the
+// oldest edge of a stats window
+#ifndef SERIES_SIZE
+#define SERIES_SIZE        32
+#endif
+
+// Aggregates are kept per time bucket and reach back SERIES_BUCKETS
+// buckets at most
+#ifndef SERIES_BUCKET_MS
+#define SERIES_BUCKET_MS   60000
+#endif
+#ifndef SERIES_BUCKETS
+#define SERIES_BUCKETS     60
+#endif
+
+#define SERIES_MAX_WINDOW_MS ((uint32_t)SERIES_BUCKET_MS * SERIES_BUCKETS)
+
+// One stored reading, 6 bytes
+typedef struct __attribute__((packed)) series_sample_t {
+    uint32_t time_ms;              // Gateway time the reading arrived
+    int16_t value;                 // Reading x100
+} series_sample_t;
+
+// Aggregate of the readings over a window
+typedef struct series_stats_t {
+    uint32_t count;
+    int16_t min;                   // x100
+    int16_t max;
+    double mean;
+    uint32_t span_ms;              // Time aggregated, up to now
+} series_stats_t;
+
+void series_add(const ble_addr_t *addr, int sensor_type, uint32_t time_ms, double value);
+void series_add_response(const sensor_response_t *response);
+bool series_stats(const ble_addr_t *addr, int sensor_type, uint32_t window_ms,
+                  series_stats_t *stats);
+unsigned series_read(const ble_addr_t *addr, int sensor_type, series_sample_t *out,
+                     unsigned max);
+void series_clear(void);
+
+int cmd_history(int argc, char **argv);
+int cmd_stats(int argc, char **argv);
+
+#endif /* SERIES_H */
@@ -0,0 +1,1015 @@
+/*
+* Mock of the NimBLE host and scanner API used by the gateway, for SIM=1
+* builds on the native board. Virtual sensors advertise, accept connections
+* and answer ATT requests with configurable timing and loss, so latency
+* changes can be measured without radios. Everything runs as events on the
+* default event queue, like the callbacks of the real host.
+*/
+#include "sim_ble.h"
+
+#if GATEWAY_SIM
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mutex.h"
+#include "thread.h"
+#include "ztimer.h"
+#include "nimble_scanner.h"
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_npl.h"
+#include "os/os_mbuf.h"
+#include "os/os_mempool.h"
+#include "host/ble_gap.h"
+#include "host/ble_gatt.h"
+#include "host/ble_hs_adv.h"
+#include "ble_handler.h"
+#include "backlog.h"
+#include "env_wire.h"
+
+// GATT database of a virtual sensor, same layout for every sensor
+#define SIM_SVC_START     1
+#define SIM_TEMP_DEF      2
+#define SIM_TEMP_VAL      3
+#define SIM_TEMP_CCCD     4
+#define SIM_HUM_DEF       5
+#define SIM_HUM_VAL       6
+#define SIM_HUM_CCCD      7
+#define SIM_BACKLOG_DEF   8
+#define SIM_BACKLOG_VAL   9
+#define SIM_SVC_END       9
+
+#define SIM_FIRST_CONN    1
+#define SIM_MBUF_COUNT    8
+#define SIM_MBUF_SIZE     64
+// Default ATT MTU, long reads come in blobs of the link MTU - 1 bytes
+#define SIM_ATT_MTU       23
+// MTU the sensors accept in an exchange, like the NimBLE default
+#define SIM_PEER_MTU      256
+// Connection events between a parameter update request and its instant
+#define SIM_UPDATE_EVENTS 6
+
+typedef enum {
+    PROC_NONE = 0,
+    PROC_DISC_SVC,
+    PROC_DISC_CHRS,
+    PROC_DISC_DSCS,
+    PROC_READ,
+    PROC_READ_LONG,
+    PROC_WRITE,
+    PROC_MTU,
+} sim_proc_type_t;
+
+// GATT procedure in progress on a connection
+typedef struct sim_proc_t {
+    sim_proc_type_t type;
+    uint16_t handle;
+    uint32_t value;                // Service UUID, written value, read offset, end handle or MTU
+    union {
+        ble_gatt_disc_svc_fn *svc;
+        ble_gatt_chr_fn *chr;
+        ble_gatt_dsc_fn *dsc;
+        ble_gatt_attr_fn *attr;
+        ble_gatt_mtu_fn *mtu;
+    } cb;
+    void *arg;
+} sim_proc_t;
+
+typedef struct sim_sensor_t {
+    bool in_use;
+    sim_sensor_cfg_t cfg;
+    ble_addr_t addr;
+    int16_t temp;                  // Readings x100, random walk
+    int16_t hum;
+    uint32_t seq;                  // Sample number of the last reading
+    uint32_t added_ms;             // History is sampled from here on
+    uint32_t backlog_acked;        // Backlog position acked by the gateway
+    uint16_t conn_handle;          // BLE_HS_CONN_HANDLE_NONE if not connected
+    struct ble_npl_callout adv_co;
+} sim_sensor_t;
+
+typedef struct sim_conn_t {
+    bool in_use;
+    uint16_t handle;
+    sim_sensor_t *sensor;
+    ble_gap_event_fn *cb;
+    void *cb_arg;
+    sim_proc_t proc;
+    uint16_t notify_val;           // Value handle whose CCCD is enabled, 0 if none
+    uint16_t mtu;                  // ATT MTU of the link
+    bool mtu_exchanged;            // The client exchanges the MTU once
+    uint16_t backlog_len;          // Backlog batch of the long read in progress
+    uint8_t backlog[ENV_WIRE_BATCH_MAX_LEN];
+    int term_reason;               // Reason reported once the link is down
+    uint16_t itvl;                 // Connection interval, 1.25 ms units
+    uint16_t latency;              // Events the sensor may sleep through
+    bool update_pending;           // Parameter update waiting for its instant
+    struct ble_gap_upd_params update;
+    struct ble_npl_callout proc_co;
+    struct ble_npl_callout notify_co;
+    struct ble_npl_callout term_co;
+    struct ble_npl_callout update_co;
+} sim_conn_t;
+
+// Connection being initiated with ble_gap_connect()
+static struct {
+    bool active;
+    bool cancelled;                // ble_gap_conn_cancel() called, event not delivered yet
+    ble_addr_t addr;
+    sim_sensor_t *sensor;          // Set once the sensor advertised
+    struct ble_gap_conn_params params;
+    ble_gap_event_fn *cb;
+    void *cb_arg;
+    struct ble_npl_callout co;
+} sim_connect;
+
+static struct {
+    bool scanning;
+    nimble_scanner_cfg_t cfg;
+    nimble_scanner_cb cb;
+} sim_scanner;
+
+static sim_sensor_t sensors[SIM_MAX_SENSORS];
+static sim_conn_t conns[MYNEWT_VAL(BLE_MAX_CONNECTIONS)];
+static uint16_t next_conn_handle = SIM_FIRST_CONN;
+static uint32_t rand_state = 1;
+static mutex_t sim_lock = MUTEX_INIT;
+
+static struct ble_npl_eventq sim_eventq;
+static char sim_stack[THREAD_STACKSIZE_DEFAULT];
+
+static os_membuf_t sim_mbuf_mem[OS_MEMPOOL_SIZE(SIM_MBUF_COUNT, SIM_MBUF_SIZE)];
+static struct os_mempool sim_mbuf_mempool;
+static struct os_mbuf_pool sim_mbuf_pool;
+
+// xorshift32, seeded by `sim seed` so runs can be repeated
+static uint32_t sim_rand(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static bool sim_lost(const sim_sensor_t *s)
+{
+    return s->cfg.loss_pct > 0 && (sim_rand() % 100) < s->cfg.loss_pct;
+}
+
+// Wait for the next connection event the sensor listens in
+static uint32_t sim_conn_event_delay(const sim_conn_t *conn)
+{
+    uint32_t span_us = (conn->latency + 1) * conn->itvl * 1250;
+    return span_us ? (sim_rand() % span_us) / 1000 : 0;
+}
+
+// ATT round trip, repeated for every lost PDU as the link layer would
+static uint32_t sim_att_delay(const sim_conn_t *conn)
+{
+    const sim_sensor_t *s = conn->sensor;
+    uint32_t delay = sim_conn_event_delay(conn) + s->cfg.att_ms;
+    while (sim_lost(s)) {
+        delay += conn->itvl * 5 / 4 + s->cfg.att_ms;
+    }
+    return delay;
+}
+
+static void sim_schedule(struct ble_npl_callout *co, uint32_t ms)
+{
+    ble_npl_callout_reset(co, ble_npl_time_ms_to_ticks32(ms));
+}
+
+static sim_conn_t *conn_by_handle(uint16_t handle)
+{
+    for (unsigned i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        if (conns[i].in_use && conns[i].handle == handle) {
+            return &conns[i];
+        }
+    }
+    return NULL;
+}
+
+// Reading as sent by sensor/, an env_wire_reading_t
+static struct os_mbuf *sim_reading_mbuf(sim_sensor_t *s, uint16_t val_handle)
+{
+    int16_t *value;
+    if (val_handle == SIM_TEMP_VAL) {
+        value = &s->temp;
+    } else if (val_handle == SIM_HUM_VAL) {
+        value = &s->hum;
+    } else {
+        return NULL;
+    }
+    *value += (int16_t)(sim_rand() % 21) - 10;
+
+    uint8_t buf[ENV_WIRE_READING_LEN];
+    size_t len = env_wire_reading_encode(buf, ++s->seq, ztimer_now(ZTIMER_MSEC), *value);
+
+    struct os_mbuf *om = os_mbuf_get_pkthdr(&sim_mbuf_pool, 0);
+    if (om && os_mbuf_append(om, buf, len) != 0) {
+        os_mbuf_free_chain(om);
+        om = NULL;
+    }
+    return om;
+}
+
+// Backlog value of sensor/: a batch of the samples from the acked one on
+static size_t sim_backlog_value(const sim_sensor_t *s, uint8_t *buf)
+{
+    static env_wire_sample_t samples[ENV_WIRE_BATCH_MAX_SAMPLES];
+
+    uint32_t next = (ztimer_now(ZTIMER_MSEC) - s->added_ms) / SIM_HISTORY_PERIOD_MS + 1;
+    uint32_t first = next > SIM_HISTORY_SIZE ? next - SIM_HISTORY_SIZE : 0;
+    if (first < s->backlog_acked) {
+        first = s->backlog_acked;
+    }
+
+    unsigned n = 0;
+    for (uint32_t seq = first; seq < next && n < ENV_WIRE_BATCH_MAX_SAMPLES; seq++, n++) {
+        samples[n].timestamp = s->added_ms + seq * SIM_HISTORY_PERIOD_MS;
+        samples[n].temperature = 2150 + (int16_t)(seq % 64) - 32;
+        samples[n].humidity = 4500 + seq % 128;
+    }
+    unsigned count;
+    return env_wire_batch_encode(buf, ENV_WIRE_BATCH_MAX_LEN, samples, n, first, next, &count);
+}
+
+// Advertisement of sensor/: flags, name, UUID16 list, ESS service data
+static size_t sim_build_adv(const sim_sensor_t *s, uint8_t *ad)
+{
+    static const char name[] = "EnvNode";
+    size_t len = 0;
+    env_wire_sample_t sample = {
+        .timestamp = ztimer_now(ZTIMER_MSEC),
+        .temperature = s->temp,
+        .humidity = s->hum,
+    };
+
+    ad[len++] = 2;
+    ad[len++] = BLE_HS_ADV_TYPE_FLAGS;
+    ad[len++] = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+
+    ad[len++] = sizeof(name);
+    ad[len++] = BLE_HS_ADV_TYPE_COMP_NAME;
+    memcpy(&ad[len], name, sizeof(name) - 1);
+    len += sizeof(name) - 1;
+
+    ad[len++] = 5;
+    ad[len++] = BLE_HS_ADV_TYPE_COMP_UUIDS16;
+    ad[len++] = TEMPERATURE_CHARACTERISTIC_UUID & 0xff;
+    ad[len++] = TEMPERATURE_CHARACTERISTIC_UUID >> 8;
+    ad[len++] = HUMIDITY_CHARACTERISTIC_UUID & 0xff;
+    ad[len++] = HUMIDITY_CHARACTERISTIC_UUID >> 8;
+
+    ad[len++] = 3 + ENV_WIRE_ADV_LEN;
+    ad[len++] = BLE_HS_ADV_TYPE_SVC_DATA_UUID16;
+    ad[len++] = ENV_SENSING_SERVICE_UUID & 0xff;
+    ad[len++] = ENV_SENSING_SERVICE_UUID >> 8;
+    len += env_wire_adv_encode(&ad[len], &sample);
+
+    return len;
+}
+
+static bool scanner_listening(void)
+{
+    if (!sim_scanner.scanning || !sim_scanner.cb) return false;
+
+    // Only advertisements falling into the scan window are heard
+    uint32_t itvl = sim_scanner.cfg.itvl_ms ? sim_scanner.cfg.itvl_ms : 1;
+    return (ztimer_now(ZTIMER_MSEC) % itvl) < sim_scanner.cfg.win_ms;
+}
+
+static void adv_event_cb(struct ble_npl_event *ev)
+{
+    sim_sensor_t *s = ble_npl_event_get_arg(ev);
+    uint8_t ad[BLE_HS_ADV_MAX_SZ];
+    size_t ad_len = 0;
+    bool report = false;
+    nimble_scanner_cb cb = NULL;
+
+    mutex_lock(&sim_lock);
+    if (!s->in_use) {
+        mutex_unlock(&sim_lock);
+        return;
+    }
+    sim_schedule(&s->adv_co, s->cfg.adv_itvl_ms + sim_rand() % 10);
+
+    // sensor/ stops advertising while a gateway is connected
+    if (s->conn_handle != BLE_HS_CONN_HANDLE_NONE || sim_lost(s)) {
+        mutex_unlock(&sim_lock);
+        return;
+    }
+
+    // The initiator answers the advertisement with a connect request
+    if (sim_connect.active && !sim_connect.cancelled && !sim_connect.sensor &&
+        ble_addr_cmp(&sim_connect.addr, &s->addr) == 0) {
+        sim_connect.sensor = s;
+        sim_schedule(&sim_connect.co, s->cfg.connect_ms);
+    }
+
+    if (scanner_listening()) {
+        ad_len = sim_build_adv(s, ad);
+        cb = sim_scanner.cb;
+        report = true;
+    }
+    mutex_unlock(&sim_lock);
+
+    if (report) {
+        nimble_scanner_info_t info = {
+            .status = 0,
+            .phy_pri = BLE_HCI_LE_PHY_1M,
+            .phy_sec = BLE_HCI_LE_PHY_1M,
+            .rssi = -40 - (int8_t)(sim_rand() % 40),
+        };
+        cb(0, &s->addr, &info, ad, ad_len);
+    }
+}
+
+static void connect_event_cb(struct ble_npl_event *ev)
+{
+    (void)ev;
+    struct ble_gap_event event = { .type = BLE_GAP_EVENT_CONNECT };
+    ble_gap_event_fn *cb;
+    void *cb_arg;
+
+    mutex_lock(&sim_lock);
+    sim_sensor_t *s = sim_connect.sensor;
+    sim_conn_t *conn = NULL;
+
+    // Cancelled by the host, reported from the event queue like NimBLE does
+    if (sim_connect.active && sim_connect.cancelled) {
+        sim_connect.active = false;
+        sim_connect.cancelled = false;
+        cb = sim_connect.cb;
+        cb_arg = sim_connect.cb_arg;
+        mutex_unlock(&sim_lock);
+
+        event.connect.status = BLE_HS_EAPP;
+        event.connect.conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        cb(&event, cb_arg);
+        return;
+    }
+
+    // Connect duration ran out before the sensor advertised
+    if (sim_connect.active && !s) {
+        sim_connect.active = false;
+        cb = sim_connect.cb;
+        cb_arg = sim_connect.cb_arg;
+        mutex_unlock(&sim_lock);
+
+        event.connect.status = BLE_HS_ETIMEOUT;
+        event.connect.conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        cb(&event, cb_arg);
+        return;
+    }
+
+    for (unsigned i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        if (!conns[i].in_use) {
+            conn = &conns[i];
+            break;
+        }
+    }
+    if (!sim_connect.active || !conn) {
+        mutex_unlock(&sim_lock);
+        return;
+    }
+
+    conn->in_use = true;
+    conn->handle = next_conn_handle++;
+    conn->sensor = s;
+    conn->cb = sim_connect.cb;
+    conn->cb_arg = sim_connect.cb_arg;
+    conn->proc.type = PROC_NONE;
+    conn->notify_val = 0;
+    conn->mtu = SIM_ATT_MTU;
+    conn->mtu_exchanged = false;
+    // Like most controllers, the longest interval the central allows
+    conn->itvl = sim_connect.params.itvl_max;
+    conn->latency = sim_connect.params.latency;
+    conn->update_pending = false;
+    s->conn_handle = conn->handle;
+    sim_connect.active = false;
+
+    cb = conn->cb;
+    cb_arg = conn->cb_arg;
+    event.connect.status = 0;
+    event.connect.conn_handle = conn->handle;
+    mutex_unlock(&sim_lock);
+
+    cb(&event, cb_arg);
+}
+
+static void proc_event_cb(struct ble_npl_event *ev)
+{
+    sim_conn_t *conn = ble_npl_event_get_arg(ev);
+    struct ble_gatt_error ok = { .status = 0 };
+    struct ble_gatt_error done = { .status = BLE_HS_EDONE };
+
+    mutex_lock(&sim_lock);
+    if (!conn->in_use || conn->proc.type == PROC_NONE) {
+        mutex_unlock(&sim_lock);
+        return;
+    }
+    sim_proc_t proc = conn->proc;
+    conn->proc.type = PROC_NONE;
+    uint16_t handle = conn->handle;
+    struct os_mbuf *om = NULL;
+    if (proc.type == PROC_READ) {
+        om = sim_reading_mbuf(conn->sensor, proc.handle);
+    }
+    // Long read: the value is built at offset 0 and blobs are cut from it,
+    // like sensor/ does
+    uint8_t *value = conn->backlog;
+    uint16_t offset = proc.value;
+    bool last = true;
+    if (proc.type == PROC_READ_LONG && proc.handle == SIM_BACKLOG_VAL) {
+        if (offset == 0) {
+            conn->backlog_len = sim_backlog_value(conn->sensor, value);
+        }
+        size_t len = conn->backlog_len;
+        size_t blob = offset < len ? len - offset : 0;
+        if (blob > conn->mtu - 1u) {
+            blob = conn->mtu - 1u;
+        }
+        om = os_mbuf_get_pkthdr(&sim_mbuf_pool, 0);
+        if (om && blob > 0 && os_mbuf_append(om, &value[offset], blob) != 0) {
+            os_mbuf_free_chain(om);
+            om = NULL;
+        }
+        // A full blob is followed by a Read Blob Request for the rest
+        if (om && blob == conn->mtu - 1u) {
+            last = false;
+            conn->proc = proc;
+            conn->proc.value = offset + blob;
+            sim_schedule(&conn->proc_co, sim_att_delay(conn));
+        }
+    }
+    if (proc.type == PROC_WRITE && proc.handle == SIM_BACKLOG_VAL) {
+        conn->sensor->backlog_acked = proc.value;
+    }
+    if (proc.type == PROC_MTU) {
+        conn->mtu = proc.value < SIM_PEER_MTU ? proc.value : SIM_PEER_MTU;
+    }
+    uint16_t mtu = conn->mtu;
+    if (proc.type == PROC_WRITE &&
+        (proc.handle == SIM_TEMP_CCCD || proc.handle == SIM_HUM_CCCD)) {
+        conn->notify_val = (proc.value & 0x0001) ? proc.handle - 1 : 0;
+        if (conn->notify_val) {
+            sim_schedule(&conn->notify_co, SIM_NOTIFY_ITVL_MS);
+        } else {
+            ble_npl_callout_stop(&conn->notify_co);
+        }
+    }
+    mutex_unlock(&sim_lock);
+
+    switch (proc.type) {
+        case PROC_DISC_SVC: {
+            struct ble_gatt_svc svc = {
+                .start_handle = SIM_SVC_START,
+                .end_handle = SIM_SVC_END,
+            };
+            svc.uuid.u16.u.type = BLE_UUID_TYPE_16;
+            svc.uuid.u16.value = ENV_SENSING_SERVICE_UUID;
+            if (proc.value == ENV_SENSING_SERVICE_UUID) {
+                proc.cb.svc(handle, &ok, &svc, proc.arg);
+            }
+            proc.cb.svc(handle, &done, NULL, proc.arg);
+            break;
+        }
+        case PROC_DISC_CHRS: {
+            struct ble_gatt_chr chr = {
+                .def_handle = SIM_TEMP_DEF,
+                .val_handle = SIM_TEMP_VAL,
+                .properties = BLE_GATT_CHR_PROP_READ | BLE_GATT_CHR_PROP_NOTIFY,
+            };
+            chr.uuid.u16.u.type = BLE_UUID_TYPE_16;
+            chr.uuid.u16.value = TEMPERATURE_CHARACTERISTIC_UUID;
+            // A non-zero return stops the procedure without EDONE
+            if (proc.cb.chr(handle, &ok, &chr, proc.arg) != 0) break;
+            chr.def_handle = SIM_HUM_DEF;
+            chr.val_handle = SIM_HUM_VAL;
+            chr.uuid.u16.value = HUMIDITY_CHARACTERISTIC_UUID;
+            if (proc.cb.chr(handle, &ok, &chr, proc.arg) != 0) break;
+            chr.def_handle = SIM_BACKLOG_DEF;
+            chr.val_handle = SIM_BACKLOG_VAL;
+            chr.properties = BLE_GATT_CHR_PROP_READ | BLE_GATT_CHR_PROP_WRITE;
+            chr.uuid.u128 = backlog_chr_uuid;
+            if (proc.cb.chr(handle, &ok, &chr, proc.arg) != 0) break;
+            proc.cb.chr(handle, &done, NULL, proc.arg);
+            break;
+        }
+        case PROC_DISC_DSCS: {
+            // The CCCD follows the value handle discovery starts from
+            struct ble_gatt_dsc dsc = { .handle = proc.handle + 1 };
+            dsc.uuid.u16.u.type = BLE_UUID_TYPE_16;
+            dsc.uuid.u16.value = BLE_GATT_DSC_CLT_CFG_UUID16;
+            if (dsc.handle <= proc.value &&
+                proc.cb.dsc(handle, &ok, proc.handle, &dsc, proc.arg) != 0) {
+                break;
+            }
+            proc.cb.dsc(handle, &done, proc.handle, NULL, proc.arg);
+            break;
+        }
+        case PROC_READ: {
+            struct ble_gatt_error err = { .status = 0, .att_handle = proc.handle };
+            struct ble_gatt_attr attr = { .handle = proc.handle, .offset = 0, .om = om };
+            if (!om) {
+                err.status = BLE_HS_ATT_ERR(BLE_ATT_ERR_INVALID_HANDLE);
+            }
+            proc.cb.attr(handle, &err, om ? &attr : NULL, proc.arg);
+            if (om) os_mbuf_free_chain(om);
+            break;
+        }
+        case PROC_READ_LONG: {
+            struct ble_gatt_error err = { .status = 0, .att_handle = proc.handle };
+            struct ble_gatt_attr attr = { .handle = proc.handle, .offset = offset, .om = om };
+            if (!om) {
+                err.status = BLE_HS_ATT_ERR(BLE_ATT_ERR_INVALID_HANDLE);
+            }
+            proc.cb.attr(handle, &err, om ? &attr : NULL, proc.arg);
+            if (om) os_mbuf_free_chain(om);
+            if (om && last) {
+                proc.cb.attr(handle, &done, NULL, proc.arg);
+            }
+            break;
+        }
+        case PROC_WRITE: {
+            struct ble_gatt_attr attr = { .handle = proc.handle, .offset = 0, .om = NULL };
+            if (proc.cb.attr) {
+                proc.cb.attr(handle, &ok, &attr, proc.arg);
+            }
+            break;
+        }
+        case PROC_MTU:
+            if (proc.cb.mtu) {
+                proc.cb.mtu(handle, &ok, mtu, proc.arg);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void notify_event_cb(struct ble_npl_event *ev)
+{
+    sim_conn_t *conn = ble_npl_event_get_arg(ev);
+    struct ble_gap_event event = { .type = BLE_GAP_EVENT_NOTIFY_RX };
+
+    mutex_lock(&sim_lock);
+    if (!conn->in_use || !conn->notify_val) {
+        mutex_unlock(&sim_lock);
+        return;
+    }
+    sim_schedule(&conn->notify_co, SIM_NOTIFY_ITVL_MS);
+    event.notify_rx.om = sim_reading_mbuf(conn->sensor, conn->notify_val);
+    event.notify_rx.conn_handle = conn->handle;
+    event.notify_rx.attr_handle = conn->notify_val;
+    event.notify_rx.indication = 0;
+    ble_gap_event_fn *cb = conn->cb;
+    void *cb_arg = conn->cb_arg;
+    mutex_unlock(&sim_lock);
+
+    if (!event.notify_rx.om) return;
+    cb(&event, cb_arg);
+    os_mbuf_free_chain(event.notify_rx.om);
+}
+
+// Parameter update reached its instant
+static void update_event_cb(struct ble_npl_event *ev)
+{
+    sim_conn_t *conn = ble_npl_event_get_arg(ev);
+    struct ble_gap_event event = { .type = BLE_GAP_EVENT_CONN_UPDATE };
+
+    mutex_lock(&sim_lock);
+    if (!conn->in_use || !conn->update_pending) {
+        mutex_unlock(&sim_lock);
+        return;
+    }
+    conn->update_pending = false;
+    conn->itvl = conn->update.itvl_max;
+    conn->latency = conn->update.latency;
+    event.conn_update.status = 0;
+    event.conn_update.conn_handle = conn->handle;
+    ble_gap_event_fn *cb = conn->cb;
+    void *cb_arg = conn->cb_arg;
+    mutex_unlock(&sim_lock);
+
+    cb(&event, cb_arg);
+}
+
+static void term_event_cb(struct ble_npl_event *ev)
+{
+    sim_conn_t *conn = ble_npl_event_get_arg(ev);
+    struct ble_gap_event event = { .type = BLE_GAP_EVENT_DISCONNECT };
+
+    mutex_lock(&sim_lock);
+    if (!conn->in_use) {
+        mutex_unlock(&sim_lock);
+        return;
+    }
+    // Procedures still queued die with the link
+    ble_npl_callout_stop(&conn->proc_co);
+    ble_npl_callout_stop(&conn->notify_co);
+    ble_npl_callout_stop(&conn->update_co);
+    conn->in_use = false;
+    conn->sensor->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+
+    event.disconnect.reason = conn->term_reason;
+    event.disconnect.conn.conn_handle = conn->handle;
+    event.disconnect.conn.peer_id_addr = conn->sensor->addr;
+    event.disconnect.conn.peer_ota_addr = conn->sensor->addr;
+    ble_gap_event_fn *cb = conn->cb;
+    void *cb_arg = conn->cb_arg;
+    mutex_unlock(&sim_lock);
+
+    cb(&event, cb_arg);
+}
+
+/* Mocked scanner API */
+
+int nimble_scanner_init(const nimble_scanner_cfg_t *params, nimble_scanner_cb disc_cb)
+{
+    mutex_lock(&sim_lock);
+    sim_scanner.cfg = *params;
+    sim_scanner.cb = disc_cb;
+    mutex_unlock(&sim_lock);
+    return 0;
+}
+
+int nimble_scanner_start(void)
+{
+    // Like the controller, no scanning while a connection is initiated
+    if (sim_connect.active) return -ECANCELED;
+    sim_scanner.scanning = true;
+    return 0;
+}
+
+void nimble_scanner_stop(void)
+{
+    sim_scanner.scanning = false;
+}
+
+int nimble_scanner_status(void)
+{
+    return sim_scanner.scanning ? NIMBLE_SCANNER_SCANNING : NIMBLE_SCANNER_STOPPED;
+}
+
+/* Mocked GAP API */
+
+int ble_gap_connect(uint8_t own_addr_type, const ble_addr_t *peer_addr,
+                    int32_t duration_ms, const struct ble_gap_conn_params *params,
+                    ble_gap_event_fn *cb, void *cb_arg)
+{
+    (void)own_addr_type;
+
+    mutex_lock(&sim_lock);
+    if (sim_connect.active) {
+        mutex_unlock(&sim_lock);
+        return BLE_HS_EALREADY;
+    }
+    if (sim_scanner.scanning) {
+        mutex_unlock(&sim_lock);
+        return BLE_HS_EBUSY;
+    }
+    sim_connect.active = true;
+    sim_connect.cancelled = false;
+    sim_connect.addr = *peer_addr;
+    sim_connect.sensor = NULL;
+    sim_connect.params = *params;
+    sim_connect.cb = cb;
+    sim_connect.cb_arg = cb_arg;
+    if (duration_ms != BLE_HS_FOREVER) {
+        sim_schedule(&sim_connect.co, duration_ms);
+    }
+    mutex_unlock(&sim_lock);
+    return 0;
+}
+
+/*
+* The connect event with BLE_HS_EAPP follows from the event queue, after the
+* caller returned. Until then the initiator stays busy.
+*/
+int ble_gap_conn_cancel(void)
+{
+    mutex_lock(&sim_lock);
+    if (!sim_connect.active || sim_connect.cancelled) {
+        mutex_unlock(&sim_lock);
+        return BLE_HS_EALREADY;
+    }
+    sim_connect.cancelled = true;
+    sim_schedule(&sim_connect.co, 0);
+    mutex_unlock(&sim_lock);
+    return 0;
+}
+
+int ble_gap_terminate(uint16_t conn_handle, uint8_t hci_reason)
+{
+    (void)hci_reason;
+
+    mutex_lock(&sim_lock);
+    sim_conn_t *conn = conn_by_handle(conn_handle);
+    if (!conn) {
+        mutex_unlock(&sim_lock);
+        return BLE_HS_ENOTCONN;
+    }
+    conn->term_reason = BLE_HS_HCI_ERR(BLE_ERR_CONN_TERM_LOCAL);
+    sim_schedule(&conn->term_co, conn->sensor->cfg.att_ms);
+    mutex_unlock(&sim_lock);
+    return 0;
+}
+
+int ble_gap_update_params(uint16_t conn_handle, const struct ble_gap_upd_params *params)
+{
+    mutex_lock(&sim_lock);
+    sim_conn_t *conn = conn_by_handle(conn_handle);
+    if (!conn) {
+        mutex_unlock(&sim_lock);
+        return BLE_HS_ENOTCONN;
+    }
+    if (conn->update_pending) {
+        mutex_unlock(&sim_lock);
+        return BLE_HS_EALREADY;
+    }
+    // The new parameters apply at an instant a few events of the old interval away
+    conn->update_pending = true;
+    conn->update = *params;
+    sim_schedule(&conn->update_co, SIM_UPDATE_EVENTS * conn->itvl * 5 / 4);
+    mutex_unlock(&sim_lock);
+    return 0;
+}
+
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc)
+{
+    int rc = BLE_HS_ENOTCONN;
+
+    mutex_lock(&sim_lock);
+    sim_conn_t *conn = conn_by_handle(handle);
+    if (conn) {
+        memset(out_desc, 0, sizeof(*out_desc));
+        out_desc->conn_handle = handle;
+        out_desc->conn_itvl = conn->itvl;
+        out_desc->conn_latency = conn->latency;
+        out_desc->peer_id_addr = conn->sensor->addr;
+        out_desc->peer_ota_addr = conn->sensor->addr;
+        rc = 0;
+    }
+    mutex_unlock(&sim_lock);
+    return rc;
+}
+
+/* Mocked GATT client API */
+
+static int proc_start(uint16_t conn_handle, const sim_proc_t *proc)
+{
+    mutex_lock(&sim_lock);
+    sim_conn_t *conn = conn_by_handle(conn_handle);
+    if (!conn) {
+        mutex_unlock(&sim_lock);
+        return BLE_HS_ENOTCONN;
+    }
+    if (conn->proc.type != PROC_NONE) {
+        mutex_unlock(&sim_lock);
+        return BLE_HS_EBUSY;
+    }
+    conn->proc = *proc;
+    sim_schedule(&conn->proc_co, sim_att_delay(conn));
+    mutex_unlock(&sim_lock);
+    return 0;
+}
+
+int ble_gattc_disc_svc_by_uuid(uint16_t conn_handle, const ble_uuid_t *uuid,
+                               ble_gatt_disc_svc_fn *cb, void *cb_arg)
+{
+    sim_proc_t proc = { .type = PROC_DISC_SVC, .cb.svc = cb, .arg = cb_arg };
+    if (uuid->type == BLE_UUID_TYPE_16) {
+        proc.value = BLE_UUID16(uuid)->value;
+    }
+    return proc_start(conn_handle, &proc);
+}
+
+int ble_gattc_disc_all_chrs(uint16_t conn_handle, uint16_t start_handle,
+                            uint16_t end_handle, ble_gatt_chr_fn *cb, void *cb_arg)
+{
+    (void)start_handle; (void)end_handle;
+    sim_proc_t proc = { .type = PROC_DISC_CHRS, .cb.chr = cb, .arg = cb_arg };
+    return proc_start(conn_handle, &proc);
+}
+
+int ble_gattc_disc_all_dscs(uint16_t conn_handle, uint16_t start_handle,
+                            uint16_t end_handle, ble_gatt_dsc_fn *cb, void *cb_arg)
+{
+    sim_proc_t proc = {
+        .type = PROC_DISC_DSCS, .handle = start_handle, .value = end_handle,
+        .cb.dsc = cb, .arg = cb_arg,
+    };
+    return proc_start(conn_handle, &proc);
+}
+
+int ble_gattc_read(uint16_t conn_handle, uint16_t attr_handle,
+                   ble_gatt_attr_fn *cb, void *cb_arg)
+{
+    sim_proc_t proc = {
+        .type = PROC_READ, .handle = attr_handle, .cb.attr = cb, .arg = cb_arg,
+    };
+    return proc_start(conn_handle, &proc);
+}
+
+int ble_gattc_write_flat(uint16_t conn_handle, uint16_t attr_handle,
+                         const void *data, uint16_t data_len,
+                         ble_gatt_attr_fn *cb, void *cb_arg)
+{
+    const uint8_t *bytes = data;
+    sim_proc_t proc = {
+        .type = PROC_WRITE, .handle = attr_handle, .cb.attr = cb, .arg = cb_arg,
+    };
+    for (uint16_t i = 0; i < data_len && i < sizeof(proc.value); i++) {
+        proc.value |= (uint32_t)bytes[i] << (8 * i);
+    }
+    return proc_start(conn_handle, &proc);
+}
+
+int ble_gattc_read_long(uint16_t conn_handle, uint16_t handle, uint16_t offset,
+                        ble_gatt_attr_fn *cb, void *cb_arg)
+{
+    sim_proc_t proc = {
+        .type = PROC_READ_LONG, .handle = handle, .value = offset,
+        .cb.attr = cb, .arg = cb_arg,
+    };
+    return proc_start(conn_handle, &proc);
+}
+
+int ble_gattc_exchange_mtu(uint16_t conn_handle, ble_gatt_mtu_fn *cb, void *cb_arg)
+{
+    sim_proc_t proc = {
+        .type = PROC_MTU, .value = MYNEWT_VAL(BLE_ATT_PREFERRED_MTU),
+        .cb.mtu = cb, .arg = cb_arg,
+    };
+
+    mutex_lock(&sim_lock);
+    sim_conn_t *conn = conn_by_handle(conn_handle);
+    bool again = conn && conn->mtu_exchanged;
+    mutex_unlock(&sim_lock);
+    if (again) return BLE_HS_EALREADY;
+
+    int rc = proc_start(conn_handle, &proc);
+    if (rc == 0) {
+        mutex_lock(&sim_lock);
+        conn->mtu_exchanged = true;
+        mutex_unlock(&sim_lock);
+    }
+    return rc;
+}
+
+uint16_t ble_att_mtu(uint16_t conn_handle)
+{
+    mutex_lock(&sim_lock);
+    sim_conn_t *conn = conn_by_handle(conn_handle);
+    uint16_t mtu = conn ? conn->mtu : 0;
+    mutex_unlock(&sim_lock);
+    return mtu;
+}
+
+/* NimBLE host task replacement */
+
+struct ble_npl_eventq *nimble_port_get_dflt_eventq(void)
+{
+    return &sim_eventq;
+}
+
+static void *sim_thread(void *arg)
+{
+    (void)arg;
+    while (1) {
+        struct ble_npl_event *ev = ble_npl_eventq_get(&sim_eventq, BLE_NPL_TIME_FOREVER);
+        ble_npl_event_run(ev);
+    }
+    return NULL;
+}
+
+void sim_seed(uint32_t seed)
+{
+    rand_state = seed ? seed : 1;
+}
+
+/*
+* Add a virtual sensor. It starts advertising right away.
+* returns: index of the sensor, or -1 if all slots are used.
+*/
+int sim_add_sensor(const sim_sensor_cfg_t *cfg)
+{
+    mutex_lock(&sim_lock);
+    for (unsigned i = 0; i < SIM_MAX_SENSORS; i++) {
+        sim_sensor_t *s = &sensors[i];
+        if (s->in_use) continue;
+
+        memset(s, 0, sizeof(*s));
+        s->in_use = true;
+        s->cfg = *cfg;
+        s->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        s->temp = 2150;
+        s->hum = 4500;
+        s->added_ms = ztimer_now(ZTIMER_MSEC);
+        // Static random address c0:5e:ee:00:00:<n>
+        s->addr.type = BLE_ADDR_RANDOM;
+        s->addr.val[0] = i + 1;
+        s->addr.val[3] = 0xee;
+        s->addr.val[4] = 0x5e;
+        s->addr.val[5] = 0xc0;
+        ble_npl_callout_init(&s->adv_co, &sim_eventq, adv_event_cb, s);
+        sim_schedule(&s->adv_co, sim_rand() % cfg->adv_itvl_ms);
+        mutex_unlock(&sim_lock);
+        return i;
+    }
+    mutex_unlock(&sim_lock);
+    return -1;
+}
+
+void sim_init(void)
+{
+    ble_npl_eventq_init(&sim_eventq);
+    os_mempool_init(&sim_mbuf_mempool, SIM_MBUF_COUNT, SIM_MBUF_SIZE,
+                    sim_mbuf_mem, "sim_mbuf");
+    os_mbuf_pool_init(&sim_mbuf_pool, &sim_mbuf_mempool, SIM_MBUF_SIZE, SIM_MBUF_COUNT);
+
+    ble_npl_callout_init(&sim_connect.co, &sim_eventq, connect_event_cb, NULL);
+    for (unsigned i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        ble_npl_callout_init(&conns[i].proc_co, &sim_eventq, proc_event_cb, &conns[i]);
+        ble_npl_callout_init(&conns[i].notify_co, &sim_eventq, notify_event_cb, &conns[i]);
+        ble_npl_callout_init(&conns[i].term_co, &sim_eventq, term_event_cb, &conns[i]);
+        ble_npl_callout_init(&conns[i].update_co, &sim_eventq, update_event_cb, &conns[i]);
+    }
+
+    thread_create(sim_stack, sizeof(sim_stack), THREAD_PRIORITY_MAIN - 2,
+                  THREAD_CREATE_STACKTEST, sim_thread, NULL, "sim_ble");
+
+    // One node serving both readings by default
+    sim_sensor_cfg_t cfg = {
+        .adv_itvl_ms = SIM_ADV_ITVL_MS,
+        .connect_ms = SIM_CONNECT_MS,
+        .att_ms = SIM_ATT_MS,
+        .loss_pct = 0,
+    };
+    sim_add_sensor(&cfg);
+
+    printf("[INFO] BLE simulation running with one virtual sensor node\n");
+}
+
+static void sim_print(void)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < SIM_MAX_SENSORS; i++) {
+        const sim_sensor_t *s = &sensors[i];
+        if (!s->in_use) continue;
+        printf("[%u] adv: %lu ms  connect: %lu ms  att: %lu ms  loss: %u%%  %s\n", i,
+               (unsigned long)s->cfg.adv_itvl_ms, (unsigned long)s->cfg.connect_ms,
+               (unsigned long)s->cfg.att_ms, s->cfg.loss_pct,
+               s->conn_handle != BLE_HS_CONN_HANDLE_NONE ? "connected" : "advertising");
+        count++;
+    }
+    if (count == 0) {
+        printf("No virtual sensors\n");
+    }
+}
+
+/**Shell command */
+int cmd_sim(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "add") == 0) {
+        sim_sensor_cfg_t cfg = {
+            .adv_itvl_ms = argc > 2 ? strtoul(argv[2], NULL, 10) : SIM_ADV_ITVL_MS,
+            .connect_ms = argc > 3 ? strtoul(argv[3], NULL, 10) : SIM_CONNECT_MS,
+            .att_ms = argc > 4 ? strtoul(argv[4], NULL, 10) : SIM_ATT_MS,
+            .loss_pct = argc > 5 ? atoi(argv[5]) : 0,
+        };
+        if (cfg.adv_itvl_ms == 0 || cfg.loss_pct >= 100) {
+            printf("[ERR] adv_ms must be > 0 and loss below 100%%\n");
+            return 1;
+        }
+        if (sim_add_sensor(&cfg) < 0) {
+            printf("[ERR] At most %d virtual sensors\n", SIM_MAX_SENSORS);
+            return 1;
+        }
+    } else if (argc > 1 && strcmp(argv[1], "clear") == 0) {
+        mutex_lock(&sim_lock);
+        for (unsigned i = 0; i < SIM_MAX_SENSORS; i++) {
+            // Connected sensors stay until their link is closed
+            if (sensors[i].conn_handle != BLE_HS_CONN_HANDLE_NONE) continue;
+            ble_npl_callout_stop(&sensors[i].adv_co);
+            sensors[i].in_use = false;
+        }
+        mutex_unlock(&sim_lock);
+    } else if (argc > 2 && strcmp(argv[1], "seed") == 0) {
+        sim_seed(strtoul(argv[2], NULL, 10));
+    } else if (argc > 1) {
+        printf("usage: %s [add [adv_ms] [connect_ms] [att_ms] [loss_pct]"
+               " | clear | seed <n>]\n", argv[0]);
+        return 1;
+    }
+
+    sim_print();
+    return 0;
+}
+
+#endif /* GATEWAY_SIM */
@@ -0,0 +1,37 @@
+#ifndef SIM_BLE_H
+#define SIM_BLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Set by SIM=1 in the Makefile: native build against virtual sensors
+#ifndef GATEWAY_SIM
+#define GATEWAY_SIM 0
+#endif
+
+#define SIM_MAX_SENSORS       8
+
+// Defaults of a virtual sensor, close to an nrf52dk running sensor/
+#define SIM_ADV_ITVL_MS       100
+#define SIM_CONNECT_MS        30
+#define SIM_ATT_MS            15
+#define SIM_NOTIFY_ITVL_MS    1000
+// Sample history served by the backlog characteristic
+#define SIM_HISTORY_PERIOD_MS 1000
+#define SIM_HISTORY_SIZE      256
+
+// Behaviour of one virtual sensor, serving temperature and humidity
+typedef struct sim_sensor_cfg_t {
+    uint32_t adv_itvl_ms;     // Advertising interval, plus 0-10 ms advDelay
+    uint32_t connect_ms;      // Connection setup after the advertisement
+    uint32_t att_ms;          // Duration of one ATT request/response
+    uint8_t loss_pct;         // Chance to lose an advertisement or ATT PDU
+} sim_sensor_cfg_t;
+
+void sim_init(void);
+int sim_add_sensor(const sim_sensor_cfg_t *cfg);
+void sim_seed(uint32_t seed);
+
+int cmd_sim(int argc, char **argv);
+
+#endif /* SIM_BLE_H */
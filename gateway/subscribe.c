@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ztimer.h"
+#include "host/ble_gatt.h"
+#include "ble_handler.h"
+#include "gateway.h"
+#include "subscribe.h"
+#include "trace.h"
+
+#define CCCD_NOTIFY 0x0001
+
+static stream_t streams[MAX_STREAMS];
+
+static stream_t *find_stream(uint16_t conn_handle)
+{
+    for (unsigned i = 0; i < MAX_STREAMS; i++) {
+        if (streams[i].in_use && streams[i].conn_handle == conn_handle) {
+            return &streams[i];
+        }
+    }
+    return NULL;
+}
+
+static stream_t *find_stream_by_type(uint16_t sensor_uuid)
+{
+    for (unsigned i = 0; i < MAX_STREAMS; i++) {
+        if (streams[i].in_use && streams[i].sensor_uuid == sensor_uuid) {
+            return &streams[i];
+        }
+    }
+    return NULL;
+}
+
+static void subscribe_fail(gw_request_t *req, const char *msg)
+{
+    uint16_t conn = req->conn_handle;
+    req->response->success = false;
+    snprintf(req->response->error_message, sizeof(req->response->error_message),
+             "%s", msg);
+    ble_request_complete(req);
+    ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+static int cccd_write_cb(uint16_t conn, const struct ble_gatt_error *error,
+                         struct ble_gatt_attr *attr, void *arg)
+{
+    (void)attr;
+    (void)arg;
+
+    gw_request_t *req = request_find_by_conn(conn);
+    if (!req) return 0;
+
+    if (error->status != 0) {
+        TRACE_ERROR(TR_CCCD_FAILED, conn, error->status, 0);
+        subscribe_fail(req, "Enabling notifications failed");
+        return 0;
+    }
+
+    stream_t *s = NULL;
+    for (unsigned i = 0; i < MAX_STREAMS && !s; i++) {
+        if (!streams[i].in_use) s = &streams[i];
+    }
+    if (!s) {
+        subscribe_fail(req, "Too many streams");
+        return 0;
+    }
+
+    s->in_use = true;
+    s->conn_handle = conn;
+    s->addr = req->addr;
+    s->val_handle = req->val_handle;
+    s->sensor_uuid = req->sensor_uuid;
+    s->count = 0;
+    s->stale = 0;
+    s->start_ms = ztimer_now(ZTIMER_MSEC);
+
+    TRACE_INFO(TR_SUBSCRIBED, req->id, conn, req->sensor_uuid);
+    ble_request_release(req);
+    return 0;
+}
+
+static int dsc_disc_cb(uint16_t conn, const struct ble_gatt_error *error,
+                       uint16_t chr_val_handle, const struct ble_gatt_dsc *dsc,
+                       void *arg)
+{
+    (void)chr_val_handle;
+    (void)arg;
+
+    gw_request_t *req = request_find_by_conn(conn);
+    if (!req || req->state != REQ_SUBSCRIBING) return 0;
+
+    if (error->status == BLE_HS_EDONE) {
+        TRACE_ERROR(TR_CCCD_MISSING, conn, req->sensor_uuid, 0);
+        subscribe_fail(req, "Characteristic does not support notifications");
+        return 0;
+    }
+
+    if (error->status != 0 || !dsc) {
+        TRACE_ERROR(TR_DSC_DISC_FAILED, conn, error->status, 0);
+        subscribe_fail(req, "Descriptor discovery failed");
+        return 0;
+    }
+
+    if (dsc->uuid.u.type == BLE_UUID_TYPE_16 &&
+        dsc->uuid.u16.value == BLE_GATT_DSC_CLT_CFG_UUID16) {
+        uint16_t value = CCCD_NOTIFY;
+        int rc = ble_gattc_write_flat(conn, dsc->handle, &value, sizeof(value),
+                                      cccd_write_cb, NULL);
+        if (rc != 0) {
+            TRACE_ERROR(TR_CCCD_FAILED, conn, rc, 0);
+            subscribe_fail(req, "Enabling notifications failed");
+            return 0;
+        }
+        // Stop here, the EDONE of this procedure is not delivered
+        return 1;
+    }
+    return 0;
+}
+
+/*
+*Look up the CCCD of the characteristic found for req, between its value
+*and end handle, and enable notifications.
+*returns: rc of the descriptor discovery, 0 on success.
+*/
+int subscribe_start(gw_request_t *req)
+{
+    request_set_state(req, REQ_SUBSCRIBING);
+    int rc = ble_gattc_disc_all_dscs(req->conn_handle, req->val_handle, req->end_handle,
+                                     dsc_disc_cb, NULL);
+    if (rc != 0) {
+        TRACE_ERROR(TR_DSC_DISC_FAILED, req->conn_handle, rc, 0);
+        subscribe_fail(req, "Descriptor discovery failed");
+    }
+    return rc;
+}
+
+/*
+*Feed a notification into the response pipeline.
+*returns: true if it belonged to a stream.
+*/
+bool subscribe_on_notify(uint16_t conn_handle, uint16_t attr_handle, struct os_mbuf *om)
+{
+    stream_t *s = find_stream(conn_handle);
+    if (!s || s->val_handle != attr_handle) return false;
+
+    uint32_t seq;
+    int16_t reading;
+    uint32_t timestamp;
+    if (ble_decode_reading(om, &seq, &reading, &timestamp) != 0) return true;
+
+    // The sensor numbers its samples, only pass on newer ones
+    if (s->count > 0 && (int32_t)(seq - s->last_seq) <= 0) {
+        s->stale++;
+        return true;
+    }
+    s->last_seq = seq;
+
+    sensor_response_t response = {0};
+    snprintf(response.request_id, sizeof(response.request_id), "SUB_%d_%lu",
+             conn_handle, (unsigned long)s->count++);
+    strcpy(response.unit, s->sensor_uuid == TEMPERATURE_CHARACTERISTIC_UUID ?
+           "Celsius" : "Percent");
+    response.addr = s->addr;
+    response.success = true;
+    response.value = reading / 100.0;
+    response.timestamp = timestamp;
+
+    ble_publish_response(&response);
+    return true;
+}
+
+bool subscribe_on_disconnect(uint16_t conn_handle)
+{
+    stream_t *s = find_stream(conn_handle);
+    if (!s) return false;
+
+    TRACE_INFO(TR_STREAM_ENDED, conn_handle, s->sensor_uuid, s->count);
+    s->in_use = false;
+    return true;
+}
+
+static void stream_print(void)
+{
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < MAX_STREAMS; i++) {
+        stream_t *s = &streams[i];
+        if (!s->in_use) continue;
+        printf("[%u] sensor 0x%04X  handle: %d  readings: %lu  stale: %lu  for %lu ms\n",
+               i, s->sensor_uuid, s->conn_handle, (unsigned long)s->count,
+               (unsigned long)s->stale, (unsigned long)(now - s->start_ms));
+        count++;
+    }
+    if (count == 0) {
+        printf("No active streams\n");
+    }
+}
+
+static int subscribe_cmd(int argc, char **argv)
+{
+    if (argc < 2) {
+        stream_print();
+        return 0;
+    }
+
+    int sensor_type;
+    uint16_t sensor_uuid;
+    if (strcmp(argv[1], "temp") == 0) {
+        sensor_type = SENSOR_TEMP;
+        sensor_uuid = TEMPERATURE_CHARACTERISTIC_UUID;
+    } else if (strcmp(argv[1], "hum") == 0) {
+        sensor_type = SENSOR_HUM;
+        sensor_uuid = HUMIDITY_CHARACTERISTIC_UUID;
+    } else {
+        printf("usage: %s [temp|hum] [stop]\n", argv[0]);
+        return 1;
+    }
+
+    stream_t *s = find_stream_by_type(sensor_uuid);
+    if (argc > 2 && strcmp(argv[2], "stop") == 0) {
+        if (!s) {
+            printf("[ERR] No %s stream\n", argv[1]);
+            return 1;
+        }
+        // Notifications are disabled with the link, the CCCD is not bonded
+        ble_gap_terminate(s->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        return 0;
+    }
+
+    if (s) {
+        printf("[ERR] Already streaming from a %s sensor\n", argv[1]);
+        return 1;
+    }
+
+    printf("Subscribing to %s sensor...\n", argv[1]);
+    ble_query_sensor(sensor_type, QUERY_SUBSCRIBE);
+    return 0;
+}
+
+/**Shell command */
+int cmd_subscribe(int argc, char **argv)
+{
+    // Streams are set up and torn down by the host
+    return ble_host_cmd(subscribe_cmd, argc, argv);
+}
@@ -0,0 +1,31 @@
+#ifndef SUBSCRIBE_H
+#define SUBSCRIBE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host/ble_hs.h"
+#include "request.h"
+
+// Sensors streaming notifications at the same time
+#define MAX_STREAMS 2
+
+// Notification stream from one sensor
+typedef struct stream_t {
+    bool in_use;
+    uint16_t conn_handle;          // Link the notifications arrive on
+    ble_addr_t addr;               // Node at the other end of the link
+    uint16_t val_handle;           // Characteristic value handle
+    uint16_t sensor_uuid;          // Characteristic UUID of the sensor type
+    uint32_t count;                // Readings received
+    uint32_t last_seq;             // Sample number of the newest reading
+    uint32_t stale;                // Readings dropped as repeated or out of order
+    uint32_t start_ms;             // Subscription time
+} stream_t;
+
+int subscribe_start(gw_request_t *req);
+bool subscribe_on_notify(uint16_t conn_handle, uint16_t attr_handle, struct os_mbuf *om);
+bool subscribe_on_disconnect(uint16_t conn_handle);
+
+int cmd_subscribe(int argc, char **argv);
+
+#endif /* SUBSCRIBE_H */
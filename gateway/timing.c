@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "timing.h"
+
+#if TIMING_ENABLE
+
+#include "mutex.h"
+#include "ztimer.h"
+#include "ble_handler.h"
+
+static timing_rec_t timing_buf[TIMING_BUF_SIZE];
+static uint32_t timing_next;    // Next write index, only grows
+static uint32_t timing_first;   // Oldest index not cleared
+static mutex_t timing_lock = MUTEX_INIT;
+
+static const char *const point_names[TP_COUNT] = {
+    [TP_ALLOC]      = "alloc",
+    [TP_SCAN_START] = "scan_start",
+    [TP_ADV_RX]     = "adv_rx",
+    [TP_ADV_MATCH]  = "adv_match",
+    [TP_CONNECT]    = "connect",
+    [TP_CONNECTED]  = "connected",
+    [TP_SVC_FOUND]  = "svc_found",
+    [TP_CHR_FOUND]  = "chr_found",
+    [TP_READ_START] = "read_start",
+    [TP_READ_CB]    = "read_cb",
+    [TP_READ_DONE]  = "read_done",
+    [TP_PUBLISH]    = "publish",
+    [TP_RELEASED]   = "released",
+};
+
+// Point stamped along with each query phase
+static const uint8_t phase_points[PHASE_COUNT] = {
+    [PHASE_SCAN_START] = TP_SCAN_START,
+    [PHASE_ADV_MATCH]  = TP_ADV_MATCH,
+    [PHASE_CONNECTED]  = TP_CONNECTED,
+    [PHASE_SVC_FOUND]  = TP_SVC_FOUND,
+    [PHASE_CHR_FOUND]  = TP_CHR_FOUND,
+    [PHASE_READ_DONE]  = TP_READ_DONE,
+};
+
+void timing_begin(timing_rec_t *rec, uint32_t id, uint16_t sensor_uuid)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->id = id;
+    rec->sensor_uuid = sensor_uuid;
+    timing_stamp(rec, TP_ALLOC);
+}
+
+void timing_stamp_at(timing_rec_t *rec, timing_point_t point, uint32_t us)
+{
+    rec->us[point] = us;
+    rec->points |= 1 << point;
+}
+
+void timing_stamp(timing_rec_t *rec, timing_point_t point)
+{
+    timing_stamp_at(rec, point, ztimer_now(ZTIMER_USEC));
+}
+
+void timing_stamp_phase(timing_rec_t *rec, query_phase_t phase)
+{
+    timing_stamp(rec, phase_points[phase]);
+}
+
+/*
+*Close the record of a finished request and keep it for export, the oldest
+*record is overwritten when the buffer is full.
+*/
+void timing_commit(timing_rec_t *rec, bool success)
+{
+    timing_stamp(rec, TP_RELEASED);
+    rec->success = success;
+
+    mutex_lock(&timing_lock);
+    timing_buf[timing_next++ & (TIMING_BUF_SIZE - 1)] = *rec;
+    if (timing_next - timing_first > TIMING_BUF_SIZE) {
+        timing_first = timing_next - TIMING_BUF_SIZE;
+    }
+    mutex_unlock(&timing_lock);
+}
+
+void timing_clear(void)
+{
+    mutex_lock(&timing_lock);
+    timing_first = timing_next;
+    mutex_unlock(&timing_lock);
+}
+
+/*
+*Copy the records kept, oldest first.
+*returns: the number of records copied.
+*/
+static unsigned timing_copy(timing_rec_t *out)
+{
+    mutex_lock(&timing_lock);
+    unsigned n = 0;
+    for (uint32_t idx = timing_first; idx != timing_next; idx++) {
+        out[n++] = timing_buf[idx & (TIMING_BUF_SIZE - 1)];
+    }
+    mutex_unlock(&timing_lock);
+    return n;
+}
+
+/*
+*Points of a record in the order they were stamped. Paths differ: a pooled
+*read stamps read_start before connected, a broadcast reading never connects.
+*returns: the number of points stamped.
+*/
+static unsigned timing_order(const timing_rec_t *rec, uint8_t *order)
+{
+    unsigned n = 0;
+    for (unsigned p = 0; p < TP_COUNT; p++) {
+        if (!(rec->points & (1 << p))) continue;
+        unsigned i = n++;
+        for (; i > 0 && (int32_t)(rec->us[order[i - 1]] - rec->us[p]) > 0; i--) {
+            order[i] = order[i - 1];
+        }
+        order[i] = p;
+    }
+    return n;
+}
+
+// One CSV line per request, each point in us since alloc, empty if not reached
+static void timing_dump(const timing_rec_t *recs, unsigned n)
+{
+    printf("id,type,ok");
+    for (unsigned p = 0; p < TP_COUNT; p++) {
+        printf(",%s", point_names[p]);
+    }
+    printf("\n");
+
+    for (unsigned i = 0; i < n; i++) {
+        const timing_rec_t *r = &recs[i];
+        printf("%lu,%s,%d", (unsigned long)r->id,
+               r->sensor_uuid == TEMPERATURE_CHARACTERISTIC_UUID ? "TEMP" : "HUM",
+               r->success);
+        for (unsigned p = 0; p < TP_COUNT; p++) {
+            if (r->points & (1 << p)) {
+                printf(",%ld", (long)(int32_t)(r->us[p] - r->us[TP_ALLOC]));
+            } else {
+                printf(",");
+            }
+        }
+        printf("\n");
+    }
+}
+
+// Time spent before each point, since the point stamped just before it
+static void timing_summary(const timing_rec_t *recs, unsigned n)
+{
+    uint32_t count[TP_COUNT] = {0};
+    uint64_t sum_us[TP_COUNT] = {0};
+    uint32_t max_us[TP_COUNT] = {0};
+
+    for (unsigned i = 0; i < n; i++) {
+        uint8_t order[TP_COUNT];
+        unsigned points = timing_order(&recs[i], order);
+        for (unsigned k = 1; k < points; k++) {
+            uint8_t p = order[k];
+            uint32_t us = recs[i].us[p] - recs[i].us[order[k - 1]];
+            count[p]++;
+            sum_us[p] += us;
+            if (us > max_us[p]) max_us[p] = us;
+        }
+    }
+
+    printf("Timing records: %u (buffer %u), time since the previous point:\n",
+           n, (unsigned)TIMING_BUF_SIZE);
+    printf("%-11s %6s %10s %10s\n", "point", "n", "mean (us)", "max (us)");
+    for (unsigned p = 0; p < TP_COUNT; p++) {
+        if (count[p] == 0) continue;
+        printf("%-11s %6lu %10lu %10lu\n", point_names[p], (unsigned long)count[p],
+               (unsigned long)(sum_us[p] / count[p]), (unsigned long)max_us[p]);
+    }
+}
+
+/**Shell command */
+int cmd_timing(int argc, char **argv)
+{
+    static timing_rec_t recs[TIMING_BUF_SIZE];
+
+    if (argc == 2 && strcmp(argv[1], "clear") == 0) {
+        timing_clear();
+        return 0;
+    }
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "dump") != 0)) {
+        printf("usage: %s [dump|clear]\n", argv[0]);
+        return 1;
+    }
+
+    unsigned n = timing_copy(recs);
+    if (argc == 2) {
+        timing_dump(recs, n);
+    } else {
+        timing_summary(recs, n);
+    }
+    return 0;
+}
+
+#else
+
+/**Shell command */
+int cmd_timing(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    printf("[ERR] Built without timing records, rebuild with TIMING_ENABLE=1\n");
+    return 1;
+}
+
+#endif /* TIMING_ENABLE */
@@ -0,0 +1,74 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "application.h"
+
+// Stamp the query pipeline in microseconds, compiled out unless set
+#ifndef TIMING_ENABLE
+#define TIMING_ENABLE 0
+#endif
+
+// Finished records kept for export, must be a power of two
+#ifndef TIMING_BUF_SIZE
+#define TIMING_BUF_SIZE 32
+#endif
+
+// Points of the query pipeline, in the order a connected read passes them
+typedef enum timing_point_t {
+    TP_ALLOC,               // Request slot taken
+    TP_SCAN_START,          // Scanner started for the query
+    TP_ADV_RX,              // scan_cb entered with the matching advertisement
+    TP_ADV_MATCH,           // Filtered, recorded and matched to the request
+    TP_CONNECT,             // ble_gap_connect() issued
+    TP_CONNECTED,           // Connection complete
+    TP_SVC_FOUND,           // ESS service discovered
+    TP_CHR_FOUND,           // Sensor characteristic discovered
+    TP_READ_START,          // ble_gattc_read() issued
+    TP_READ_CB,             // gatt_read_cb entered
+    TP_READ_DONE,           // Reading decoded
+    TP_PUBLISH,             // Response handed to ble_publish_response()
+    TP_RELEASED,            // Published to every consumer, request freed
+    TP_COUNT
+} timing_point_t;
+
+_Static_assert(TP_COUNT <= 16, "timing points are a 16 bit mask");
+
+// ZTIMER_USEC timestamps of one request, a point stamped twice keeps the last
+typedef struct timing_rec_t {
+    uint32_t id;            // Request number
+    uint16_t sensor_uuid;
+    uint16_t points;        // Bit per point stamped
+    bool success;
+    uint32_t us[TP_COUNT];
+} timing_rec_t;
+
+int cmd_timing(int argc, char **argv);
+
+// Only built with TIMING_ENABLE, like gw_request_t.timing: use the macros
+#if TIMING_ENABLE
+void timing_begin(timing_rec_t *rec, uint32_t id, uint16_t sensor_uuid);
+void timing_stamp(timing_rec_t *rec, timing_point_t point);
+void timing_stamp_at(timing_rec_t *rec, timing_point_t point, uint32_t us);
+void timing_stamp_phase(timing_rec_t *rec, query_phase_t phase);
+void timing_commit(timing_rec_t *rec, bool success);
+void timing_clear(void);
+
+#define TIMING_BEGIN(req) timing_begin(&(req)->timing, (req)->id, (req)->sensor_uuid)
+#define TIMING_STAMP(req, point) timing_stamp(&(req)->timing, point)
+#define TIMING_STAMP_AT(req, point, us) timing_stamp_at(&(req)->timing, point, us)
+#define TIMING_STAMP_PHASE(req, phase) timing_stamp_phase(&(req)->timing, phase)
+#define TIMING_COMMIT(req) timing_commit(&(req)->timing, (req)->response->success)
+// Declare and take a timestamp for a later TIMING_STAMP_AT
+#define TIMING_NOW(var) uint32_t var = ztimer_now(ZTIMER_USEC)
+#else
+#define TIMING_BEGIN(req) do { } while (0)
+#define TIMING_STAMP(req, point) do { } while (0)
+#define TIMING_STAMP_AT(req, point, us) do { } while (0)
+#define TIMING_STAMP_PHASE(req, phase) do { } while (0)
+#define TIMING_COMMIT(req) do { } while (0)
+#define TIMING_NOW(var) do { } while (0)
+#endif
+
+#endif /* TIMING_H */
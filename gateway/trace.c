@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "atomic_utils.h"
+#include "ztimer.h"
+#include "trace.h"
+
+static trace_record_t trace_buf[TRACE_BUF_SIZE];
+static uint32_t trace_next;     // Next write index, only grows
+static uint32_t trace_read;     // First index not dumped yet
+
+// Format of each event; the first values args after args[0] print as readings x100
+static const struct {
+    const char *fmt;
+    uint8_t values;
+} trace_fmt[TR_EVENT_COUNT] = {
+    [TR_SCAN_FOUND]        = { "[INFO] REQ %ld: sensor found in %ld ms (RSSI: %ld dBm)", 0 },
+    [TR_ADV_READING]       = { "[INFO] REQ %ld: reading %.2f taken from advertisement", 1 },
+    [TR_CONNECTED]         = { "[SUCCESS] REQ %ld: connected, handle: %ld", 0 },
+    [TR_CONNECT_FAILED]    = { "[ERROR] REQ %ld: connection failed: %ld", 0 },
+    [TR_CONNECT_CANCELLED] = { "[TIMEOUT] REQ %ld: connect cancelled", 0 },
+    [TR_CACHED_READ]       = { "[DEBUG] REQ %ld: using cached handle %ld, skipping discovery", 0 },
+    [TR_LINK_SHARED]       = { "[INFO] REQ %ld: reading over the open link %ld, handle %ld", 0 },
+    [TR_DISCONNECTED]      = { "[INFO] Disconnected: handle %ld, reason=%ld", 0 },
+    [TR_CONN_UPDATE]       = { "[INFO] Handle %ld: parameters updated (status=%ld), interval: %ld x 1.25 ms", 0 },
+    [TR_CONN_PARAMS_FAILED] = { "[WARN] Handle %ld: profile %ld parameter update failed: %ld", 0 },
+    [TR_SVC_FOUND]         = { "[SUCCESS] Handle %ld: ESS service, handle range: %ld to %ld", 0 },
+    [TR_SVC_MISSING]       = { "[WARN] Handle %ld: ESS service not found", 0 },
+    [TR_CHR_FOUND]         = { "[DEBUG] Handle %ld: characteristic 0x%04lX, value handle: %ld", 0 },
+    [TR_CHR_MISSING]       = { "[WARN] Handle %ld: no characteristic 0x%04lX", 0 },
+    [TR_DISC_FAILED]       = { "[ERROR] Handle %ld: discovery failed: %ld", 0 },
+    [TR_READ_DONE]         = { "[INFO] REQ %ld: read %.2f @ %ld", 1 },
+    [TR_READ_FAILED]       = { "[ERR] Handle %ld: GATT read failed: %ld", 0 },
+    [TR_READ_SHORT]        = { "[WARN] Handle %ld: not enough data (%ld bytes)", 0 },
+    [TR_READ_UNKNOWN]      = { "[WARN] Read completed for unknown connection %ld", 0 },
+    [TR_TIMEOUT]           = { "[TIMEOUT] REQ %ld: timeout in state %ld after %ld ms", 0 },
+    [TR_GAP_EVENT]         = { "[DEBUG] Unhandled GAP event: %ld", 0 },
+    [TR_POOL_DEFERRED]     = { "[DEBUG] Pool slot %ld: reconnect deferred: %ld", 0 },
+    [TR_POOL_UNREACHABLE]  = { "[WARN] Pool slot %ld: sensor unreachable after %ld tries, dropped", 0 },
+    [TR_POOL_IDLE]         = { "[INFO] Pool slot %ld: closing idle link %ld", 0 },
+    [TR_POOL_RESTORED]     = { "[INFO] Pool slot %ld: link restored, handle: %ld", 0 },
+    [TR_POOL_REJECTED]     = { "[WARN] Pool slot %ld: sensor rejected profile %ld: %ld", 0 },
+    [TR_POOL_DROPPED]      = { "[WARN] Pool slot %ld: link dropped (reason=%ld), reconnecting", 0 },
+    [TR_SUBSCRIBED]        = { "[SUCCESS] REQ %ld: subscribed, handle: %ld, characteristic 0x%04lX", 0 },
+    [TR_CCCD_MISSING]      = { "[WARN] Handle %ld: no CCCD on characteristic 0x%04lX", 0 },
+    [TR_CCCD_FAILED]       = { "[ERR] Handle %ld: CCCD write failed: %ld", 0 },
+    [TR_DSC_DISC_FAILED]   = { "[ERROR] Handle %ld: descriptor discovery failed: %ld", 0 },
+    [TR_STREAM_ENDED]      = { "[INFO] Handle %ld: stream from 0x%04lX ended after %ld readings", 0 },
+    [TR_BACKLOG_START]     = { "[INFO] REQ %ld: downloading backlog over handle %ld (resumed=%ld)", 0 },
+    [TR_BACKLOG_SAMPLE]    = { "[DEBUG] Backlog seq %ld: %.2f C  %.2f %%", 2 },
+    [TR_BACKLOG_DONE]      = { "[SUCCESS] REQ %ld: backlog of %ld samples, next seq %ld", 0 },
+    [TR_BACKLOG_READ_FAILED] = { "[ERR] Handle %ld: backlog read failed: %ld", 0 },
+    [TR_BACKLOG_ACK_FAILED]  = { "[ERR] Handle %ld: backlog ack failed: %ld", 0 },
+    [TR_MTU]               = { "[INFO] Handle %ld: MTU exchanged (status=%ld), ATT MTU: %ld", 0 },
+    [TR_PADV_SYNCED]       = { "[SUCCESS] Node %ld: synced, %ld ms interval on PHY %ld", 0 },
+    [TR_PADV_SYNC_FAILED]  = { "[WARN] Node %ld: periodic sync failed: %ld", 0 },
+    [TR_PADV_LOST]         = { "[WARN] Node %ld: periodic sync lost: %ld, syncing again", 0 },
+    [TR_PADV_NOT_FOUND]    = { "[TIMEOUT] No periodic train found, trying the next node", 0 },
+};
+
+/*
+* Record an event. Safe from any thread: the slot is claimed with an atomic
+* increment and published by writing seq last. Old records are overwritten.
+*/
+void trace_record(trace_event_t event, int32_t a0, int32_t a1, int32_t a2)
+{
+    uint32_t idx = atomic_fetch_add_u32(&trace_next, 1);
+    trace_record_t *rec = &trace_buf[idx & (TRACE_BUF_SIZE - 1)];
+
+    atomic_store_u32(&rec->seq, 0);
+    rec->time_us = ztimer_now(ZTIMER_USEC);
+    rec->event = event;
+    rec->args[0] = a0;
+    rec->args[1] = a1;
+    rec->args[2] = a2;
+    atomic_store_u32(&rec->seq, idx + 1);
+}
+
+static void trace_print(const trace_record_t *rec)
+{
+    printf("%10lu ", (unsigned long)rec->time_us);
+
+    if (rec->event >= TR_EVENT_COUNT) {
+        printf("[WARN] Unknown trace event %u\n", rec->event);
+        return;
+    }
+    if (trace_fmt[rec->event].values == 2) {
+        printf(trace_fmt[rec->event].fmt, (long)rec->args[0],
+               rec->args[1] / 100.0, rec->args[2] / 100.0);
+    } else if (trace_fmt[rec->event].values == 1) {
+        printf(trace_fmt[rec->event].fmt, (long)rec->args[0],
+               rec->args[1] / 100.0, (long)rec->args[2]);
+    } else {
+        printf(trace_fmt[rec->event].fmt, (long)rec->args[0],
+               (long)rec->args[1], (long)rec->args[2]);
+    }
+    printf("\n");
+}
+
+/*
+* Print the records written since the last dump, oldest first.
+*/
+void trace_dump(void)
+{
+    uint32_t next = atomic_load_u32(&trace_next);
+    uint32_t first = trace_read;
+
+    if (next - first > TRACE_BUF_SIZE) {
+        first = next - TRACE_BUF_SIZE;
+        printf("[WARN] %lu trace records overwritten\n",
+               (unsigned long)(first - trace_read));
+    }
+
+    for (uint32_t idx = first; idx != next; idx++) {
+        const trace_record_t *slot = &trace_buf[idx & (TRACE_BUF_SIZE - 1)];
+        trace_record_t rec;
+
+        // Skip records being written or overwritten while copying
+        memcpy(&rec, slot, sizeof(rec));
+        if (rec.seq != idx + 1 || atomic_load_u32(&slot->seq) != idx + 1) continue;
+
+        trace_print(&rec);
+    }
+    trace_read = next;
+}
+
+void trace_clear(void)
+{
+    trace_read = atomic_load_u32(&trace_next);
+}
+
+/**Shell command */
+int cmd_trace(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "dump") == 0) {
+        trace_dump();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "clear") == 0) {
+        trace_clear();
+        return 0;
+    }
+    if (argc > 1) {
+        printf("usage: %s [dump|clear]\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t next = atomic_load_u32(&trace_next);
+    uint32_t pending = next - trace_read;
+    printf("Trace level %d, %lu records written, %lu pending (buffer %u)\n",
+           TRACE_LEVEL, (unsigned long)next,
+           (unsigned long)(pending > TRACE_BUF_SIZE ? TRACE_BUF_SIZE : pending),
+           (unsigned)TRACE_BUF_SIZE);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_LEVEL_NONE  0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO  2
+#define TRACE_LEVEL_DEBUG 3
+
+// Calls above this level are compiled out
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+// Number of records kept, must be a power of two
+#ifndef TRACE_BUF_SIZE
+#define TRACE_BUF_SIZE 64
+#endif
+
+// Events recorded from the NimBLE callbacks, formatted by trace_dump()
+typedef enum {
+    TR_SCAN_FOUND,          // request, scan time ms, rssi
+    TR_ADV_READING,         // request, reading x100
+    TR_CONNECTED,           // request, conn handle
+    TR_CONNECT_FAILED,      // request, status
+    TR_CONNECT_CANCELLED,   // request
+    TR_CACHED_READ,         // request, value handle
+    TR_LINK_SHARED,         // request, conn handle, value handle
+    TR_DISCONNECTED,        // conn handle, reason
+    TR_CONN_UPDATE,         // conn handle, status, interval x1.25 ms
+    TR_CONN_PARAMS_FAILED,  // conn handle, conn profile, status
+    TR_SVC_FOUND,           // conn handle, start handle, end handle
+    TR_SVC_MISSING,         // conn handle
+    TR_CHR_FOUND,           // conn handle, uuid, value handle
+    TR_CHR_MISSING,         // conn handle, uuid
+    TR_DISC_FAILED,         // conn handle, status
+    TR_READ_DONE,           // request, reading x100, sensor timestamp
+    TR_READ_FAILED,         // conn handle, status
+    TR_READ_SHORT,          // conn handle, length
+    TR_READ_UNKNOWN,        // conn handle
+    TR_TIMEOUT,             // request, state, elapsed ms
+    TR_GAP_EVENT,           // event type
+    TR_POOL_DEFERRED,       // pool slot, status
+    TR_POOL_UNREACHABLE,    // pool slot, retries
+    TR_POOL_IDLE,           // pool slot, conn handle
+    TR_POOL_RESTORED,       // pool slot, conn handle
+    TR_POOL_REJECTED,       // pool slot, conn profile, status
+    TR_POOL_DROPPED,        // pool slot, reason
+    TR_SUBSCRIBED,          // request, conn handle, uuid
+    TR_CCCD_MISSING,        // conn handle, uuid
+    TR_CCCD_FAILED,         // conn handle, status
+    TR_DSC_DISC_FAILED,     // conn handle, status
+    TR_STREAM_ENDED,        // conn handle, uuid, readings
+    TR_BACKLOG_START,       // request, conn handle, resumed
+    TR_BACKLOG_SAMPLE,      // sequence number, temperature x100, humidity x100
+    TR_BACKLOG_DONE,        // request, samples, next sequence number
+    TR_BACKLOG_READ_FAILED, // conn handle, status
+    TR_BACKLOG_ACK_FAILED,  // conn handle, status
+    TR_MTU,                 // conn handle, status, ATT MTU
+    TR_PADV_SYNCED,         // registry id or -1, interval ms, phy
+    TR_PADV_SYNC_FAILED,    // registry id or -1, status
+    TR_PADV_LOST,           // registry id or -1, reason
+    TR_PADV_NOT_FOUND,      // no arguments
+    TR_EVENT_COUNT
+} trace_event_t;
+
+typedef struct trace_record_t {
+    uint32_t seq;           // Write index + 1, set once the record is complete
+    uint32_t time_us;       // ZTIMER_USEC timestamp
+    uint16_t event;         // trace_event_t
+    int32_t args[3];
+} trace_record_t;
+
+void trace_record(trace_event_t event, int32_t a0, int32_t a1, int32_t a2);
+void trace_dump(void);
+void trace_clear(void);
+
+int cmd_trace(int argc, char **argv);
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(ev, a0, a1, a2) trace_record(ev, a0, a1, a2)
+#else
+#define TRACE_ERROR(ev, a0, a1, a2) do { } while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(ev, a0, a1, a2) trace_record(ev, a0, a1, a2)
+#else
+#define TRACE_INFO(ev, a0, a1, a2) do { } while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(ev, a0, a1, a2) trace_record(ev, a0, a1, a2)
+#else
+#define TRACE_DEBUG(ev, a0, a1, a2) do { } while (0)
+#endif
+
+#endif /* TRACE_H */
@@ -1,2 +1,2 @@
-make SENSOR_TYPE=0 APPLICATION=temp_sensor_1
-make SENSOR_TYPE=1 APPLICATION=hum_sensor_2
+make APPLICATION=env_sensor_1
+make APPLICATION=env_sensor_2
@@ -0,0 +1,56 @@
+// history.c
+#include <stdint.h>
+#include "mutex.h"
+#include "history.h"
+
+/**
+ * Ring of the last HISTORY_SIZE samples. Every sample gets a sequence
+ * number, so a reader can resume where it stopped and tell how many
+ * samples were overwritten in between.
+ */
+static env_wire_sample_t ring[HISTORY_SIZE];
+static uint32_t next_seq;
+static mutex_t history_lock = MUTEX_INIT;
+
+/**
+ * Record a sample.
+ * returns: sequence number of the sample.
+ */
+uint32_t history_add(const env_wire_sample_t *sample) {
+
+    mutex_lock(&history_lock);
+    uint32_t seq = next_seq++;
+    ring[seq % HISTORY_SIZE] = *sample;
+    mutex_unlock(&history_lock);
+    return seq;
+}
+
+/** Sequence number the next sample will get */
+uint32_t history_next_seq(void) {
+
+    mutex_lock(&history_lock);
+    uint32_t next = next_seq;
+    mutex_unlock(&history_lock);
+    return next;
+}
+
+/**
+ * Copy up to max samples starting at *seq. If that sample was already
+ * overwritten, *seq is moved up to the oldest one held.
+ * returns: number of samples copied.
+ */
+unsigned history_read(uint32_t *seq, env_wire_sample_t *out, unsigned max) {
+
+    mutex_lock(&history_lock);
+    uint32_t first = next_seq > HISTORY_SIZE ? next_seq - HISTORY_SIZE : 0;
+    if (*seq < first) {
+        *seq = first;
+    }
+    unsigned count = 0;
+    while (count < max && *seq + count < next_seq) {
+        out[count] = ring[(*seq + count) % HISTORY_SIZE];
+        count++;
+    }
+    mutex_unlock(&history_lock);
+    return count;
+}
@@ -0,0 +1,17 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+#include "env_wire.h"
+
+// Samples kept in RAM, the oldest is overwritten when full
+#ifndef HISTORY_SIZE
+#define HISTORY_SIZE 256
+#endif
+
+uint32_t history_add(const env_wire_sample_t *sample);
+uint32_t history_next_seq(void);
+unsigned history_read(uint32_t *seq, env_wire_sample_t *out, unsigned max);
+
+#endif /* HISTORY_H */
@@ -1,21 +1,60 @@
 // hts221_sensor.c
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "hts221.h"
 #include "hts221_params.h"
+#include "hts221_regs.h"
 #include "hts221_sensor.h"
 
 #define TEMPERATURE 0
 #define HUMIDITY 1
 
+// Set once the sensor converts on its own at a fixed output data rate
+static bool continuous = false;
+
+/**
+ * Run the HTS221 at a fixed output data rate instead of one-shot
+ * conversions. The query functions then read the latest result directly.
+ * returns: status of the rate change, 0 on success.
+ */
+int start_continuous(hts221_t *dev, uint8_t rate) {
+
+    if (hts221_set_rate(dev, rate) != HTS221_OK) {
+        puts("Error: HTS221 rate change failed");
+        return -1;
+    }
+    continuous = true;
+    return 0;
+}
+
+/**
+ * Query temperature and humidity from a single HTS221 conversion.
+ * returns: status of the read, 0 on success.
+ */
+int query_environment(hts221_t *dev, int16_t *temperature, uint16_t *humidity) {
+
+    if (!continuous && hts221_one_shot(dev) != HTS221_OK) {
+        puts("Error: HTS221 one-shot trigger failed");
+        return -1;
+    }
+    int status;
+    status = hts221_read_temperature(dev, temperature);
+    if (status != HTS221_OK) {
+        return status;
+    }
+    status = hts221_read_humidity(dev, humidity);
+    return status;
+}
+
 /**
  * Query the temperature data of the HTS221 sensor.
  * returns: status of the read, 0 on success.
  */
 int query_temperature(hts221_t *dev, int16_t *temperature) {
 
-    if (hts221_one_shot(dev) != HTS221_OK) {
+    if (!continuous && hts221_one_shot(dev) != HTS221_OK) {
         puts("Error: HTS221 one-shot trigger failed");
         return -1;
     }
@@ -30,7 +69,7 @@ int query_temperature(hts221_t *dev, int16_t *temperature) {
  */
 int query_humidity(hts221_t *dev, uint16_t *humidity) {
 
-    if (hts221_one_shot(dev) != HTS221_OK) {
+    if (!continuous && hts221_one_shot(dev) != HTS221_OK) {
         puts("Error: HTS221 one-shot trigger failed");
         return -1;
     }
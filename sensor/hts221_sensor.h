@@ -10,6 +10,8 @@
 // Function declarations
 int query_temperature(hts221_t *dev, int16_t *temperature);
 int query_humidity(hts221_t *dev, uint16_t *humidity);
+int query_environment(hts221_t *dev, int16_t *temperature, uint16_t *humidity);
+int start_continuous(hts221_t *dev, uint8_t rate);
 hts221_t* create_sensor(void);
 // Added cleanup function
 void destroy_sensor(hts221_t* dev); 
@@ -3,8 +3,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include "hts221_sensor.h"
+#include "history.h"
+#include "env_wire.h"
+#include "hts221_regs.h"
 #include "nimble_riot.h"
 #include "nimble_autoadv.h"
+#include "mutex.h"
+#include "ztimer.h"
 
 #include "host/ble_hs.h"
 #include "host/util/util.h"
@@ -16,30 +21,129 @@
 #define ENV_SENSING_SERVICE_UUID     0x181A
 #define TEMPERATURE_CHAR_UUID        0x2A6E
 #define HUMIDITY_CHAR_UUID           0x2A6F
+#define BACKLOG_CHAR_UUID            BLE_UUID128_DECLARE(ENV_WIRE_BACKLOG_UUID128)
 
-#ifndef SENSOR_TYPE
-#define SENSOR_TYPE 0  
+// How often the reading in the advertisement is refreshed
+#ifndef ADV_REFRESH_MS
+#define ADV_REFRESH_MS 1000
 #endif
 
+// Advertising profiles: a fast burst for ADV_FAST_DURATION_MS after boot, a
+// disconnect or a change of the readings, the slow interval otherwise
+#ifndef ADV_FAST_ITVL_MS
+#define ADV_FAST_ITVL_MS 20
+#endif
+#ifndef ADV_SLOW_ITVL_MS
+#define ADV_SLOW_ITVL_MS 1000
+#endif
+#ifndef ADV_FAST_DURATION_MS
+#define ADV_FAST_DURATION_MS 30000
+#endif
 
-/**Compile time Initilization */
-#if SENSOR_TYPE == 0
-    #define SENSOR_CHAR_UUID 0x2A6E
-    #define SENSOR_ACCESS_CB gatt_svr_chr_access_temperature
-#elif SENSOR_TYPE == 1
-    #define SENSOR_CHAR_UUID 0x2A6F
-    #define SENSOR_ACCESS_CB gatt_svr_chr_access_humidity
+// Change of either reading (x100) that starts a fast burst, 0 to disable
+#ifndef ADV_FAST_ON_CHANGE
+#define ADV_FAST_ON_CHANGE 50
+#endif
+
+// Notification period while a gateway is subscribed, 0 to notify on change only
+#ifndef NOTIFY_INTERVAL_MS
+#define NOTIFY_INTERVAL_MS 1000
+#endif
+
+// Also notify as soon as the reading changes
+#ifndef NOTIFY_ON_CHANGE
+#define NOTIFY_ON_CHANGE 1
+#endif
+
+// Sampling period of the main loop
+#if NOTIFY_INTERVAL_MS > 0 && NOTIFY_INTERVAL_MS < ADV_REFRESH_MS
+#define SAMPLE_PERIOD_MS NOTIFY_INTERVAL_MS
 #else
-    #error "Unknown SENSOR_TYPE"
+#define SAMPLE_PERIOD_MS ADV_REFRESH_MS
 #endif
 
-/**BLE Packet */
-typedef struct packet_t {
-    int16_t reading;
-    uint32_t timestamp;
-} packet_t;
+
+// Period of the samples recorded in the history ring
+#ifndef HISTORY_PERIOD_MS
+#define HISTORY_PERIOD_MS 10000
+#endif
+
+// Serve reads from the latest sample of the main loop instead of converting
+#ifndef CONTINUOUS_SAMPLING
+#define CONTINUOUS_SAMPLING 1
+#endif
+
+// Also broadcast every sample on a periodic advertising train (BLE 5), for
+// any number of gateways synced to it
+#ifndef PERIODIC_ADV
+#define PERIODIC_ADV 0
+#endif
+#ifndef PERIODIC_ADV_ITVL_MS
+#define PERIODIC_ADV_ITVL_MS 1000
+#endif
+
+// HTS221 output data rate fast enough for the sampling period
+#if SAMPLE_PERIOD_MS < 1000
+#define SENSOR_ODR HTS221_REGS_CTRL_REG1_ODR_7HZ
+#else
+#define SENSOR_ODR HTS221_REGS_CTRL_REG1_ODR_1HZ
+#endif
+
+/**Both readings of one HTS221 conversion */
+typedef struct env_sample_t {
+    uint32_t seq;                  // Sample number of the main loop
+    env_wire_sample_t data;
+} env_sample_t;
 
 static hts221_t *sensor_dev = NULL;
+static bool connected = false;
+static uint16_t temp_val_handle;
+static uint16_t hum_val_handle;
+static uint16_t backlog_val_handle;
+// First sample the gateway has not acknowledged, kept across connections
+static uint32_t backlog_acked;
+// Batch of the long read in progress on a connection, served blob by blob
+typedef struct backlog_snap_t {
+    bool in_use;
+    uint16_t conn_handle;
+    uint16_t len;
+    uint8_t batch[ENV_WIRE_BATCH_MAX_LEN];
+} backlog_snap_t;
+static backlog_snap_t backlog_snaps[MYNEWT_VAL(BLE_MAX_CONNECTIONS)];
+// Subscribed gateway, per characteristic
+static uint16_t temp_notify_conn = BLE_HS_CONN_HANDLE_NONE;
+static uint16_t hum_notify_conn = BLE_HS_CONN_HANDLE_NONE;
+static mutex_t adv_lock = MUTEX_INIT;
+// Service data broadcast with the advertisement: ESS UUID, then env_wire_adv_t
+static uint8_t adv_data[2 + ENV_WIRE_ADV_LEN] = {
+    ENV_SENSING_SERVICE_UUID & 0xff, ENV_SENSING_SERVICE_UUID >> 8,
+};
+
+/**Advertising profiles */
+typedef enum adv_profile_t {
+    ADV_PROFILE_FAST,
+    ADV_PROFILE_SLOW,
+} adv_profile_t;
+
+static const struct {
+    const char *name;
+    uint32_t itvl_ms;
+} adv_profiles[] = {
+    [ADV_PROFILE_FAST] = { "fast", ADV_FAST_ITVL_MS },
+    [ADV_PROFILE_SLOW] = { "slow", ADV_SLOW_ITVL_MS },
+};
+
+static nimble_autoadv_cfg_t adv_cfg = {
+    .adv_duration_ms = BLE_HS_FOREVER,
+    .phy = NIMBLE_PHY_1M,
+    .flags = NIMBLE_AUTOADV_FLAG_CONNECTABLE | NIMBLE_AUTOADV_FLAG_LEGACY |
+             NIMBLE_AUTOADV_FLAG_SCANNABLE,
+    .name = CONFIG_NIMBLE_AUTOADV_DEVICE_NAME,
+};
+static adv_profile_t adv_profile = ADV_PROFILE_SLOW;
+static uint32_t adv_fast_until;        // End of the fast burst
+static uint32_t adv_since;             // Advertising since, for the time to connect
+static env_wire_sample_t adv_anchor;   // Readings the last change burst started at
 static int init_sensor(void)
 {
     sensor_dev = create_sensor();
@@ -48,77 +152,172 @@ static int init_sensor(void)
         return -1;
     }
     printf("HTS221 sensor initialized successfully\n");
+#if CONTINUOUS_SAMPLING
+    start_continuous(sensor_dev, SENSOR_ODR);
+#endif
     return 0;
 }
 
 
 
-//TODO: Make gatt_svr_chr_access_temperature & gatt_svr_chr_access_humidity as they are basically the same bar the sensor type use.
-/** Access callback for temperature characteristic */
-static int __attribute__((unused)) gatt_svr_chr_access_temperature(uint16_t conn_handle,
-                                           uint16_t attr_handle,
-                                           struct ble_gatt_access_ctxt *ctxt,
-                                           void *arg)
+/**
+ * Latest sample, double buffered: the main loop fills the idle slot and
+ * then flips sample_idx, so readers never see a half written sample.
+ */
+static env_sample_t sample_cache[2];
+static volatile unsigned sample_idx;
+
+static void cache_store(const env_sample_t *sample)
+{
+    unsigned next = sample_idx ^ 1;
+    sample_cache[next] = *sample;
+    sample_idx = next;
+}
+
+static env_sample_t cache_load(void)
+{
+    env_sample_t sample;
+    unsigned idx;
+    // Retry if the sampler flipped while copying
+    do {
+        idx = sample_idx;
+        sample = sample_cache[idx];
+    } while (idx != sample_idx);
+    return sample;
+}
+
+/** Take temperature and humidity from one conversion */
+static env_sample_t take_sample(void)
+{
+    static uint32_t seq;
+
+    env_sample_t sample = { .seq = seq++ };
+    if (sensor_dev != NULL) {
+        query_environment(sensor_dev, &sample.data.temperature, &sample.data.humidity);
+    }
+    /* get timestamp in ms */
+    sample.data.timestamp = ztimer_now(ZTIMER_MSEC);
+    return sample;
+}
+
+/** Reading of the sample served by a characteristic */
+static int16_t sample_value(const env_sample_t *sample, uint16_t chr_uuid)
+{
+    return chr_uuid == TEMPERATURE_CHAR_UUID ? sample->data.temperature
+                                             : (int16_t)sample->data.humidity;
+}
+
+/** Characteristic value of one reading of the sample, an env_wire_reading_t */
+static size_t sample_encode(const env_sample_t *sample, uint16_t chr_uuid, uint8_t *buf)
+{
+    return env_wire_reading_encode(buf, sample->seq, sample->data.timestamp,
+                                   sample_value(sample, chr_uuid));
+}
+
+/**
+ * Access callback for both characteristics, arg holds the characteristic
+ * UUID being read.
+ */
+static int gatt_svr_chr_access_sensor(uint16_t conn_handle,
+                                      uint16_t attr_handle,
+                                      struct ble_gatt_access_ctxt *ctxt,
+                                      void *arg)
 {
     (void)conn_handle;
     (void)attr_handle;
-    (void)arg;
-    
+
     int rc = 0;
     switch (ctxt->op) {
     case BLE_GATT_ACCESS_OP_READ_CHR:
     {
-        packet_t pkt = {0};
-
-        if (sensor_dev != NULL) {
-            int status = query_temperature(sensor_dev, &pkt.reading);
-            if (status == 0) {
-                printf("Temperature: %d \n", pkt.reading);
-            }
-            else {
-                printf("Sensor read failed, fallback temp: %d\n", pkt.reading);
-            }
-        }
-
-        /* get timestamp in ms */
-        pkt.timestamp = ztimer_now(ZTIMER_MSEC);
-
-        rc = os_mbuf_append(ctxt->om, &pkt, sizeof(pkt));
+#if CONTINUOUS_SAMPLING
+        // No conversion while the gateway waits for the ATT response
+        env_sample_t sample = cache_load();
+#else
+        env_sample_t sample = take_sample();
+#endif
+        uint8_t buf[ENV_WIRE_READING_LEN];
+        size_t len = sample_encode(&sample, (uint16_t)(uintptr_t)arg, buf);
+        rc = os_mbuf_append(ctxt->om, buf, len);
     }
     break;
     }
     return rc;
 }
 
-/** Access callback for humidity characteristic */
-static int __attribute__((unused)) gatt_svr_chr_access_humidity(uint16_t conn_handle,
-                                        uint16_t attr_handle,
-                                        struct ble_gatt_access_ctxt *ctxt,
-                                        void *arg)
+/**
+ * Snapshot of the backlog batch for a connection, the slot of another
+ * connection is taken over if none is free.
+ */
+static backlog_snap_t *backlog_snap(uint16_t conn_handle)
+{
+    backlog_snap_t *free_snap = &backlog_snaps[0];
+    for (unsigned i = 0; i < sizeof(backlog_snaps) / sizeof(backlog_snaps[0]); i++) {
+        backlog_snap_t *s = &backlog_snaps[i];
+        if (s->in_use && s->conn_handle == conn_handle) return s;
+        if (!s->in_use) free_snap = s;
+    }
+    free_snap->in_use = true;
+    free_snap->conn_handle = conn_handle;
+    free_snap->len = 0;
+    return free_snap;
+}
+
+static void backlog_snap_release(uint16_t conn_handle)
+{
+    for (unsigned i = 0; i < sizeof(backlog_snaps) / sizeof(backlog_snaps[0]); i++) {
+        if (backlog_snaps[i].conn_handle == conn_handle) {
+            backlog_snaps[i].in_use = false;
+        }
+    }
+}
+
+/**
+ * Backlog characteristic: a read returns a batch of the samples from the
+ * last acknowledged one on, a 4 byte write acknowledges every sample before
+ * the given sequence number. Long reads call this once per blob, and the
+ * ring may overwrite the first samples of the batch in between: the batch
+ * is encoded once at offset 0 and later blobs are cut from that snapshot.
+ */
+static int gatt_svr_chr_access_backlog(uint16_t conn_handle,
+                                       uint16_t attr_handle,
+                                       struct ble_gatt_access_ctxt *ctxt,
+                                       void *arg)
 {
-    (void)conn_handle;
     (void)attr_handle;
     (void)arg;
-        
+
+    // Host task only, too big for its stack
+    static env_wire_sample_t samples[ENV_WIRE_BATCH_MAX_SAMPLES];
+
     int rc = 0;
     switch (ctxt->op) {
     case BLE_GATT_ACCESS_OP_READ_CHR:
     {
-        packet_t pkt = {0};
-
-        if (sensor_dev != NULL) {
-            int status = query_humidity(sensor_dev, (uint16_t *)&pkt.reading);
-            if (status == 0) {
-                printf("Humidity: %d \n", pkt.reading);
-            }
-            else {
-                printf("Sensor read failed, fallback humidity: %d\n", pkt.reading);
-            }
+        backlog_snap_t *snap = backlog_snap(conn_handle);
+        // A blob without a snapshot, e.g. after a reconnect, starts one too
+        if (ctxt->offset == 0 || snap->len == 0) {
+            uint32_t first = backlog_acked;
+            unsigned n = history_read(&first, samples, ENV_WIRE_BATCH_MAX_SAMPLES);
+            unsigned count;
+            snap->len = env_wire_batch_encode(snap->batch, sizeof(snap->batch), samples, n,
+                                              first, history_next_seq(), &count);
+        }
+        // The host cuts the blob at ctxt->offset from the whole value
+        if (os_mbuf_append(ctxt->om, snap->batch, snap->len) != 0) {
+            rc = BLE_ATT_ERR_INSUFFICIENT_RES;
         }
-
-        pkt.timestamp = ztimer_now(ZTIMER_MSEC);
-
-        rc = os_mbuf_append(ctxt->om, &pkt, sizeof(pkt));
+    }
+    break;
+    case BLE_GATT_ACCESS_OP_WRITE_CHR:
+    {
+        uint8_t ack[4];
+        uint16_t len;
+        if (OS_MBUF_PKTLEN(ctxt->om) != sizeof(ack) ||
+            ble_hs_mbuf_to_flat(ctxt->om, ack, sizeof(ack), &len) != 0) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        backlog_acked = env_wire_get32(ack);
     }
     break;
     }
@@ -133,9 +332,26 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
         .characteristics = (struct ble_gatt_chr_def[]) {
             {
                 /* Temperature characteristic */
-                .uuid = BLE_UUID16_DECLARE(SENSOR_CHAR_UUID),
-                .access_cb = SENSOR_ACCESS_CB,
-                .flags = BLE_GATT_CHR_F_READ,
+                .uuid = BLE_UUID16_DECLARE(TEMPERATURE_CHAR_UUID),
+                .access_cb = gatt_svr_chr_access_sensor,
+                .arg = (void *)(uintptr_t)TEMPERATURE_CHAR_UUID,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &temp_val_handle,
+            },
+            {
+                /* Humidity characteristic */
+                .uuid = BLE_UUID16_DECLARE(HUMIDITY_CHAR_UUID),
+                .access_cb = gatt_svr_chr_access_sensor,
+                .arg = (void *)(uintptr_t)HUMIDITY_CHAR_UUID,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &hum_val_handle,
+            },
+            {
+                /* Sample history */
+                .uuid = BACKLOG_CHAR_UUID,
+                .access_cb = gatt_svr_chr_access_backlog,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+                .val_handle = &backlog_val_handle,
             },
             { 0 } 
         }
@@ -143,6 +359,246 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
     { 0 } 
 };
 
+/**
+ * Set the advertising fields, including the latest reading as ESS service
+ * data so the gateway can read it without connecting.
+ */
+static void adv_set_fields(void)
+{
+    // Flags and device name are added by nimble_autoadv itself
+
+    // Characteristic UUIDs served
+    uint16_t service_uuids[] = { TEMPERATURE_CHAR_UUID, HUMIDITY_CHAR_UUID };
+    nimble_autoadv_add_field(BLE_HS_ADV_TYPE_COMP_UUIDS16, service_uuids, sizeof(service_uuids));
+
+    // Latest readings
+    if (nimble_autoadv_add_field(BLE_HS_ADV_TYPE_SVC_DATA_UUID16, adv_data,
+                                 sizeof(adv_data)) != 0) {
+        puts("Warning: no room for the reading in the advertisement");
+    }
+}
+
+/** Advertise with the interval of the current profile, adv_lock held */
+static void adv_configure(void)
+{
+    adv_cfg.adv_itv_ms = adv_profiles[adv_profile].itvl_ms;
+    nimble_autoadv_cfg_update(&adv_cfg);
+}
+
+/**
+ * Switch the advertising profile, a fast burst starts over if already fast.
+ * returns: true if the interval changed and advertising must be restarted.
+ */
+static bool adv_enter(adv_profile_t profile, const char *reason)
+{
+    mutex_lock(&adv_lock);
+    bool changed = profile != adv_profile;
+    adv_profile = profile;
+    if (profile == ADV_PROFILE_FAST) {
+        adv_fast_until = ztimer_now(ZTIMER_MSEC) + ADV_FAST_DURATION_MS;
+        printf("[ADV] %s: fast profile, %lu ms interval for %lu ms\n", reason,
+               (unsigned long)ADV_FAST_ITVL_MS, (unsigned long)ADV_FAST_DURATION_MS);
+    } else {
+        printf("[ADV] %s: slow profile, %lu ms interval\n", reason,
+               (unsigned long)ADV_SLOW_ITVL_MS);
+    }
+    mutex_unlock(&adv_lock);
+    return changed;
+}
+
+/** (Re)start advertising unless a gateway is connected */
+static void adv_start(void)
+{
+    mutex_lock(&adv_lock);
+    if (!connected) {
+        nimble_autoadv_stop();
+        adv_configure();
+        nimble_autoadv_start(NULL);
+    }
+    mutex_unlock(&adv_lock);
+}
+
+/** Put a sample into the advertisement */
+static void adv_refresh(const env_sample_t *sample)
+{
+    mutex_lock(&adv_lock);
+    env_wire_adv_encode(&adv_data[2], &sample->data);
+
+    nimble_autoadv_stop();
+    nimble_autoadv_reset();
+    adv_set_fields();
+    if (!connected) {
+        adv_configure();
+        nimble_autoadv_start(NULL);
+    }
+    mutex_unlock(&adv_lock);
+}
+
+/**
+ * Start a fast burst when a reading moved by ADV_FAST_ON_CHANGE, and fall
+ * back to the slow profile once the burst is over.
+ */
+static void adv_profile_update(const env_sample_t *sample)
+{
+    const env_wire_sample_t *s = &sample->data;
+
+    if (ADV_FAST_ON_CHANGE > 0 && !connected &&
+        (abs(s->temperature - adv_anchor.temperature) >= ADV_FAST_ON_CHANGE ||
+         abs(s->humidity - adv_anchor.humidity) >= ADV_FAST_ON_CHANGE)) {
+        adv_anchor = *s;
+        if (adv_enter(ADV_PROFILE_FAST, "change")) {
+            adv_start();
+        }
+        return;
+    }
+    if (adv_profile == ADV_PROFILE_FAST && (int32_t)(s->timestamp - adv_fast_until) >= 0) {
+        adv_enter(ADV_PROFILE_SLOW, "burst over");
+        adv_start();
+    }
+}
+
+#if PERIODIC_ADV
+#if !MYNEWT_VAL(BLE_PERIODIC_ADV)
+#error "PERIODIC_ADV needs nimble_adv_ext with BLE_PERIODIC_ADV enabled"
+#endif
+
+// nimble_autoadv owns instance 0
+#define PADV_INSTANCE 1
+// Extended advertising carrying the sync info, slow: a gateway only needs
+// it once to find the train
+#define PADV_EXT_ITVL_MS 1000
+
+#if IS_USED(MODULE_NIMBLE_PHY_CODED)
+#define PADV_PHY BLE_HCI_LE_PHY_CODED
+#else
+#define PADV_PHY BLE_HCI_LE_PHY_1M
+#endif
+
+static bool padv_running;
+// Periodic advertising data: ESS service data with an env_wire_padv_t
+static uint8_t padv_data[4 + ENV_WIRE_PADV_LEN] = {
+    3 + ENV_WIRE_PADV_LEN, BLE_HS_ADV_TYPE_SVC_DATA_UUID16,
+    ENV_SENSING_SERVICE_UUID & 0xff, ENV_SENSING_SERVICE_UUID >> 8,
+};
+
+/**
+ * Start the periodic advertising train. It runs non-connectable on its own
+ * advertising set next to the legacy advertisement, connected or not.
+ * returns: 0 on success, NimBLE error otherwise.
+ */
+static int padv_start(const env_sample_t *sample)
+{
+    struct ble_gap_ext_adv_params params = {
+        .own_addr_type = nimble_riot_own_addr_type,
+        .itvl_min = BLE_GAP_ADV_ITVL_MS(PADV_EXT_ITVL_MS),
+        .itvl_max = BLE_GAP_ADV_ITVL_MS(PADV_EXT_ITVL_MS),
+        .primary_phy = PADV_PHY,
+        .secondary_phy = PADV_PHY,
+        .tx_power = 127,
+        .sid = ENV_WIRE_PADV_SID,
+    };
+    struct ble_gap_periodic_adv_params pparams = {
+        .itvl_min = BLE_GAP_PERIODIC_ITVL_MS(PERIODIC_ADV_ITVL_MS),
+        .itvl_max = BLE_GAP_PERIODIC_ITVL_MS(PERIODIC_ADV_ITVL_MS),
+    };
+
+    // Name and served UUIDs, so a gateway that only hears this set (e.g. on
+    // coded PHY) still registers the node
+    static const char name[] = CONFIG_NIMBLE_AUTOADV_DEVICE_NAME;
+    uint8_t ext_data[6 + 2 + sizeof(name) - 1] = {
+        5, BLE_HS_ADV_TYPE_COMP_UUIDS16,
+        TEMPERATURE_CHAR_UUID & 0xff, TEMPERATURE_CHAR_UUID >> 8,
+        HUMIDITY_CHAR_UUID & 0xff, HUMIDITY_CHAR_UUID >> 8,
+        sizeof(name), BLE_HS_ADV_TYPE_COMP_NAME,
+    };
+    memcpy(&ext_data[8], name, sizeof(name) - 1);
+
+    env_wire_padv_encode(&padv_data[4], sample->seq, &sample->data);
+
+    int rc = ble_gap_ext_adv_configure(PADV_INSTANCE, &params, NULL, NULL, NULL);
+    if (rc == 0) rc = ble_gap_ext_adv_set_data(PADV_INSTANCE,
+                                               ble_hs_mbuf_from_flat(ext_data, sizeof(ext_data)));
+    if (rc == 0) rc = ble_gap_periodic_adv_configure(PADV_INSTANCE, &pparams);
+    if (rc == 0) rc = ble_gap_periodic_adv_set_data(PADV_INSTANCE,
+                                                    ble_hs_mbuf_from_flat(padv_data, sizeof(padv_data)));
+    if (rc == 0) rc = ble_gap_periodic_adv_start(PADV_INSTANCE);
+    if (rc == 0) rc = ble_gap_ext_adv_start(PADV_INSTANCE, 0, 0);
+    if (rc != 0) {
+        printf("[ADV] Periodic advertising failed to start: %d\n", rc);
+        return rc;
+    }
+
+    padv_running = true;
+    printf("[ADV] Periodic advertising, SID %d, %lu ms interval on %s PHY\n",
+           ENV_WIRE_PADV_SID, (unsigned long)PERIODIC_ADV_ITVL_MS,
+           PADV_PHY == BLE_HCI_LE_PHY_CODED ? "coded" : "1M");
+    return 0;
+}
+
+/** Put a sample into the periodic advertising train */
+static void padv_refresh(const env_sample_t *sample)
+{
+    if (!padv_running) return;
+
+    mutex_lock(&adv_lock);
+    env_wire_padv_encode(&padv_data[4], sample->seq, &sample->data);
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(padv_data, sizeof(padv_data));
+    if (om == NULL) {
+        puts("Warning: no buffer for periodic advertising data");
+    } else if (ble_gap_periodic_adv_set_data(PADV_INSTANCE, om) != 0) {
+        puts("Warning: periodic advertising data not updated");
+    }
+    mutex_unlock(&adv_lock);
+}
+#endif /* PERIODIC_ADV */
+
+/** Notification state of one characteristic */
+typedef struct notify_state_t {
+    uint16_t chr_uuid;
+    uint16_t *val_handle;
+    uint16_t *conn;
+    int16_t last_reading;
+    uint32_t last_notify;
+} notify_state_t;
+
+static notify_state_t notify_states[] = {
+    { TEMPERATURE_CHAR_UUID, &temp_val_handle, &temp_notify_conn, 0, 0 },
+    { HUMIDITY_CHAR_UUID, &hum_val_handle, &hum_notify_conn, 0, 0 },
+};
+
+/**
+ * Notify the subscribed gateway every NOTIFY_INTERVAL_MS, or as soon as the
+ * reading changes if NOTIFY_ON_CHANGE is set.
+ */
+static void notify_update(const env_sample_t *sample)
+{
+    for (unsigned i = 0; i < sizeof(notify_states) / sizeof(notify_states[0]); i++) {
+        notify_state_t *n = &notify_states[i];
+        uint16_t conn = *n->conn;
+        if (conn == BLE_HS_CONN_HANDLE_NONE) continue;
+
+        int16_t reading = sample_value(sample, n->chr_uuid);
+        uint32_t timestamp = sample->data.timestamp;
+        bool due = NOTIFY_INTERVAL_MS > 0 &&
+                   timestamp - n->last_notify >= NOTIFY_INTERVAL_MS;
+        bool changed = NOTIFY_ON_CHANGE && reading != n->last_reading;
+        if (!due && !changed) continue;
+
+        uint8_t buf[ENV_WIRE_READING_LEN];
+        size_t len = sample_encode(sample, n->chr_uuid, buf);
+        struct os_mbuf *om = ble_hs_mbuf_from_flat(buf, len);
+        if (om == NULL) {
+            puts("Warning: no buffer for notification");
+            return;
+        }
+
+        if (ble_gatts_notify_custom(conn, *n->val_handle, om) == 0) {
+            n->last_reading = reading;
+            n->last_notify = timestamp;
+        }
+    }
+}
+
 // GAP event handler - called for connection/disconnection events 
 static int gap_event_handler(struct ble_gap_event *event, void *arg)
 {
@@ -152,17 +608,36 @@ static int gap_event_handler(struct ble_gap_event *event, void *arg)
     switch (event->type) {
     case BLE_GAP_EVENT_CONNECT:
         if (event->connect.status == 0) {
-            printf("Device connected\n");
+            printf("Device connected after %lu ms of %s advertising\n",
+                   (unsigned long)(ztimer_now(ZTIMER_MSEC) - adv_since),
+                   adv_profiles[adv_profile].name);
+            connected = true;
         } else {
             printf("Connection failed; status=%d\n", event->connect.status);
             /* Restart advertising on connection failure */
-            nimble_autoadv_start(NULL);
+            adv_start();
         }
         break;
     case BLE_GAP_EVENT_DISCONNECT:
         printf("Device disconnected; reason=%d\n", event->disconnect.reason);
-        /* Restart advertising after disconnection */
-        nimble_autoadv_start(NULL);
+        connected = false;
+        backlog_snap_release(event->disconnect.conn.conn_handle);
+        temp_notify_conn = BLE_HS_CONN_HANDLE_NONE;
+        hum_notify_conn = BLE_HS_CONN_HANDLE_NONE;
+        /* Restart advertising after disconnection, fast so the next query finds us */
+        adv_since = ztimer_now(ZTIMER_MSEC);
+        adv_enter(ADV_PROFILE_FAST, "disconnect");
+        adv_start();
+        break;
+    case BLE_GAP_EVENT_SUBSCRIBE:
+        for (unsigned i = 0; i < sizeof(notify_states) / sizeof(notify_states[0]); i++) {
+            notify_state_t *n = &notify_states[i];
+            if (event->subscribe.attr_handle != *n->val_handle) continue;
+            printf("Notifications for 0x%04X %s\n", n->chr_uuid,
+                   event->subscribe.cur_notify ? "enabled" : "disabled");
+            *n->conn = event->subscribe.cur_notify ? event->subscribe.conn_handle
+                                                   : BLE_HS_CONN_HANDLE_NONE;
+        }
         break;
     case BLE_GAP_EVENT_ADV_COMPLETE:
         printf("Advertising complete; reason=%d\n", event->adv_complete.reason);
@@ -194,22 +669,42 @@ int main(void)
     /* Set GAP event handler using the correct API */
     nimble_autoadv_set_gap_cb(gap_event_handler, NULL);
     
-    // Add advertising data fields 
-    // Flags field 
-    uint8_t flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
-    nimble_autoadv_add_field(BLE_HS_ADV_TYPE_FLAGS, &flags, sizeof(flags));
-    
-    // Service UUID 
-    uint16_t service_uuid = SENSOR_CHAR_UUID;
-    nimble_autoadv_add_field(BLE_HS_ADV_TYPE_COMP_UUIDS16, &service_uuid, sizeof(service_uuid));
-    
-    // Device name in scan response
-    const char* device_name = "RIOT-EnvSensor";
-    nimble_autoadv_add_field(BLE_HS_ADV_TYPE_COMP_NAME, device_name, strlen(device_name));
-
-    // Start advertising using nimble_autoadv
-    nimble_autoadv_start(NULL);
+    // Add advertising data fields and start advertising using nimble_autoadv
+    env_sample_t sample = take_sample();
+    uint32_t last_adv = sample.data.timestamp;
+    uint32_t last_history = sample.data.timestamp;
+    cache_store(&sample);
+    history_add(&sample.data);
+    adv_anchor = sample.data;
+    adv_since = sample.data.timestamp;
+    adv_enter(ADV_PROFILE_FAST, "boot");
+    adv_refresh(&sample);
+#if PERIODIC_ADV
+    padv_start(&sample);
+#endif
     
     printf("Advertising Started");
+
+    // Sample, stream to a subscribed gateway and keep the advertisement fresh
+    while (1) {
+        ztimer_sleep(ZTIMER_MSEC, SAMPLE_PERIOD_MS);
+
+        sample = take_sample();
+        cache_store(&sample);
+
+        notify_update(&sample);
+#if PERIODIC_ADV
+        padv_refresh(&sample);
+#endif
+        adv_profile_update(&sample);
+        if (sample.data.timestamp - last_history >= HISTORY_PERIOD_MS) {
+            history_add(&sample.data);
+            last_history = sample.data.timestamp;
+        }
+        if (sample.data.timestamp - last_adv >= ADV_REFRESH_MS) {
+            adv_refresh(&sample);
+            last_adv = sample.data.timestamp;
+        }
+    }
     return 0;
 }